@@ -1,4 +1,13 @@
 #include<bits/stdc++.h>
+#include<sys/stat.h>
+#ifdef _WIN32
+#include<direct.h>
+#endif
+#ifdef __linux__
+#include<sys/inotify.h>
+#include<poll.h>
+#include<unistd.h>
+#endif
 using namespace std;
 
 //    Delimeter for parsing dates Dates are always given in d/m/yyyy format
@@ -8,6 +17,118 @@ const char DATEDELIMETER = '/';
 //    is written seperated by this Delimeter
 const char DELIMETER = ';';
 
+//    Width in bytes (newline included) of one record slot in trips.txt.
+//    Trips are changed in place when they are started and completed, so their
+//    file is kept in fixed-width slots and an update only rewrites the slot of
+//    the trip. The table remembers each trip's slot. Set to 0 to use plain lines.
+const size_t TRIPRECORDWIDTH = 128;
+
+//    Character used to pad a record up to its fixed width
+const char RECORDPADDING = ' ';
+
+//    Completed trips whose end date is older than this many days are moved
+//    out of trips.txt into compressed archive segments when the database loads
+//    and once a day while it stays open
+const long ARCHIVEAFTERDAYS = 180;
+
+//    Fewest trips a new archive segment is written for, fewer wait in
+//    trips.txt until more are due
+const size_t ARCHIVEMINTRIPS = 256;
+
+//    Archive segments are stored as trips.archive.1, trips.archive.2, ...
+const string TRIPARCHIVEPREFIX = "trips.archive.";
+
+//    Records a backup reads from a table at a time. The table is locked while
+//    they are formatted, and at most this many are held in memory for it.
+const size_t BACKUPCHUNKRECORDS = 4096;
+
+//    When set, the menu appends every add and update to mutations.log in
+//    its location, from where follower processes replicate it
+const bool SHIPMUTATIONLOG = true;
+
+//    Number of availability search results kept by each database
+const size_t AVAILABILITYCACHESIZE = 256;
+
+//    How often a follower looks for new entries in the mutation log
+const int FOLLOWERPOLLMILLISECONDS = 200;
+
+//    When set, the menu watches vehicle.txt and users.txt and takes in the
+//    lines other programs append to them, or the whole file when they replace
+//    it, without a restart. Where inotify is missing the files are looked at
+//    this often, with inotify this is how long stopping the watcher can take.
+const bool HOTRELOAD = true;
+const int RELOADPOLLMILLISECONDS = 500;
+
+//    In sharded mode vehicles and their trips are partitioned by this many
+//    leading characters of the registration number (the state code)
+const size_t SHARDKEYLENGTH = 2;
+
+//    When set, mutations only change the tables in memory and the files are
+//    written by a background persistence thread. Database::flush() waits
+//    until everything handed to it is on disk.
+const bool ASYNCPERSISTENCE = true;
+
+//    When set, users are kept in users.db, a paged B+tree, instead of being
+//    loaded from users.txt. Only users that trips refer to or that are looked
+//    up are held in memory. An existing users.txt is imported on first use.
+const bool PAGEDUSERS = false;
+
+//    In paged mode, users read from users.db that no trip refers to are
+//    dropped from memory again, oldest first, once more than this many were
+//    read. A user returned by a lookup stays valid for at least this many
+//    further lookups.
+const size_t RESIDENTUSERS = 1 << 14;
+
+//    Size of a page of users.db and the number of pages kept in memory
+const size_t USERPAGESIZE = 4096;
+const size_t USERPAGECACHE = 256;
+
+//    Deleted records stay in memory as tombstones until a table holds this
+//    many of them, then the tables are compacted in the background
+const size_t COMPACTAFTERTOMBSTONES = 1024;
+
+//    Set-based updates of tables with at least this many records match and
+//    change the records on several threads
+const size_t PARALLELUPDATERECORDS = 1 << 14;
+
+//    How often the telemetry thread takes the queued odometer readings
+const int TELEMETRYBATCHMILLISECONDS = 10;
+
+//    The running program takes in odometer readings that telemetry units
+//    append to this file in its location, one "registration;odometer;timestamp"
+//    per line, and looks for new lines this often
+const char *const TELEMETRYFEED = "telemetry.txt";
+const int TELEMETRYFEEDMILLISECONDS = 200;
+
+//    Number of spans each thread keeps for tracing, older ones are overwritten
+const size_t TRACEBUFFERSPANS = 1 << 14;
+
+//    Setting this environment variable to a file name turns tracing on and
+//    writes the spans there in Chrome trace format when the program exits
+const char *const TRACEENVIRONMENT = "VMS_TRACE";
+
+//    Setting this environment variable to a file name records every call made
+//    to a database there, for replaying the same operations later
+const char *const WORKLOADENVIRONMENT = "VMS_RECORD";
+
+//    Bytes of recorded calls collected before they are written to the file
+const size_t WORKLOADBUFFERSIZE = 1 << 16;
+
+//    Days after today the async benchmark starts booking and how many days
+//    each of its runs spreads the bookings over
+const long BENCHMARKFIRSTDAY = 3650;
+const long BENCHMARKDAYS = 365;
+
+//    Marks the rest of the enclosing scope as a span named by a string literal.
+//    Building with -DVMS_NO_TRACING removes every span from the program.
+#ifndef VMS_NO_TRACING
+#define TRACE_SPAN_NAME(line) traceSpan##line
+#define TRACE_SPAN_AT(name, line) TraceSpan TRACE_SPAN_NAME(line)(name)
+#define TRACE_SPAN(name) TRACE_SPAN_AT(name, __LINE__)
+#else
+#define TRACE_SPAN(name)
+#endif
+
 
 // Abstract class that is the parent of entity class
 // it provides a toString method which have different implementation for every junior class
@@ -15,6 +136,8 @@ class Issuable
 {
     public:
     virtual string toString() const = 0 ;
+    // records are freed through pointers to their base by the tables
+    virtual ~Issuable() {}
 };
 
 //Entity class signifies all the storable entities in the system namely vehicle, trips, users.
@@ -22,10 +145,13 @@ class Entity: public Issuable{
 protected:
     //recordID of that particular Entity
     long recordId;
+    // set when the record was deleted but is still held as a tombstone
+    bool deleted;
 public:
     // parameterized constructor for setting the recordId
     Entity(long recordId){
         this->recordId = recordId;
+        this->deleted = false;
     }
 
     //accessor function for getting the recordId
@@ -33,6 +159,11 @@ public:
         return this->recordId;
     }
 
+    //scans skip records for which this is true
+    bool isDeleted() const{
+        return this->deleted;
+    }
+
     // virtual method that helps setting data from a desired entity to the current entity.
     // Each entity have its own implementation of setDataFrom method
     virtual void setDataFrom(Entity *s) = 0;
@@ -44,6 +175,9 @@ public:
     // setting the Database class to be the friend of Entity class
     // Table can now access all methods of Entity class.
     friend class Database;
+
+    // the schema of every entity names the fields its files hold
+    template<typename T> friend struct EntitySchema;
 };
 
 //Error class for defining custom Exceptions
@@ -82,6 +216,36 @@ class IOError : public Error
     public:
     //Default constructor which sets the message by calling parent constructor
     IOError() : Error ("I/O Error could not open or process file make sure 'vehicle.txt', 'trips.txt, and 'users.txt' files exist in this directory") {};
+    protected:
+    IOError(string message) : Error (message) {};
+};
+
+//Signifies a change attempted on a read-only replica of the database
+class ReadOnlyError : public IOError
+{
+    public:
+    ReadOnlyError() : IOError ("This database is a read-only replica") {};
+};
+
+//Signifies a backup that could not be started or written
+class BackupError : public IOError
+{
+    public:
+    BackupError(string message) : IOError ("Backup failed: " + message) {};
+};
+
+//Signifies the deletion of a vehicle or user that still has trips
+class RecordInUseError : public Error
+{
+    public:
+    RecordInUseError() : Error ("The record still has trips and cannot be deleted") {};
+};
+
+//Signifies a query that cannot be compiled, the message says why
+class QueryError : public Error
+{
+    public:
+    QueryError(string message) : Error ("Query error: " + message) {};
 };
 
 //Signifies Memory Errors in programm
@@ -96,6 +260,160 @@ class DateParsingError: public Error
 {
     public: DateParsingError(): Error("Incorrect date format"){};
 };
+
+//A finished span, times are in nanoseconds on the steady clock
+struct TraceEvent
+{
+    const char *name;
+    long long start;
+    long long duration;
+};
+
+//Ring of the latest spans of one thread. Only its own thread writes to it,
+//the lock is there for a dump running at the same time.
+struct TraceBuffer
+{
+    long threadId;
+    vector<TraceEvent> events;
+    size_t recorded;
+    mutex lock;
+};
+
+//Collects spans from every thread and writes them out as Chrome trace JSON,
+//which chrome://tracing and Perfetto open directly
+class Tracer
+{
+    static atomic<bool> enabled;
+    static mutex buffersLock;
+    static vector<shared_ptr<TraceBuffer>> buffers;
+    static TraceBuffer &localBuffer();
+    static void dumpAtExit();
+
+public:
+    static void enable(bool on);
+    static bool isEnabled();
+    static void enableFromEnvironment();
+    static long long now();
+    static void record(const char *name, long long start, long long end);
+    static void dump(ostream &out);
+    static void dumpToFile(const string &fileName) throw(IOError);
+};
+
+//Records the time from its construction to its destruction as a span.
+//When tracing is off it only reads one flag.
+class TraceSpan
+{
+    const char *name;
+    long long start;
+
+public:
+    TraceSpan(const char *name);
+    ~TraceSpan();
+};
+
+//Calls of a database the workload recorder writes down. The numbers are
+//stored in traces and must not change.
+typedef enum {
+    callUnrecorded = 0,
+    callGetVehicle = 1,
+    callFindVehicles = 2,
+    callGetUser = 3,
+    callGetUserForId = 4,
+    callTripsForUser = 5,
+    callTripsForVehicle = 6,
+    callAdd = 7,
+    callUpdate = 8,
+    callDelete = 9,
+    callBookBatch = 10,
+    callSearchVehicles = 11,
+    callSearchUsers = 12,
+    callTripsStarting = 13,
+    callTripsEnding = 14,
+    callTripsActiveOn = 15,
+    callUpdateWhere = 16
+} WorkloadOperation;
+
+//A call read back from a trace. Times are in nanoseconds, start from the
+//first call of the trace. Number arguments are given as text.
+struct WorkloadCall
+{
+    WorkloadOperation operation;
+    long long start;
+    long long latency;
+    vector<string> arguments;
+};
+
+//Writes the calls made to databases to a compact binary trace. After the
+//magic every call is its operation, its start as a zigzag varint delta to
+//the start of the call before, its latency, its argument count and each
+//argument as a tag (0 number, 1 text) followed by a zigzag varint or a
+//length and the bytes. Calls are written in the order they finish.
+class WorkloadRecorder
+{
+    static atomic<bool> enabled;
+    static mutex lock;
+    static FILE *out;
+    static string pending;
+    // start of the call written last, -1 before the first
+    static long long previous;
+    static void flushAtExit();
+
+public:
+    static bool isEnabled();
+    static void enable(const string &fileName) throw(IOError);
+    static void enableFromEnvironment();
+    static void record(WorkloadOperation operation, long long start, long long end, int count, const string &arguments);
+    static void flush();
+    static void read(const string &fileName, vector<WorkloadCall> &calls) throw(IOError);
+};
+
+//Records one call from its construction to its destruction. Calls that a
+//recorded call makes on the same thread belong to it and are not recorded,
+//callUnrecorded marks work whose inner calls are never recorded at all.
+//When recording is off it only reads one flag.
+class RecordedCall
+{
+    WorkloadOperation operation;
+    long long start;
+    int count;
+    string arguments;
+
+    static int &depth();
+public:
+    RecordedCall(WorkloadOperation operation);
+    ~RecordedCall();
+    bool isRecording() const;
+    void text(const string &value);
+    void number(long long value);
+};
+
+//Counts of latencies in buckets a quarter of a power of two wide, so a
+//percentile read from it is within a fifth of the real value
+struct LatencyHistogram
+{
+    vector<long long> counts;
+    long long total;
+    long long maximum;
+
+    LatencyHistogram();
+    static size_t bucketOf(long long nanoseconds);
+    static long long bucketStart(size_t bucket);
+    void add(long long nanoseconds);
+    void merge(const LatencyHistogram &other);
+    long long percentile(double fraction) const;
+    void print(ostream &out) const;
+};
+
+//Outcome of replaying a workload. Calls that threw count as failed, they
+//are usually records the trace's data files had and the copy lacks.
+struct ReplayReport
+{
+    long long calls;
+    long long failures;
+    double seconds;
+    LatencyHistogram recorded;
+    LatencyHistogram replayed;
+};
 //A helper method which helps spliting the string given a delimeter
 //Splits the string based of a given delimeter and returns the splited string as a vector of strings.
 vector <string> split (const string &s, char delimiter) throw(DateParsingError)
@@ -115,25 +433,182 @@ vector <string> split (const string &s, char delimiter) throw(DateParsingError)
     return tokens ;
 }
 
+//A helper method that strips the padding of a fixed-width record slot
+//and a trailing carriage return left behind by files edited on Windows.
+string trimRecord (const string &s)
+{
+    size_t end = s.find_last_not_of (string (1, RECORDPADDING) + "\r");
+    if (end == string::npos)
+    {
+        return "";
+    }
+    return s.substr (0, end + 1);
+}
+
+//Moves a fully written temporary file over fileName. Returns false when
+//that fails.
+bool replaceFile (const string &temporary, const string &fileName)
+{
+    if (rename (temporary.c_str (), fileName.c_str ()) == 0)
+    {
+        return true;
+    }
+    // rename does not replace an existing file on Windows
+    remove (fileName.c_str ());
+    return rename (temporary.c_str (), fileName.c_str ()) == 0;
+}
+
+//Appends the decimal digits of a number without going through a stream
+void appendNumber (string &out, long long value)
+{
+    char digits[24];
+    char *at = digits + sizeof digits;
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long) value : value;
+    do
+    {
+        *--at = char ('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0)
+    {
+        *--at = '-';
+    }
+    out.append (at, digits + sizeof digits - at);
+}
+
+//Reads a number from the start of a field the way stol does: leading
+//blanks and a sign are allowed, whatever follows the digits is ignored and
+//a number too large for a long long throws out_of_range
+long long parseNumber (const char *begin, const char *end)
+{
+    while (begin != end && isspace (*begin))
+    {
+        begin++;
+    }
+    bool negative = begin != end && *begin == '-';
+    if (begin != end && (*begin == '-' || *begin == '+'))
+    {
+        begin++;
+    }
+    if (begin == end || !isdigit (*begin))
+    {
+        throw invalid_argument ("parseNumber");
+    }
+    unsigned long long limit = negative ? 0ULL - (unsigned long long) LLONG_MIN : LLONG_MAX;
+    unsigned long long value = 0;
+    for (; begin != end && isdigit (*begin); begin++)
+    {
+        unsigned digit = *begin - '0';
+        if (value > (limit - digit) / 10)
+        {
+            throw out_of_range ("parseNumber");
+        }
+        value = value * 10 + digit;
+    }
+    if (negative)
+    {
+        return value == limit ? LLONG_MIN : -(long long) value;
+    }
+    return (long long) value;
+}
+
 //Child class of class Issuable
 // it contains information for the date of trips and expiration
 class Date: public Issuable{
     private:
         tm date;
         bool empty;
+        Date(long day, long month, long year);
+        void set(long day, long month, long year);
     public: 
         Date(string date) throw (DateParsingError);
         Date();
+        static Date parse(const char *begin, const char *end);
+        void appendTo(string &out) const;
+        static long dayNumberOf(long day, long month, long year);
         bool operator>(Date date) const;
         bool operator<(Date date) const;
         bool operator<=(Date date) const;
         bool operator>=(Date date) const;
         bool isEmpty() const;
+        long getDayNumber() const;
+        static Date fromDayNumber(long dayNumber);
+        static void splitDayNumber(long dayNumber, long &day, long &month, long &year);
         string toString() const;
 };
 
 typedef enum { bike = 1, car = 2, bus = 3 } VehicleType;
 
+//Exact amount of money kept as a whole number of paise, so fares never
+//pick up floating point rounding errors.
+class Money
+{
+    long long paise;
+public:
+    Money(long long paise = 0);
+    static Money fromRupees(double rupees);
+    static Money parse(string amount) throw (Error);
+    long long getPaise() const;
+    Money operator+(Money other) const;
+    Money operator-(Money other) const;
+    bool operator<(Money other) const;
+    bool operator==(Money other) const;
+    string toString() const;
+};
+
+ostream &operator<<(ostream &out, Money amount);
+
+//Pricing rules of one vehicle type. Amounts are in paise and percentages
+//are whole numbers applied to the vehicle's price per km.
+struct Tariff
+{
+    long long minimumFare;
+    long long perDay;
+    // km up to firstTierKm are billed at the full price per km, km up to
+    // secondTierKm at secondTierPercent and everything beyond that at
+    // thirdTierPercent
+    long firstTierKm;
+    long secondTierKm;
+    int secondTierPercent;
+    int thirdTierPercent;
+    // extra percentage on the per-day charge of Saturdays and Sundays
+    int weekendSurchargePercent;
+};
+
+//Tariff of each vehicle type, fixed at compile time. Every specialisation
+//gives the pricing engine a fare function with its constants folded in.
+template<VehicleType V> struct TariffFor;
+
+//Trips laid out column by column for re-pricing many of them in one pass
+struct PricingBatch
+{
+    vector<long> distance;
+    vector<long> days;
+    vector<long> weekendDays;
+    vector<long long> pricePerKm;
+    vector<int> type;
+
+    void add(VehicleType type, double pricePerKm, long distance, long startDay, long endDay);
+    size_t size() const;
+    void clear();
+};
+
+//Computes fares from the distance run, the rental days and the tariff of the
+//vehicle type. Live quotes use the compile-time tariffs, batch re-pricing
+//uses the engine's own copy so alternative tariffs can be tried out.
+class PricingEngine
+{
+    Tariff tariffs[4];
+public:
+    PricingEngine();
+    void setTariff(VehicleType type, Tariff tariff);
+    Tariff getTariff(VehicleType type) const;
+    template<VehicleType V>
+    static Money quote(double pricePerKm, long distance, long startDay, long endDay);
+    static Money quote(VehicleType type, double pricePerKm, long distance, Date startDate, Date endDate);
+    void reprice(const PricingBatch &batch, vector<long long> &fares) const;
+};
+
 //Vehicle entity that stores the vehicles info
 class Vehicle : public Entity {
     string registrationNumber;
@@ -163,6 +638,7 @@ public:
     void display() const;
     string toString() const;
     void setDataFrom(Entity *s);
+    template<typename T> friend struct EntitySchema;
 };
 
 //User entity that stores user's info
@@ -181,6 +657,7 @@ public:
     void display() const;
     string toString() const;
     void setDataFrom(Entity *s);
+    template<typename T> friend struct EntitySchema;
 };
 
 //Trip entity that stores trip's info
@@ -193,7 +670,7 @@ class Trip : public Entity
     Date endDate ;
     long startReading ;
     long endReading ;
-    double fare ;
+    Money fare ;
     bool completed ;
 
     public:
@@ -204,7 +681,7 @@ class Trip : public Entity
         long recordId=0, 
         long startReading = 0, 
         long endReading =0 , 
-        double fare = 0.0 , 
+        Money fare = Money() , 
         bool isCompleted = false );
     const User & getUser () const ;
     const Vehicle & getVehicle () const ;
@@ -212,77 +689,1271 @@ class Trip : public Entity
     Date getEndDate () const ;
     long getStartReading () const ;
     long getEndReading() const;
-    long getFare () const ;
+    Money getFare () const ;
     void startTrip (long startReading) ;
-    double completeTrip (long endReading);
+    Money completeTrip (long endReading);
     void display () const ;
     string toString() const ;
     bool isCompleted() const;
     void setDataFrom (Entity *s);
+    template<typename T> friend struct EntitySchema;
+};
+
+//One field of an entity as its files hold it. The type of the member picks
+//the FieldCodec that reads and writes it.
+template<typename C, typename M>
+struct SchemaField
+{
+    const char *name;
+    M C::*member;
+};
+
+template<typename C, typename M>
+constexpr SchemaField<C, M> schemaField(const char *name, M C::*member)
+{
+    return SchemaField<C, M>{name, member};
+}
+
+//The fields of every entity, in the order its files hold them. This is the
+//only place that lists them: RecordCodec generates the text parser and
+//serialiser of the data files and the binary layout from it.
+template<typename T> struct EntitySchema;
+
+template<> struct EntitySchema<Vehicle>
+{
+    static constexpr auto fields = make_tuple(
+        schemaField("id", &Entity::recordId),
+        schemaField("registration", &Vehicle::registrationNumber),
+        schemaField("type", &Vehicle::type),
+        schemaField("seats", &Vehicle::seats),
+        schemaField("company", &Vehicle::companyName),
+        schemaField("price", &Vehicle::pricePerKm),
+        schemaField("puc", &Vehicle::PUCExpirationDate));
+    static Vehicle *make() { return new Vehicle("", bike, 0, "", 0, Date::parse(nullptr, nullptr)); }
+};
+
+template<> struct EntitySchema<User>
+{
+    static constexpr auto fields = make_tuple(
+        schemaField("id", &Entity::recordId),
+        schemaField("name", &User::name),
+        schemaField("contact", &User::contact),
+        schemaField("email", &User::email));
+    static User *make() { return new User("", "", ""); }
+};
+
+template<> struct EntitySchema<Trip>
+{
+    static constexpr auto fields = make_tuple(
+        schemaField("id", &Entity::recordId),
+        schemaField("vehicle", &Trip::vehicle),
+        schemaField("user", &Trip::user),
+        schemaField("start", &Trip::startDate),
+        schemaField("end", &Trip::endDate),
+        schemaField("startReading", &Trip::startReading),
+        schemaField("endReading", &Trip::endReading),
+        schemaField("fare", &Trip::fare),
+        schemaField("completed", &Trip::completed));
+    static Trip *make() { return new Trip(nullptr, nullptr, Date::parse(nullptr, nullptr), Date::parse(nullptr, nullptr)); }
+};
+
+//Text and binary form of one type of field. The text is what a data file
+//holds between two delimiters, the binary form uses the varints of the trip
+//archive. A field that refers to another record is stored as its id and
+//resolved through the context, the database the record is read into.
+//Parsing throws invalid_argument on a malformed field, decoding throws
+//out_of_range on data that ends early.
+template<typename M> struct FieldCodec;
+
+template<typename M>
+struct IntegerCodec
+{
+    static void format(M value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, M &value, Context &context);
+    static void encode(M value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, M &value, Context &context);
+};
+
+template<> struct FieldCodec<long> : IntegerCodec<long> {};
+template<> struct FieldCodec<int> : IntegerCodec<int> {};
+template<> struct FieldCodec<VehicleType> : IntegerCodec<VehicleType> {};
+
+template<> struct FieldCodec<bool>
+{
+    static void format(bool value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, bool &value, Context &context);
+    static void encode(bool value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, bool &value, Context &context);
 };
 
+template<> struct FieldCodec<double>
+{
+    static void format(double value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, double &value, Context &context);
+    static void encode(double value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, double &value, Context &context);
+};
+
+template<> struct FieldCodec<string>
+{
+    static void format(const string &value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, string &value, Context &context);
+    static void encode(const string &value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, string &value, Context &context);
+};
+
+template<> struct FieldCodec<Date>
+{
+    static void format(const Date &value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, Date &value, Context &context);
+    static void encode(const Date &value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, Date &value, Context &context);
+};
+
+template<> struct FieldCodec<Money>
+{
+    static void format(Money value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, Money &value, Context &context);
+    static void encode(Money value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, Money &value, Context &context);
+};
+
+template<typename R>
+struct ReferenceCodec
+{
+    static void format(const R *value, string &out);
+    template<typename Context> static void parse(const char *begin, const char *end, const R *&value, Context &context);
+    static void encode(const R *value, string &out);
+    template<typename Context> static void decode(const char *&at, const char *end, const R *&value, Context &context);
+};
+
+template<> struct FieldCodec<const Vehicle *> : ReferenceCodec<Vehicle> {};
+template<> struct FieldCodec<const User *> : ReferenceCodec<User> {};
+
+//Parser, serialiser and binary layout of an entity, generated from its
+//EntitySchema. Each field goes through the codec of its type, so nothing is
+//split into a vector of strings or passed through a stream: parsing reads
+//the fields in place and formatting appends to one string.
+template<typename T>
+class RecordCodec
+{
+    static const size_t FIELDS = tuple_size<decltype(EntitySchema<T>::fields)>::value;
+
+    template<typename C, typename M>
+    static void formatField(const T &record, const SchemaField<C, M> &field, string &out, size_t position);
+    template<size_t... I>
+    static void formatFields(const T &record, string &out, index_sequence<I...>);
+    template<typename C, typename M, typename Context>
+    static void parseField(T &record, const SchemaField<C, M> &field, const char *&at, const char *end, Context &context);
+    template<typename Context, size_t... I>
+    static void parseFields(T &record, const char *at, const char *end, Context &context, index_sequence<I...>);
+    template<typename C, typename M>
+    static void encodeField(const T &record, const SchemaField<C, M> &field, string &out);
+    template<size_t... I>
+    static void encodeFields(const T &record, string &out, index_sequence<I...>);
+    template<typename C, typename M, typename Context>
+    static void decodeField(T &record, const SchemaField<C, M> &field, const char *&at, const char *end, Context &context);
+    template<typename Context, size_t... I>
+    static void decodeFields(T &record, const char *at, const char *end, Context &context, index_sequence<I...>);
+public:
+    static void format(const T &record, string &out);
+    template<typename Context>
+    static T *parse(const char *begin, const char *end, Context &context);
+    template<typename Context>
+    static T *parse(const string &line, Context &context);
+    static void encode(const T &record, string &out);
+    template<typename Context>
+    static T *decode(const string &data, Context &context);
+};
+
+
+//A completed trip that was moved out of the trips table into the archive.
+//Vehicle and user are kept as record ids and dates as day numbers.
+struct ArchivedTrip
+{
+    long recordId;
+    long vehicleId;
+    long userId;
+    long startDay;
+    long endDay;
+    long startReading;
+    long endReading;
+    Money fare;
+
+    void display() const;
+};
+
+//Immutable, compressed segment files that hold archived trips.
+//Every segment is written once and then only read in a streaming fashion.
+class TripArchive
+{
+    string prefix;
+    // number of segments on disk and the highest record id stored in them
+    int segmentCount;
+    long lastRecordId;
+    // first and last record id of each segment, from their headers
+    vector<pair<long, long>> ranges;
+
+    string segmentName(int segment) const;
+    bool readHeader(istream &in, long &count, long &firstId, long &lastId) const;
+    void decodeSegment(istream &in, long count, function<bool(const ArchivedTrip &)> visit) const throw (IOError);
+public:
+    TripArchive(string prefix);
+    long getLastRecordId() const;
+    void addSegment(const vector<ArchivedTrip> &trips) throw (IOError);
+    void forEach(function<void(const ArchivedTrip &)> visit) const throw (IOError);
+    void removeStored(vector<ArchivedTrip> &trips) const throw (IOError);
+    void copyTo(string prefix) const throw (IOError);
+    ArchivedTrip getTrip(long recordId) const throw (IOError, RecordNotFoundError);
+};
+
+//Unbounded multi-producer single-consumer queue. Producers push with a single
+//compare-and-swap on the head, the consumer takes every queued value at once.
+template<typename T>
+class MpscQueue
+{
+    struct Node
+    {
+        T value;
+        Node *next;
+    };
+    atomic<Node *> head;
+
+public:
+    MpscQueue();
+    ~MpscQueue();
+    void push(T value);
+    bool empty() const;
+    vector<T> popAll();
+};
+
+//Blocking queue with a fixed capacity. Producers wait while it is full,
+//which pushes back on a stage that runs ahead of the ones after it.
+template<typename T>
+class BoundedQueue
+{
+    deque<T> values;
+    size_t capacity;
+    bool closed;
+    mutex lock;
+    condition_variable notFull;
+    condition_variable notEmpty;
+
+public:
+    BoundedQueue(size_t capacity);
+    void push(T value);
+    bool pop(T &value);
+    void close();
+};
+
+//Anything that the persistence thread can write to disk. Tables remember
+//what changed and write all of it at once when asked.
+class Persistable
+{
+    public:
+    virtual void writePending() throw (IOError) = 0;
+    virtual ~Persistable() {}
+};
+
+//Background thread that writes tables to disk. Repeated requests for the
+//same table that queue up while a write is running are coalesced into one.
+class Persister
+{
+    struct Request
+    {
+        Persistable *table;
+        // set for flush requests, called once earlier writes are done
+        function<void(exception_ptr)> flushed;
+    };
+    MpscQueue<Request> queue;
+    mutex wakeLock;
+    condition_variable wake;
+    atomic<bool> stopping;
+    // set when a write failed, reported to the next flush
+    bool failed;
+    thread worker;
+
+    void run();
+    void notify();
+public:
+    Persister();
+    ~Persister();
+    void schedule(Persistable *table);
+    shared_future<void> flush();
+    void flush(function<void(exception_ptr)> done);
+};
+
+//Thread that runs posted tasks one after another. Whatever a loop serves
+//is only touched by its thread, and a task that would wait for something
+//posts the rest of its work as a new task instead of holding the thread.
+//Tasks must not throw.
+class EventLoop
+{
+    MpscQueue<function<void()>> tasks;
+    mutex wakeLock;
+    condition_variable wake;
+    atomic<bool> stopping;
+    thread worker;
+
+    void run();
+public:
+    EventLoop();
+    ~EventLoop();
+    void post(function<void()> task);
+};
+
+//One odometer reading sent by the telemetry unit of a vehicle
+struct TelemetryReading
+{
+    long vehicleId;
+    long odometer;
+    // milliseconds, as stamped by the unit
+    long long timestamp;
+};
+
+//Counters of the telemetry ingest
+struct TelemetryStats
+{
+    long long received;
+    long long batches;
+    size_t vehicles;
+};
+
+//Keeps the current odometer of every vehicle from its telemetry. Producers
+//only push to a lock-free queue, so any number of units can report without
+//touching the booking locks. A thread takes the queue in batches, keeps the
+//newest reading of each vehicle and publishes those once per batch.
+//Readings are never written to disk.
+class TelemetryIngest
+{
+    MpscQueue<TelemetryReading> queue;
+    mutable mutex odometersLock;
+    unordered_map<long, TelemetryReading> odometers;
+    atomic<long long> received;
+    atomic<long long> batches;
+    atomic<bool> stopping;
+    mutex wakeLock;
+    condition_variable wake;
+    thread worker;
+
+    void run();
+public:
+    TelemetryIngest();
+    ~TelemetryIngest();
+    void submit(const TelemetryReading &reading);
+    bool getOdometer(long vehicleId, long &odometer) const;
+    TelemetryStats getStats() const;
+};
+
+//Lazy read-only view over the records of a table. It refers to the table's
+//own records instead of copying them, filters are only evaluated while
+//iterating and every page ends with a token that resumes after it.
+//A cursor is valid until its table changes, resume tokens stay valid.
+template<typename T>
+class Cursor
+{
+    const vector<T*> *records;
+    vector<function<bool(const T &)>> filters;
+    // only records with a greater id are visited
+    long resumeAfter;
+
+    typename vector<T*>::const_iterator begin() const;
+    bool matches(const T &record) const;
+public:
+    Cursor(const vector<T*> *records);
+    Cursor<T> where(function<bool(const T &)> filter) const;
+    Cursor<T> after(long resumeToken) const;
+    void forEach(function<void(const T &)> visit) const;
+    long nextPage(size_t pageSize, vector<const T*> &page) const;
+    const T *first() const throw (RecordNotFoundError);
+};
+
+//Identity, size and modification time of a file, all zero when it is missing
+struct FileState
+{
+    unsigned long long device;
+    unsigned long long inode;
+    long long size;
+    long long modified;
+
+    static FileState of(const string &fileName);
+    bool exists() const;
+    bool isSameFile(const FileState &other) const;
+    bool operator==(const FileState &other) const;
+};
+
+//What another program did to a table's file since the table last saw it
+typedef enum { fileUnchanged = 0, fileAppended = 1, fileReplaced = 2 } FileChange;
 
 //templated class Table that stores entity tables and functions to modify them
 template<typename T>
-class Table{        
+class Table: public Persistable{        
 
     string fileName;
     fstream fileStream;
     vector<T*> records;
-
+    // width of one record slot in the file, 0 when records are plain lines
+    size_t recordWidth;
+    // slot of every record in a fixed-width file and the number of slots.
+    // Slots are not tied to ids: a new record takes the next one and a
+    // rewrite packs the records, so the file only holds what the table does.
+    unordered_map<long, long> slots;
+    long slotCount;
+    // ids up to this one are in use outside of the table (e.g. archived)
+    long reservedRecordId;
+    // background writer, null when the table is written synchronously
+    Persister *persister;
+    // guards records against the persistence thread and the pending changes
+    mutex lock;
+    bool rewritePending;
+    set<long> dirtyRecordIds;
+    // deleted records still in records
+    size_t tombstones;
+    // changes with every change to records, compaction results are only
+    // installed when it did not move since they were taken
+    long generation;
+    // set after a deletion, the highest id is kept in the .seq file so
+    // that ids of deleted records are never given out again
+    bool sequencePending;
+    // the file as the table last read or wrote it. Writes hold fileLock
+    // until this is updated, so they are never taken for another program's.
+    mutex fileLock;
+    FileState knownFile;
+    // set while a backup streams the table. It holds the ids up to
+    // backupLastId, the ones below backupNextId are written already. A record
+    // that changes ahead of the backup leaves its old version behind, null
+    // when it was not in the table when the backup started.
+    bool backingUp;
+    long backupLastId;
+    long backupNextId;
+    map<long, T*> backupVersions;
+    // last id given out by any table sharing the sequence, null unless the
+    // table belongs to a shard
+    atomic<long> *sharedSequence;
+
+    typename vector<T*>::const_iterator findRecord(long recordId) const;
     T *getReferenceOfRecordForId(long recordId) const throw (RecordNotFoundError);
+    long takeRecordIds(size_t count);
+    void sortRecords();
+    string formatRecord(const T *record) const throw (IOError);
+    string serializeRecords(unordered_map<long, long> &layout) const throw (IOError);
+    long slotOf(long recordId);
+    void writeFileContents(const string &contents) throw (IOError);
+    void writeSlot(long slot, const string &contents) throw (IOError);
     void writeToFile() throw (IOError);
+    void writeRecordToFile(const T *record) throw (IOError);
+    void persist(const T *record) throw (IOError);
+    void persistRecords(const vector<T*> &changed) throw (IOError);
     const T* const addNewRecord(T data) throw (MemoryError, IOError);
+    void appendRecords(const vector<T*> &newRecords) throw (IOError);
+    T *applyRecord(T *record);
     void updateRecord(T updatedRecord) throw (IOError, RecordNotFoundError);
+    void updateRecords(vector<T> &updated) throw (IOError, RecordNotFoundError);
+    T *markDeleted(long recordId, bool deleted) throw (RecordNotFoundError);
+    void evictRecord(long recordId);
+    void deleteRecord(long recordId) throw (IOError, RecordNotFoundError);
+    void writeSequence() throw (IOError);
+    long snapshotLive(vector<T*> &live, function<void(T *)> visit);
+    bool installLive(vector<T*> &live, long generation);
+    void recordFileState();
+    bool mergeSnapshot(vector<T*> &fresh, function<bool(const T &)> keep, vector<T*> &changed, vector<T*> &removed) throw (IOError);
+    void keepForBackup(long recordId, const T *record);
+    long startBackup();
+    bool readBackupChunk(string &contents, size_t count) throw (IOError);
+    void finishBackup();
 public:
-    Table(string filename) throw (MemoryError);
+    Table(string filename, size_t recordWidth = 0) throw (MemoryError);
+    void setPersister(Persister *persister);
+    void writePending() throw (IOError);
+    bool isFixedWidth() const;
+    void reserveRecordIds(long lastRecordId);
+    void shareSequence(atomic<long> *sequence);
+    void loadSequence();
+    size_t getTombstones() const;
+    FileChange readChanges(function<T *(const string &)> parse, vector<T*> &changed);
     long getNextRecordId() const;
     const T *const  getRecordForId(long recordId) const throw (RecordNotFoundError);
-    vector<T*> getRecords(){return records;}
+    const vector<T*> &getRecords() const{return records;}
+    Cursor<T> cursor() const;
     friend class Database;
+    friend class Backup;
+    friend class TelemetryFeed;
 };
 
 
-//Database class that has entity tables and is repsonsible for their updation.
-class Database
+//Append-only log of the adds and updates of a database. Every entry is one
+//line "sequence;table;operation;record" where table is V, U or T, operation
+//is A (add) or U (update) and record is the record as stored in its file.
+//The log is started afresh whenever a primary starts serving, its first line
+//"epoch;number" tells followers which run of the primary wrote it.
+class MutationLog
 {
-private:
-    Table<Vehicle> *vehicleTable;
-    Table<User> *userTable;
-    Table<Trip> *tripTable;
+    ofstream out;
+    long sequence;
+    mutex lock;
+public:
+    MutationLog(string fileName) throw (IOError);
+    void append(char table, char operation, const string &record) throw (IOError);
+};
 
-    void fetchAllVehicles() throw(IOError, MemoryError);
-    void fetchAllUsers() throw(IOError, MemoryError);
-    void fetchAllTrips() throw(IOError, MemoryError);
+//An availability search: the day numbers of its dates and the vehicle type.
+//An empty date stands for an unbounded range.
+struct AvailabilityKey
+{
+    long startDay;
+    long endDay;
+    int type;
 
-    void cleanUp();
+    bool operator==(const AvailabilityKey &other) const;
+};
+
+struct AvailabilityKeyHash
+{
+    size_t operator()(const AvailabilityKey &key) const;
+};
+
+//Counters of an availability cache
+struct CacheStats
+{
+    long hits;
+    long misses;
+    long invalidations;
+    long entries;
+};
+
+//Bounded least-recently-used cache of availability search results. Entries
+//are dropped precisely: only those whose vehicle type and date range a
+//change can affect.
+class AvailabilityCache
+{
+    typedef list<pair<AvailabilityKey, vector<const Vehicle *>>> Entries;
+    size_t capacity;
+    // most recently used first
+    Entries entries;
+    unordered_map<AvailabilityKey, Entries::iterator, AvailabilityKeyHash> positions;
+    CacheStats stats;
+    mutex lock;
 
 public:
-    Database() throw(MemoryError, IOError);
+    AvailabilityCache(size_t capacity);
+    static AvailabilityKey makeKey(Date startDate, Date endDate, VehicleType type);
+    bool lookup(const AvailabilityKey &key, vector<const Vehicle *> &vehicles);
+    void store(const AvailabilityKey &key, const vector<const Vehicle *> &vehicles);
+    void invalidate(VehicleType type, long startDay, long endDay);
+    void invalidate(VehicleType type);
+    CacheStats getStats();
+};
 
-    ~Database();
+//A search result, lower ranks are better matches
+struct SearchHit
+{
+    long recordId;
+    // 0 exact, 1 prefix, 2 start of a word, 3 anywhere inside
+    int rank;
+};
 
-    const Table<Vehicle> *const getVehicleRef() const;
-    const Table<User> *const getUserRef() const;
-    const Table<Trip> *const getTripRef() const;
+//Case-insensitive search over one text field of a table. An ordered set of
+//the keys answers prefix lookups like a trie, by walking the range of keys
+//that start with the text, and an inverted index from every trigram to the
+//records containing it answers substring lookups by intersecting the lists
+//of the text's trigrams. Both are kept up to date record by record.
+class TextIndex
+{
+    set<pair<string, long>> prefixes;
+    unordered_map<uint32_t, vector<long>> trigrams;
+    unordered_map<long, string> keys;
 
-    const Vehicle *const getVehicle(string registrationNo) const throw(RecordNotFoundError);
-    const User *const getUser(string contactNo) const throw(RecordNotFoundError);
-    const vector<const Vehicle *> getVehicle(Date startDate, Date endDate, VehicleType type) const;
+    static string normalize(const string &text);
+    static vector<uint32_t> trigramsOf(const string &key);
+public:
+    void index(long recordId, const string &text);
+    void remove(long recordId);
+    vector<SearchHit> search(const string &text, size_t limit) const;
+};
 
-    template <class T>
-    void addNewRecord(T *record) throw(IOError, MemoryError);
-    template <class T>
-    void updateRecord(T *record) throw(IOError, RecordNotFoundError);
+//Trips placed on the calendar by their dates, for questions about days
+//rather than about one user or vehicle. Start and end days map to their
+//trips in ordered maps, so the trips starting or ending in a range are
+//one lower_bound away. Every trip is also listed under each week it runs
+//in, so the trips on the road on a day are found among those of its week
+//instead of in the whole history. Trips without dates are left out.
+class TripCalendar
+{
+    map<long, vector<const Trip *>> starts;
+    map<long, vector<const Trip *>> ends;
+    unordered_map<long, vector<const Trip *>> weeks;
+    // the start and end day each trip was placed under, which the trip
+    // itself no longer knows once its dates were changed
+    unordered_map<const Trip *, pair<long, long>> placed;
+
+    static long weekOf(long day);
+    static void collect(const map<long, vector<const Trip *>> &days, long firstDay, long lastDay, vector<const Trip *> &trips);
+public:
+    void add(const Trip *trip);
+    void remove(const Trip *trip);
+    vector<const Trip *> startingBetween(long firstDay, long lastDay) const;
+    vector<const Trip *> endingBetween(long firstDay, long lastDay) const;
+    vector<const Trip *> activeOn(long day) const;
 };
 
-//Applicaton class that keeps a record of the database and is responsible for driving the program.
-class Application{
-    Database *db;
-    void renderMenu();
-    void welcome();
-    void gotoXY(int x, int y) const;
-    void renderAddNewVehicleMenu() const;
+//A B+tree node as it is held in the buffer pool
+struct BTreeNode
+{
+    bool leaf;
+    // next leaf to the right, leaves only
+    uint32_t next;
+    vector<string> keys;
+    // the value of each key in a leaf
+    vector<string> values;
+    // the children of an inner node, one more than keys
+    vector<uint32_t> children;
+    bool dirty;
+};
+
+//Users on disk in a file of fixed size pages holding two B+trees: one from
+//the record id to the user's record and one from the contact number to the
+//record id. Pages are read through a buffer pool of bounded size, so memory
+//stays the same however many users there are. Changed pages stay in the
+//pool until they are written back by writePending, on the persistence thread
+//when there is one. Deleting only removes the key from its leaf, leaves are
+//not merged.
+class UserStore : public Persistable
+{
+    string fileName;
+    fstream file;
+    mutex lock;
+    uint32_t pageCount;
+    uint32_t idRoot;
+    uint32_t contactRoot;
+    long lastRecordId;
+    bool headerDirty;
+    bool created;
+    // set while the values are still the text lines of users.txt
+    bool textValues;
+    size_t poolCapacity;
+    // most recently used first
+    list<pair<uint32_t, shared_ptr<BTreeNode>>> pool;
+    unordered_map<uint32_t, list<pair<uint32_t, shared_ptr<BTreeNode>>>::iterator> poolPositions;
+
+    static string idKey(long recordId);
+    static size_t nodeSize(const BTreeNode &node);
+    bool contactOf(const string &record, string &contact);
+    shared_ptr<BTreeNode> fetch(uint32_t page) throw(IOError);
+    uint32_t allocate(bool leaf);
+    void evict() throw(IOError);
+    void writeNode(uint32_t page, const BTreeNode &node) throw(IOError);
+    void writeHeader() throw(IOError);
+    bool insert(uint32_t page, const string &key, const string &value, string &splitKey, uint32_t &splitPage) throw(IOError);
+    void insert(uint32_t &root, const string &key, const string &value) throw(IOError);
+    bool seek(uint32_t root, const string &key, string &foundKey, string &value) throw(IOError);
+    void erase(uint32_t root, const string &key) throw(IOError);
+public:
+    UserStore(string fileName, size_t poolCapacity) throw(IOError);
+    ~UserStore();
+    bool isNew() const;
+    bool holdsText() const;
+    void convertValues(function<string(const string &)> convert) throw(IOError);
+    long getLastRecordId();
+    bool get(long recordId, string &record) throw(IOError);
+    bool findContact(const string &contact, long &recordId) throw(IOError);
+    void put(long recordId, const string &contact, const string &record) throw(IOError);
+    void remove(long recordId) throw(IOError);
+    void forEach(function<void(const string &)> visit) throw(IOError);
+    void dropCache() throw(IOError);
+    void writePending() throw(IOError);
+    static bool selfCheck(string fileName, ostream &out) throw(IOError);
+};
+
+//One booking of a batch: a user wants any vehicle of a type for a date range
+struct BookingRequest
+{
+    long userId;
+    Date startDate;
+    Date endDate;
+    VehicleType type;
+};
+
+//What a batch did with one request, vehicle is null when it was rejected
+struct BookingResult
+{
+    const Vehicle *vehicle;
+    long tripId;
+};
+
+//Outcome of a bulk import
+struct ImportReport
+{
+    long imported;
+    long rejected;
+    // record ids given to the imported records, a contiguous range
+    long firstRecordId;
+    long lastRecordId;
+};
+
+typedef enum { csvFormat = 1, jsonLinesFormat = 2 } ExportFormat;
+
+//Writes trips joined with their vehicle and user as CSV or JSON Lines.
+//Rows are formatted straight into a fixed size buffer that is written out
+//whenever it fills up, so memory stays the same whatever the table size.
+class TripExporter
+{
+    FILE *out;
+    ExportFormat format;
+    vector<char> buffer;
+    size_t used;
+    // index of the next field within the current row
+    int field;
+
+    void append(const char *data, size_t length) throw (IOError);
+    void append(const string &text) throw (IOError);
+    void beginField(const char *name) throw (IOError);
+    void writeText(const char *name, const string &text) throw (IOError);
+    void writeNumber(const char *name, long long number) throw (IOError);
+    void writeRaw(const char *name, const string &text) throw (IOError);
+    void writeDate(const char *name, long dayNumber, bool empty) throw (IOError);
+    void writeRow(long tripId, long startDay, long endDay, bool datesEmpty,
+                  long startReading, long endReading, Money fare, bool completed,
+                  long vehicleId, const Vehicle *vehicle,
+                  long userId, const User *user) throw (IOError);
+public:
+    TripExporter(FILE *out, ExportFormat format);
+    void writeHeader() throw (IOError);
+    void write(const Trip &trip) throw (IOError);
+    void write(const ArchivedTrip &trip, const Vehicle *vehicle, const User *user) throw (IOError);
+    void finish() throw (IOError);
+};
+
+class Database;
+class Query;
+class Update;
+class HotReload;
+class Backup;
+class TelemetryFeed;
+
+//Compaction of a database's tables. The persistence thread copies the live
+//records and rebuilds the trip indexes from them, the database installs the
+//result on its own thread if the tables did not change in the meantime, so
+//nothing is ever removed under a reader.
+class Compaction : public Persistable
+{
+    Database *database;
+    mutex lock;
+    // set while a compaction is queued, prepared or waiting to be installed
+    bool pending;
+    bool ready;
+    vector<Vehicle *> vehicles;
+    vector<User *> users;
+    vector<Trip *> trips;
+    long vehicleGeneration;
+    long userGeneration;
+    long tripGeneration;
+    unordered_map<long, vector<const Trip *>> tripsByUser;
+    unordered_map<long, vector<const Trip *>> tripsByVehicle;
+    friend class Database;
+
+public:
+    Compaction(Database *database);
+    void writePending() throw(IOError);
+};
+
+//Takes in the changes other programs make to vehicle.txt and users.txt.
+//A thread waits for the files to change (inotify on Linux, polling
+//elsewhere) and parses only what changed: the appended lines when a file
+//grew, the whole file when it was replaced. The database applies the parsed
+//records on its own thread, each replaced file in one step.
+class HotReload
+{
+    Database *database;
+    mutex lock;
+    // parsed records waiting for the database, after a replaced file they
+    // start with its whole contents
+    vector<Vehicle *> vehicles;
+    vector<User *> users;
+    bool vehicleSnapshot;
+    bool userSnapshot;
+    atomic<bool> ready;
+    atomic<bool> stopping;
+    // inotify instance watching the directory, -1 when the files are polled
+    int notifier;
+    thread worker;
+    friend class Database;
+
+    bool waitForChange();
+    void run();
+public:
+    HotReload(Database *database, string location);
+    ~HotReload();
+};
+
+//Feeds the readings that units append to the telemetry file of a location
+//into the database's telemetry ingest, from a thread of its own. Lines are
+//read as they are completed, a file that shrank is read again from the
+//start. Registrations are resolved under the vehicle table's lock and
+//remembered, readings of unknown vehicles are dropped.
+class TelemetryFeed
+{
+    Database *database;
+    string fileName;
+    streamoff offset;
+    unordered_map<string, long> vehicleIds;
+    atomic<bool> stopping;
+    thread worker;
+
+    bool findVehicle(const string &registrationNo, long &vehicleId);
+    void poll();
+    void run();
+public:
+    TelemetryFeed(Database *database, string location);
+    ~TelemetryFeed();
+};
+
+//Online backup of a database to another location. Starting it fixes the
+//point in time the backup shows for all tables at once: from then on each
+//table keeps the old version of a record that changes before the backup got
+//to it. A thread streams the tables into the location in chunks while the
+//database goes on taking writes, and frees the old versions it has passed.
+//Each file appears under its final name once it is complete.
+class Backup
+{
+    Database *database;
+    string location;
+    // the last record ids handed out when the backup started
+    long vehicleSequence;
+    long userSequence;
+    long tripSequence;
+    promise<void> written;
+    shared_future<void> result;
+    thread worker;
+    friend class Database;
+
+    template <typename T>
+    void copyTable(Table<T> *table, string fileName, long sequence) throw(IOError);
+    void copyPagedUsers() throw(IOError);
+    void run();
+public:
+    Backup(Database *database, string location) throw(IOError);
+    ~Backup();
+};
+
+//Database class that has entity tables and is repsonsible for their updation.
+class Database
+{
+private:
+    Table<Vehicle> *vehicleTable;
+    Table<User> *userTable;
+    Table<Trip> *tripTable;
+    TripArchive *tripArchive;
+    // day number of the last archiving run, it runs once a day
+    long archivedDay;
+    Persister *persister;
+    // false when the user table belongs to another database (shards)
+    bool ownsUsers;
+    // replicas never write their files, they only apply the primary's log
+    bool readOnly;
+    MutationLog *mutationLog;
+    AvailabilityCache *availabilityCache;
+    // started on first use, most databases never receive telemetry
+    mutable TelemetryIngest *telemetry;
+    mutable once_flag telemetryStarted;
+    Compaction *compaction;
+    // partial match search, the user ones only when the users are our own
+    TextIndex *registrationSearch;
+    TextIndex *nameSearch;
+    TextIndex *emailSearch;
+    // set in paged mode, userTable then only holds the users in use
+    UserStore *userStore;
+    // ids of the users read from the store, in the order they were read
+    mutable deque<long> storedUsers;
+    string location;
+    // null until watchFiles is called
+    HotReload *hotReload;
+    // the last backup started, null before the first
+    Backup *backup;
+    // null until watchTelemetry is called
+    TelemetryFeed *telemetryFeed;
+    // trips of every user and every vehicle, each list ordered by startDate
+    unordered_map<long, vector<const Trip *>> tripsByUser;
+    unordered_map<long, vector<const Trip *>> tripsByVehicle;
+    TripCalendar *tripCalendar;
+
+    template <class T>
+    void logMutation(char operation, const T *record) throw(IOError);
+    template <class T>
+    ImportReport importRecords(Table<T> *table, istream &in, ostream &rejects, unsigned threads) throw(IOError);
+    void indexTrip(const Trip *trip);
+    void unindexTrip(const Trip *trip);
+    void onRecordAdded(const Vehicle *vehicle);
+    void onRecordAdded(const User *user);
+    void onRecordAdded(const Trip *trip);
+    void invalidateAvailability(const Trip &trip);
+    void applyUpdates(vector<Vehicle> &vehicles) throw(IOError, RecordNotFoundError);
+    void applyUpdates(vector<User> &users) throw(IOError, RecordNotFoundError);
+    void applyUpdates(vector<Trip> &trips) throw(IOError, RecordNotFoundError);
+    void prepareCompaction();
+    void compactIfDue();
+    void prepareReload(HotReload &reload);
+    void replayCall(const WorkloadCall &call);
+    // the parsers throw MemoryError, RecordNotFoundError or the standard
+    // exceptions of the number conversions on a malformed line
+    Vehicle *parseVehicle(const string &line) const;
+    User *parseUser(const string &line) const;
+    Trip *parseTrip(const string &line) const;
+    void resolve(long recordId, const Vehicle *&vehicle) const;
+    void resolve(long recordId, const User *&user) const;
+    template<typename R> friend struct ReferenceCodec;
+    User *decodeUser(const string &record) const;
+    void fetchAllVehicles() throw(IOError, MemoryError);
+    void fetchAllUsers() throw(IOError, MemoryError);
+    void openUserStore(string location) throw(IOError, MemoryError);
+    void persistUsers() throw(IOError);
+    bool isStored(const Vehicle &vehicle) const;
+    bool isStored(const User &user) const;
+    void evictStoredUsers() const;
+    void fetchAllTrips() throw(IOError, MemoryError);
+    void archiveCompletedTrips(long olderThanDays) throw(IOError);
+
+    void cleanUp();
+
+public:
+    Database(string location = "", const Database *userSource = nullptr, bool readOnly = false) throw(MemoryError, IOError);
+
+    ~Database();
+
+    const Table<Vehicle> *const getVehicleRef() const;
+    const Table<User> *const getUserRef() const;
+    const Table<Trip> *const getTripRef() const;
+
+    const Vehicle *const getVehicle(string registrationNo) const throw(RecordNotFoundError);
+    const User *const getUser(string contactNo) const throw(RecordNotFoundError);
+    const User *getUserForId(long recordId) const throw(RecordNotFoundError);
+    void forEachUser(function<void(const User &)> visit) const throw(IOError);
+    const vector<const Vehicle *> getVehicle(Date startDate, Date endDate, VehicleType type) const;
+    const vector<const Trip *> getTripsForUser(long userId) const;
+    const vector<const Trip *> getTripsForVehicle(long vehicleId) const;
+    const vector<const Trip *> getTripsStarting(Date firstDay, Date lastDay) const;
+    const vector<const Trip *> getTripsEnding(Date firstDay, Date lastDay) const;
+    const vector<const Trip *> getTripsActiveOn(Date day) const;
+    const TripCalendar &getTripCalendar() const;
+    Cursor<Vehicle> vehicles() const;
+    Cursor<User> users() const;
+    Cursor<Trip> trips() const;
+    ArchivedTrip getArchivedTrip(long recordId) const throw(IOError, RecordNotFoundError);
+    void forEachArchivedTrip(function<void(const ArchivedTrip &)> visit) const throw(IOError);
+    shared_future<void> flush();
+    void flush(function<void(exception_ptr)> done);
+    Money repriceHistory(const PricingEngine &engine) const throw(IOError);
+    void exportTrips(TripExporter &exporter) const throw(IOError);
+    ImportReport importVehicles(istream &in, ostream &rejects, unsigned threads) throw(IOError);
+    ImportReport importUsers(istream &in, ostream &rejects, unsigned threads) throw(IOError);
+    long applyLogEntry(const string &entry);
+    vector<BookingResult> bookBatch(const vector<BookingRequest> &requests) throw(IOError);
+    CacheStats getAvailabilityCacheStats() const;
+    TelemetryIngest &getTelemetry() const;
+    Query *compileQuery(const string &text) const throw(QueryError);
+    Update *compileUpdate(const string &text) throw(QueryError);
+    size_t updateWhere(const string &text, unsigned threads) throw(QueryError, IOError, RecordNotFoundError);
+    vector<const Vehicle *> searchVehicles(const string &text, size_t limit) const;
+    vector<const User *> searchUsers(const string &text, size_t limit) const;
+    void watchFiles();
+    void watchTelemetry();
+    void shipMutations() throw(IOError);
+    void shareRecordIds(atomic<long> *vehicleIds, atomic<long> *tripIds);
+    void applyFileChanges() throw(IOError);
+    shared_future<void> startBackup(string location) throw(IOError);
+    ReplayReport replayWorkload(const vector<WorkloadCall> &calls, double speed, unsigned threads);
+    static bool selfCheck(string location, ostream &out) throw(IOError, MemoryError);
+
+    template <class T>
+    void addNewRecord(T *record) throw(IOError, MemoryError);
+    template <class T>
+    void updateRecord(T *record) throw(IOError, RecordNotFoundError);
+    template <class T>
+    void updateRecords(vector<T> &records) throw(IOError, RecordNotFoundError);
+    template <class T>
+    void deleteRecord(T *record) throw(IOError, RecordNotFoundError, RecordInUseError);
+
+    friend class Compaction;
+    friend class HotReload;
+    friend class Backup;
+    friend class TelemetryFeed;
+};
+
+//Asynchronous front of a database, for serving many clients from one
+//thread. Every call is queued on an event loop that owns the database and
+//answered by calling done on that thread with the result and a null error,
+//or with the exception the call threw. Reads are answered in the turn they
+//run in. Writes are answered once they are on disk, but the loop does not
+//wait for the disk: one flush is asked for per turn and its answers are
+//posted back by the persistence thread. Bookings queued in the same turn
+//are served together by one bookBatch.
+class AsyncDatabase
+{
+    struct Booking
+    {
+        BookingRequest request;
+        function<void(const BookingResult &, exception_ptr)> done;
+    };
+    Database *database;
+    // only touched on the loop thread
+    vector<Booking> bookings;
+    vector<function<void(exception_ptr)>> waitingForDisk;
+    // calls not answered yet, the destructor waits for them
+    long unanswered;
+    mutex lock;
+    condition_variable answered;
+    EventLoop loop;
+
+    void accept();
+    void finish(long calls);
+    void bookPending();
+    void whenWritten(function<void(exception_ptr)> done);
+    void flushWaiting();
+public:
+    AsyncDatabase(Database *database);
+    ~AsyncDatabase();
+    void getVehicleAsync(string registrationNo, function<void(const Vehicle *, exception_ptr)> done);
+    void getUserAsync(string contactNo, function<void(const User *, exception_ptr)> done);
+    template <class T>
+    void addNewRecordAsync(T record, function<void(long, exception_ptr)> done);
+    void bookAsync(BookingRequest request, function<void(const BookingResult &, exception_ptr)> done);
+};
+
+//Kinds of values a query column holds, dates compare as day numbers
+typedef enum { numberColumn = 1, textColumn = 2, dateColumn = 3 } QueryColumnKind;
+
+//A column of a table as queries see it. Every column can be formatted as
+//text, number and date columns can also be read as a number for comparing.
+template<typename T>
+struct QueryColumn
+{
+    const char *name;
+    QueryColumnKind kind;
+    double (*number)(const T &);
+    string (*text)(const T &);
+};
+
+//A column a set-based update can change. Number columns take = += -= and
+//*=, the others only =. The setters throw QueryError on a value the record
+//cannot take.
+template<typename T>
+struct UpdateColumn
+{
+    const char *name;
+    QueryColumnKind kind;
+    void (*setNumber)(T &, double);
+    void (*setText)(T &, const string &);
+};
+
+//The columns of each table and the indexes a query can use instead of a scan
+template<typename T> struct QuerySchema;
+
+template<> struct QuerySchema<Vehicle>
+{
+    static const char *name() { return "vehicles"; }
+    static const vector<QueryColumn<Vehicle>> &columns();
+    static const Table<Vehicle> *table(const Database &database) { return database.getVehicleRef(); }
+    static bool hasIndex(const string &) { return false; }
+    static vector<const Vehicle *> index(const Database &, const string &, long) { return {}; }
+    static bool hasRangeIndex(const string &) { return false; }
+    static vector<const Vehicle *> rangeIndex(const Database &, const string &, long, long) { return {}; }
+    static const vector<UpdateColumn<Vehicle>> &updateColumns();
+};
+
+template<> struct QuerySchema<User>
+{
+    static const char *name() { return "users"; }
+    static const vector<QueryColumn<User>> &columns();
+    static const Table<User> *table(const Database &database) { return database.getUserRef(); }
+    static bool hasIndex(const string &) { return false; }
+    static vector<const User *> index(const Database &, const string &, long) { return {}; }
+    static bool hasRangeIndex(const string &) { return false; }
+    static vector<const User *> rangeIndex(const Database &, const string &, long, long) { return {}; }
+    static const vector<UpdateColumn<User>> &updateColumns();
+};
+
+template<> struct QuerySchema<Trip>
+{
+    static const char *name() { return "trips"; }
+    static const vector<QueryColumn<Trip>> &columns();
+    static const Table<Trip> *table(const Database &database) { return database.getTripRef(); }
+    static bool hasIndex(const string &column) { return column == "vehicle" || column == "user"; }
+    static vector<const Trip *> index(const Database &database, const string &column, long key);
+    static bool hasRangeIndex(const string &column) { return column == "start" || column == "end"; }
+    static vector<const Trip *> rangeIndex(const Database &database, const string &column, long first, long last);
+    static const vector<UpdateColumn<Trip>> &updateColumns();
+};
+
+//A query compiled against one table of a database. The text has the form
+//  <table> [where <column> <op> <value> [and ...]] [select <column>,...] [limit <n>]
+//with op one of = != < <= > >=. Compiling resolves the columns, parses the
+//values and picks how the records are reached once, so running it only
+//evaluates prepared predicates on the columns they name and formats only the
+//selected columns. Conditions on the id narrow a binary search over the
+//sorted records, an equality on an indexed column reads the index instead
+//and, without one, conditions on a trip date read its range of the calendar.
+class Query
+{
+public:
+    virtual ~Query() {}
+    virtual vector<string> getColumns() const = 0;
+    virtual string explain() const = 0;
+    virtual void run(function<void(const vector<string> &)> emit) const = 0;
+};
+
+template<typename T>
+class TableQuery : public Query
+{
+    const Database *database;
+    vector<const QueryColumn<T> *> projection;
+    vector<function<bool(const T &)>> filters;
+    // the conditions behind the filters, for explain
+    vector<string> conditions;
+    // filters on numbers and dates, which come before those on text
+    size_t numberFilters;
+    long firstId;
+    long lastId;
+    // empty when the records are not read from an index
+    string indexColumn;
+    long indexKey;
+    // the date column whose conditions bound a range of day numbers
+    string rangeColumn;
+    long rangeFirst;
+    long rangeLast;
+    size_t limit;
+
+    const QueryColumn<T> *findColumn(const string &name) const throw(QueryError);
+    void addCondition(const string &column, const string &op, const string &value) throw(QueryError);
+public:
+    TableQuery(const Database *database, const vector<string> &tokens) throw(QueryError);
+    vector<string> getColumns() const;
+    string explain() const;
+    void run(function<void(const vector<string> &)> emit) const;
+    void forEach(function<void(const T &)> visit) const;
+    bool matches(const T &record) const;
+    bool scansTable() const;
+    const QueryColumn<T> *getColumn(const string &name) const throw(QueryError);
+};
+
+//A set-based change compiled from
+//  <table> [where <column> <op> <value> [and ...]] set <column> <op> <value> [, ...]
+//with the set ops = += -= *=, for example
+//  vehicles where type = car and company = Toyota set price *= 1.05
+//The records are chosen with the plan of the same query and every change is
+//worked out before anything is applied. Database::updateRecords then
+//changes them in one pass and one write, all of them or none.
+class Update
+{
+public:
+    virtual ~Update() {}
+    virtual string explain() const = 0;
+    virtual size_t run(unsigned threads) throw(QueryError, IOError, RecordNotFoundError) = 0;
+};
+
+template<typename T>
+class TableUpdate : public Update
+{
+    struct Change
+    {
+        const UpdateColumn<T> *column;
+        // the column as queries read it, for += -= and *=
+        const QueryColumn<T> *current;
+        string op;
+        double number;
+        string text;
+    };
+    Database *database;
+    TableQuery<T> selection;
+    vector<Change> changes;
+
+    void apply(T &record) const throw(QueryError);
+    void collect(const T &record, vector<T> &updated) const throw(QueryError);
+public:
+    TableUpdate(Database *database, const vector<string> &tokens, size_t set) throw(QueryError);
+    string explain() const;
+    size_t run(unsigned threads) throw(QueryError, IOError, RecordNotFoundError);
+};
+
+//Vehicles and their trips partitioned by the prefix of the registration
+//number. Every shard is an independent Database with its own files, its own
+//persistence thread and its own lock, so unrelated depots do not wait for
+//each other. Users are kept once, in the root location, and shared by all
+//shards. Vehicle and trip ids come from one sequence for all the shards.
+//A shard's trips.txt has slots only for its own trips, whatever their ids.
+class ShardedDatabase
+{
+    struct Shard
+    {
+        Database *db;
+        mutex lock;
+    };
+    string location;
+    Database *root;
+    // shards read the shared users under it, adding one takes it alone.
+    // Paged users are read into the shared table, so shards take it alone too.
+    shared_timed_mutex usersLock;
+    map<string, Shard *> shards;
+    // guards the shard map while a shard is added
+    mutex shardsLock;
+    // last vehicle and trip ids given out by any shard
+    atomic<long> vehicleIds;
+    atomic<long> tripIds;
+
+    static string shardLocation(string location, string key);
+    Shard *getShard(string key, bool create) throw(IOError, MemoryError, RecordNotFoundError);
+    void withUsers(function<void()> operation);
+    void cleanUp();
+public:
+    ShardedDatabase(string location) throw(IOError, MemoryError);
+    ~ShardedDatabase();
+    static string shardKey(string registrationNo);
+    static void split(const Database &source, string location) throw(IOError);
+    const User *getUser(string contactNo) throw(RecordNotFoundError);
+    void addUser(User *user) throw(IOError, MemoryError);
+    void addVehicle(Vehicle *vehicle) throw(IOError, MemoryError);
+    void withShard(string registrationNo, function<void(Database &)> operation) throw(IOError, MemoryError, RecordNotFoundError);
+    const vector<const Vehicle *> getVehicle(Date startDate, Date endDate, VehicleType type);
+};
+
+//Read-only replica of the database at a location, kept current by tailing
+//the primary's mutation log on a background thread. Queries run through
+//query() so they never see a log entry half applied.
+class LogFollower
+{
+    string location;
+    Database *replica;
+    mutex lock;
+    // bytes of the log applied so far and the last sequence number seen
+    streamoff offset;
+    long sequence;
+    atomic<bool> stopping;
+    thread worker;
+
+    // epoch of the log the replica follows, 0 before there is a log
+    long long epoch;
+
+    bool readHeader(ifstream &log, long long &epoch, streamoff &start);
+    void reload(long long epoch, streamoff start) throw(IOError, MemoryError);
+    void poll();
+    void run();
+public:
+    LogFollower(string location) throw(IOError, MemoryError);
+    ~LogFollower();
+    long getSequence();
+    void query(function<void(const Database &)> read);
+};
+
+//Applicaton class that keeps a record of the database and is responsible for driving the program.
+class Application{
+    // opened by the menu or by a command that needs it
+    Database *db;
+    // the last backup started from the menu
+    shared_future<void> backup;
+    string backupLocation;
+    void openDatabase(bool readOnly) throw(IOError, MemoryError);
+    void renderMenu();
+    void welcome();
+    void gotoXY(int x, int y) const;
+    void renderAddNewVehicleMenu() const;
     void renderViewVehicleMenu() const;
     void renderEditVehicleMenu() const;
     void renderAddNewUserMenu() const;
@@ -290,21 +1961,132 @@ class Application{
     void renderViewTripMenu() const;
     void renderStartTripMenu() const;
     void renderCompleteTripMenu() const;
+    void renderBackupMenu();
+    string getBackupStatus() const;
     void showDialog(string message, string id="") const;
     void cleanMemory();
+    int printUsage() const;
+    void followerLoop(string location) const;
+    void replayTelemetry(string fileName, long rate, int producers) const;
+    void benchmarkAsync(long requests, long clients);
     
 public:
     Application();
     void start();
+    int runCommand(vector<string> arguments);
 };
 
-//driver code
-int main(){
+//driver code, any arguments run a single batch command instead of the menu
+int main(int argc, char *argv[]){
+    Tracer::enableFromEnvironment();
+    WorkloadRecorder::enableFromEnvironment();
     Application *app = new  Application();
+    if(argc > 1){
+        return app->runCommand(vector<string>(argv + 1, argv + argc));
+    }
     app->start();
     return 0;
 }
 
+atomic<bool> Tracer::enabled(false);
+mutex Tracer::buffersLock;
+vector<shared_ptr<TraceBuffer>> Tracer::buffers;
+
+void Tracer::enable(bool on){
+    enabled.store(on, memory_order_relaxed);
+}
+
+bool Tracer::isEnabled(){
+    return enabled.load(memory_order_relaxed);
+}
+
+void Tracer::enableFromEnvironment(){
+    if(getenv(TRACEENVIRONMENT) && *getenv(TRACEENVIRONMENT)){
+        enable(true);
+        atexit(dumpAtExit);
+    }
+}
+
+void Tracer::dumpAtExit(){
+    try{
+        dumpToFile(getenv(TRACEENVIRONMENT));
+    }
+    catch(IOError e){
+        cerr<<e.getMessage()<<"\n";
+    }
+}
+
+long long Tracer::now(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//The buffer of the calling thread, registered on first use and kept alive by
+//the registry so spans of finished threads can still be dumped
+TraceBuffer &Tracer::localBuffer(){
+    thread_local shared_ptr<TraceBuffer> buffer;
+    if(!buffer){
+        buffer = make_shared<TraceBuffer>();
+        buffer->events.resize(TRACEBUFFERSPANS);
+        buffer->recorded = 0;
+        lock_guard<mutex> guard(buffersLock);
+        buffer->threadId = buffers.size() + 1;
+        buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+void Tracer::record(const char *name, long long start, long long end){
+    TraceBuffer &buffer = localBuffer();
+    lock_guard<mutex> guard(buffer.lock);
+    buffer.events[buffer.recorded % TRACEBUFFERSPANS] = TraceEvent{name, start, end - start};
+    buffer.recorded++;
+}
+
+//Writes the spans of all threads as complete ("X") events in microseconds
+void Tracer::dump(ostream &out){
+    vector<shared_ptr<TraceBuffer>> snapshot;
+    {
+        lock_guard<mutex> guard(buffersLock);
+        snapshot = buffers;
+    }
+    out<<"{\"traceEvents\":[";
+    bool first = true;
+    for(auto &buffer: snapshot){
+        lock_guard<mutex> guard(buffer->lock);
+        size_t count = min(buffer->recorded, TRACEBUFFERSPANS);
+        for(size_t i = buffer->recorded - count; i < buffer->recorded; i++){
+            const TraceEvent &event = buffer->events[i % TRACEBUFFERSPANS];
+            out<<(first ? "\n" : ",\n")<<"{\"name\":\""<<event.name<<"\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+               <<buffer->threadId<<",\"ts\":"<<event.start / 1000<<"."<<setw(3)<<setfill('0')<<event.start % 1000
+               <<",\"dur\":"<<event.duration / 1000<<"."<<setw(3)<<event.duration % 1000<<setfill(' ')<<"}";
+            first = false;
+        }
+    }
+    out<<"\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void Tracer::dumpToFile(const string &fileName) throw(IOError){
+    ofstream out(fileName);
+    if(!out){
+        throw IOError();
+    }
+    dump(out);
+    if(!out){
+        throw IOError();
+    }
+}
+
+TraceSpan::TraceSpan(const char *name){
+    this->name = name;
+    this->start = Tracer::isEnabled() ? Tracer::now() : -1;
+}
+
+TraceSpan::~TraceSpan(){
+    if(this->start >= 0){
+        Tracer::record(this->name, this->start, Tracer::now());
+    }
+}
+
 Date::Date(){
     time_t now = time(nullptr);
     this->empty = false;
@@ -312,6 +2094,7 @@ Date::Date(){
 }
 
 Date::Date(string date) throw (DateParsingError){
+    TRACE_SPAN("Date::parse");
     if(date.length()<0){
         this->empty=true;
         return;
@@ -335,54 +2118,120 @@ Date::Date(string date) throw (DateParsingError){
     }
 }
 
+Date::Date(long day, long month, long year){
+    this->set(day, month, year);
+}
+
+//Days past the end of the month roll over into the next one, as mktime does
+void Date::set(long day, long month, long year){
+    splitDayNumber(dayNumberOf(day, month, year), day, month, year);
+    this->empty = false;
+    this->date = tm();
+    this->date.tm_mday = day;
+    this->date.tm_mon = month-1;
+    this->date.tm_year = year-1900;
+}
+
+//Reads a d/m/yyyy field without copying it. Anything unusual is left to
+//the string constructor so it is read exactly as before, an empty field
+//is the empty date toString writes.
+Date Date::parse(const char *begin, const char *end){
+    if(begin == end){
+        Date date(1, 1, 1970);
+        date.empty = true;
+        return date;
+    }
+    long parts[3];
+    const char *at = begin;
+    for(int part = 0; part < 3; part++){
+        if(part > 0){
+            if(at == end || *at != DATEDELIMETER){
+                return Date(string(begin, end));
+            }
+            at++;
+        }
+        const char *digits = at;
+        parts[part] = 0;
+        for(; at != end && at - digits < 9 && isdigit(*at); at++){
+            parts[part] = parts[part]*10 + (*at - '0');
+        }
+        if(at == digits){
+            return Date(string(begin, end));
+        }
+    }
+    if(at != end || parts[1] < 1 || parts[1] > 12){
+        return Date(string(begin, end));
+    }
+    return Date(parts[0], parts[1], parts[2]);
+}
+
 bool Date::isEmpty() const{
     return this->empty;
 }
 
-string Date:: toString() const{
+void Date::appendTo(string &out) const{
     if(this->empty)
-        return "";
-    stringstream ss;
-    ss<<this->date.tm_mday<<"/"<<this->date.tm_mon+1<<"/"<<this->date.tm_year+1900;
-    return ss.str();
+        return;
+    appendNumber(out, this->date.tm_mday);
+    out.push_back(DATEDELIMETER);
+    appendNumber(out, this->date.tm_mon+1);
+    out.push_back(DATEDELIMETER);
+    appendNumber(out, this->date.tm_year+1900);
+}
+
+string Date:: toString() const{
+    string out;
+    this->appendTo(out);
+    return out;
+}
+
+//Number of days since 1/1/1970 of the date, used for compact storage and
+//date arithmetic.
+long Date::getDayNumber() const{
+    return dayNumberOf(this->date.tm_mday, this->date.tm_mon + 1, this->date.tm_year + 1900);
+}
+
+//Based on the days-from-civil algorithm
+long Date::dayNumberOf(long day, long month, long year){
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long yearOfEra = year - era * 400;
+    long dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+Date Date::fromDayNumber(long dayNumber){
+    long day, month, year;
+    splitDayNumber(dayNumber, day, month, year);
+    return Date(day, month, year);
+}
+
+//Day, month and year of a day number, the inverse of getDayNumber
+void Date::splitDayNumber(long dayNumber, long &day, long &month, long &year){
+    dayNumber += 719468;
+    long era = (dayNumber >= 0 ? dayNumber : dayNumber - 146096) / 146097;
+    long dayOfEra = dayNumber - era * 146097;
+    long yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    long dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    long monthIndex = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    year = yearOfEra + era * 400 + (month <= 2);
 }
 
 bool Date::operator>(Date date) const{
     if(this->isEmpty()|| date.isEmpty()){
         return false;
     }
-    int dyear = this->date.tm_year - date.date.tm_year;
-    int dmonth = this->date.tm_mon - date.date.tm_mon;
-    int dday = this->date.tm_mday - this->date.tm_mday;
-
-    if(dyear!=0){
-        return dyear>0;
-    }
-    else if(dmonth!=0){
-        return dmonth>0;
-    }
-    else{
-        return dday>0;
-    }
+    return this->getDayNumber() > date.getDayNumber();
 }
 
 bool Date::operator<(Date date) const{
     if(this->isEmpty()|| date.isEmpty()){
         return false;
     }
-    int dyear = this->date.tm_year - date.date.tm_year;
-    int dmonth = this->date.tm_mon - date.date.tm_mon;
-    int dday = this->date.tm_mday - this->date.tm_mday;
-
-    if(dyear!=0){
-        return dyear<0;
-    }
-    else if(dmonth!=0){
-        return dmonth<0;
-    }
-    else{
-        return dday<0;
-    }
+    return this->getDayNumber() < date.getDayNumber();
 }
 
 bool Date:: operator>=(Date date) const{
@@ -393,40 +2242,248 @@ bool Date:: operator<=(Date date) const{
     return !(*this>date);
 }
 
-Vehicle::Vehicle(
-            string registrationNumber, 
-            VehicleType type,
-            int seats,
-            string companyName,
-            double pricePerKm,
-            Date PUCExpirationDate,
-            long recordId
-        ): Entity(recordId){
-    this->registrationNumber = registrationNumber;
-    this->type = type;
-    this->seats = seats;
-    this->companyName = companyName;
-    this->pricePerKm = pricePerKm;
-    this->PUCExpirationDate = PUCExpirationDate;
+Money::Money(long long paise){
+    this->paise = paise;
 }
 
-string Vehicle::getRegistrationNumber() const{
-    return this->registrationNumber;
+Money Money::fromRupees(double rupees){
+    return Money(llround(rupees * 100));
 }
 
-VehicleType Vehicle::getVehicleType() const{
-    return this->type;
+//Parses amounts such as "630", "31.5" or "31.500000" without going through
+//a double. Digits past the paise are rounded half up.
+Money Money::parse(string amount) throw(Error){
+    size_t position = 0;
+    bool negative = false;
+    if(position < amount.length() && (amount[position] == '-' || amount[position] == '+')){
+        negative = amount[position] == '-';
+        position++;
+    }
+    long long rupees = 0, paise = 0;
+    bool digits = false;
+    for(; position < amount.length() && isdigit(amount[position]); position++){
+        rupees = rupees * 10 + (amount[position] - '0');
+        digits = true;
+    }
+    if(position < amount.length() && amount[position] == '.'){
+        position++;
+        for(int place = 0; position < amount.length() && isdigit(amount[position]); position++, place++){
+            if(place < 2){
+                paise = paise * 10 + (amount[position] - '0');
+            }
+            else if(place == 2 && amount[position] >= '5'){
+                paise++;
+            }
+            digits = true;
+        }
+        // a single digit after the point is tenths of a rupee
+        if(amount.find('.') + 2 == position){
+            paise *= 10;
+        }
+    }
+    if(!digits || position != amount.length()){
+        throw Error("Invalid amount: " + amount);
+    }
+    long long total = rupees * 100 + paise;
+    return Money(negative ? -total : total);
 }
 
-int Vehicle::getSeats() const{
-    return this->seats;
+long long Money::getPaise() const{
+    return this->paise;
 }
 
-string Vehicle::getCompanyName() const{
-    return this->companyName;
+Money Money::operator+(Money other) const{
+    return Money(this->paise + other.paise);
 }
 
-double Vehicle::getPricePerKm() const{
+Money Money::operator-(Money other) const{
+    return Money(this->paise - other.paise);
+}
+
+bool Money::operator<(Money other) const{
+    return this->paise < other.paise;
+}
+
+bool Money::operator==(Money other) const{
+    return this->paise == other.paise;
+}
+
+//Whole amounts are written without paise, as fares always were
+string Money::toString() const{
+    long long magnitude = this->paise < 0 ? -this->paise : this->paise;
+    stringstream ss;
+    if(this->paise < 0){
+        ss<<'-';
+    }
+    ss<<magnitude/100;
+    if(magnitude%100){
+        ss<<'.'<<setw(2)<<setfill('0')<<magnitude%100;
+    }
+    return ss.str();
+}
+
+ostream &operator<<(ostream &out, Money amount){
+    return out<<amount.toString();
+}
+
+template<> struct TariffFor<VehicleType::bike>
+{
+    static constexpr Tariff tariff() { return Tariff{5000, 0, 100, 300, 90, 80, 0}; }
+};
+
+template<> struct TariffFor<VehicleType::car>
+{
+    static constexpr Tariff tariff() { return Tariff{20000, 50000, 100, 300, 90, 80, 20}; }
+};
+
+template<> struct TariffFor<VehicleType::bus>
+{
+    static constexpr Tariff tariff() { return Tariff{200000, 300000, 100, 300, 90, 75, 25}; }
+};
+
+//Number of Saturdays and Sundays between two day numbers, both included.
+//Day 0 (1/1/1970) was a Thursday.
+long countWeekendDays(long startDay, long endDay)
+{
+    if (endDay < startDay)
+    {
+        return 0;
+    }
+    long days = endDay - startDay + 1;
+    long count = days / 7 * 2;
+    for (long day = startDay + days / 7 * 7; day <= endDay; day++)
+    {
+        long weekday = ((day + 4) % 7 + 7) % 7;
+        count += weekday == 0 || weekday == 6;
+    }
+    return count;
+}
+
+//The fare formula shared by live quotes and batch re-pricing. It is inline
+//and branch free so constant tariffs fold away and batches vectorise.
+inline long long computeFare(const Tariff &tariff, long long pricePerKm, long distance, long days, long weekendDays)
+{
+    long firstTier = min(distance, tariff.firstTierKm);
+    long secondTier = max(0L, min(distance, tariff.secondTierKm) - tariff.firstTierKm);
+    long thirdTier = max(0L, distance - tariff.secondTierKm);
+    long long distanceCharge =
+        (pricePerKm * (firstTier * 100LL + secondTier * tariff.secondTierPercent +
+                       thirdTier * tariff.thirdTierPercent) + 50) / 100;
+    long long dayCharge = tariff.perDay * days +
+        (tariff.perDay * weekendDays * tariff.weekendSurchargePercent + 50) / 100;
+    return max(tariff.minimumFare, distanceCharge + dayCharge);
+}
+
+void PricingBatch::add(VehicleType type, double pricePerKm, long distance, long startDay, long endDay){
+    this->type.push_back(type);
+    this->pricePerKm.push_back(Money::fromRupees(pricePerKm).getPaise());
+    this->distance.push_back(distance);
+    this->days.push_back(max(1L, endDay - startDay + 1));
+    this->weekendDays.push_back(countWeekendDays(startDay, endDay));
+}
+
+size_t PricingBatch::size() const{
+    return this->type.size();
+}
+
+void PricingBatch::clear(){
+    this->distance.clear();
+    this->days.clear();
+    this->weekendDays.clear();
+    this->pricePerKm.clear();
+    this->type.clear();
+}
+
+PricingEngine::PricingEngine(){
+    this->tariffs[0] = Tariff{0, 0, 0, 0, 0, 0, 0};
+    this->tariffs[VehicleType::bike] = TariffFor<VehicleType::bike>::tariff();
+    this->tariffs[VehicleType::car] = TariffFor<VehicleType::car>::tariff();
+    this->tariffs[VehicleType::bus] = TariffFor<VehicleType::bus>::tariff();
+}
+
+void PricingEngine::setTariff(VehicleType type, Tariff tariff){
+    this->tariffs[type] = tariff;
+}
+
+Tariff PricingEngine::getTariff(VehicleType type) const{
+    return this->tariffs[type];
+}
+
+template<VehicleType V>
+Money PricingEngine::quote(double pricePerKm, long distance, long startDay, long endDay){
+    return Money(computeFare(TariffFor<V>::tariff(),
+                             Money::fromRupees(pricePerKm).getPaise(),
+                             distance,
+                             max(1L, endDay - startDay + 1),
+                             countWeekendDays(startDay, endDay)));
+}
+
+Money PricingEngine::quote(VehicleType type, double pricePerKm, long distance, Date startDate, Date endDate){
+    long startDay = startDate.isEmpty() ? 0 : startDate.getDayNumber();
+    long endDay = endDate.isEmpty() ? startDay : endDate.getDayNumber();
+    switch (type)
+    {
+        case VehicleType::bike:
+            return quote<VehicleType::bike>(pricePerKm, distance, startDay, endDay);
+        case VehicleType::car:
+            return quote<VehicleType::car>(pricePerKm, distance, startDay, endDay);
+        case VehicleType::bus:
+            return quote<VehicleType::bus>(pricePerKm, distance, startDay, endDay);
+        default:
+            return Money::fromRupees(distance * pricePerKm);
+    }
+}
+
+//Re-prices every trip of the batch with the engine's tariffs in one pass
+//over the columns, writing the fares in paise.
+void PricingEngine::reprice(const PricingBatch &batch, vector<long long> &fares) const{
+    size_t count = batch.size();
+    fares.resize(count);
+    const long *distance = batch.distance.data();
+    const long *days = batch.days.data();
+    const long *weekendDays = batch.weekendDays.data();
+    const long long *pricePerKm = batch.pricePerKm.data();
+    const int *type = batch.type.data();
+    long long *out = fares.data();
+    for(size_t i = 0; i < count; i++){
+        out[i] = computeFare(this->tariffs[type[i] & 3], pricePerKm[i], distance[i], days[i], weekendDays[i]);
+    }
+}
+
+Vehicle::Vehicle(
+            string registrationNumber, 
+            VehicleType type,
+            int seats,
+            string companyName,
+            double pricePerKm,
+            Date PUCExpirationDate,
+            long recordId
+        ): Entity(recordId){
+    this->registrationNumber = registrationNumber;
+    this->type = type;
+    this->seats = seats;
+    this->companyName = companyName;
+    this->pricePerKm = pricePerKm;
+    this->PUCExpirationDate = PUCExpirationDate;
+}
+
+string Vehicle::getRegistrationNumber() const{
+    return this->registrationNumber;
+}
+
+VehicleType Vehicle::getVehicleType() const{
+    return this->type;
+}
+
+int Vehicle::getSeats() const{
+    return this->seats;
+}
+
+string Vehicle::getCompanyName() const{
+    return this->companyName;
+}
+
+double Vehicle::getPricePerKm() const{
     return this->pricePerKm;
 }
 
@@ -467,15 +2524,9 @@ void Vehicle::display() const{
 }
 
 string Vehicle::toString() const{
-    stringstream ss;
-    ss<<recordId<<DELIMETER
-      <<registrationNumber<<DELIMETER
-      <<type<<DELIMETER
-      <<seats<<DELIMETER
-      <<companyName<<DELIMETER
-      <<to_string(pricePerKm)<<DELIMETER
-      <<PUCExpirationDate.toString();
-      return ss.str();
+    string line;
+    RecordCodec<Vehicle>::format(*this, line);
+    return line;
 }
 
 void Vehicle::setDataFrom(Entity *s){
@@ -514,12 +2565,9 @@ void User ::display() const
 
 string User ::toString() const
 {
-    stringstream ss;
-    ss << recordId << DELIMETER
-    << name << DELIMETER
-    << contact << DELIMETER
-    << email;
-    return ss.str();
+    string line;
+    RecordCodec<User>::format(*this, line);
+    return line;
 }
 
 void User ::setDataFrom(Entity *s)
@@ -534,7 +2582,7 @@ void User ::setDataFrom(Entity *s)
     }
 }
 
-Trip ::Trip(const Vehicle*vehicle, const User * user, Date startDate, Date endDate, long recordId, long startReading, long endReading, double fare, bool isCompleted) : Entity(recordId)
+Trip ::Trip(const Vehicle*vehicle, const User * user, Date startDate, Date endDate, long recordId, long startReading, long endReading, Money fare, bool isCompleted) : Entity(recordId)
 {
     this->vehicle = vehicle;
     this->user = user;
@@ -552,7 +2600,7 @@ Date Trip ::getStartDate() const { return this->startDate; }
 Date Trip ::getEndDate() const { return this->endDate; }
 long Trip ::getStartReading() const { return this->startReading; }
 long Trip ::getEndReading() const { return this->endReading; }
-long Trip ::getFare() const { return this->fare; }
+Money Trip ::getFare() const { return this->fare; }
 bool Trip ::isCompleted() const { return this->completed; }
 
 void Trip ::startTrip(long startReading)
@@ -560,7 +2608,7 @@ void Trip ::startTrip(long startReading)
     this->startReading = startReading;
 }
 
-double Trip ::completeTrip(long endReading)
+Money Trip ::completeTrip(long endReading)
 {
     if (this->completed)
     {
@@ -568,7 +2616,10 @@ double Trip ::completeTrip(long endReading)
     }
 
     this->endReading = endReading;
-    this->fare = (this->endReading - this->startReading) * this->vehicle->getPricePerKm(); 
+    this->fare = PricingEngine::quote(this->vehicle->getVehicleType(),
+                                      this->vehicle->getPricePerKm(),
+                                      this->endReading - this->startReading,
+                                      this->startDate, this->endDate);
     this->completed = true;
     return this->fare;
 }
@@ -597,414 +2648,7534 @@ void Trip ::display() const
         tripStatus = "On going";
         cout << "Start Reading : " << this->startReading << endl;
     }
-    if (this->completed)
+    if (this->completed)
+    {
+        tripStatus = "Completed";
+        cout << "End reading : " << this->endReading << endl;
+        cout << "Total run : " << this->endReading - this->startReading << endl;
+        cout << "Total fare : " << this->fare << endl;
+    }
+
+    cout << "Trip status : " << tripStatus << endl;
+}
+
+string Trip ::toString() const
+{
+    string line;
+    RecordCodec<Trip>::format(*this, line);
+    return line;
+}
+
+void Trip ::setDataFrom(Entity *s)
+{
+    Trip *t = static_cast<Trip *>(s); // keyword
+    if (t)
+    {
+        this->vehicle = t->vehicle;
+        this->user = t->user;
+        this->startDate = t->startDate;
+        this->endDate = t->endDate;
+        this->startReading = t->startReading;
+        this->endReading = t->endReading;
+        this->fare = t->fare;
+        this->completed = t->completed;
+    }
+}
+
+//Helpers for the variable length integers used by the trip archive.
+//Signed values are zigzag encoded so small negative deltas stay short.
+void writeVarint(string &out, unsigned long long value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(char(value));
+}
+
+void writeSignedVarint(string &out, long long value)
+{
+    writeVarint(out, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+bool readVarint(istream &in, unsigned long long &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = in.get();
+        if (byte == EOF)
+        {
+            return false;
+        }
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool readSignedVarint(istream &in, long long &value)
+{
+    unsigned long long raw;
+    if (!readVarint(in, raw))
+    {
+        return false;
+    }
+    value = (long long)(raw >> 1) ^ -(long long)(raw & 1);
+    return true;
+}
+
+//The same for data held in memory, at is moved past what was read
+bool readVarint(const char *&at, const char *end, unsigned long long &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && at != end; shift += 7)
+    {
+        unsigned char byte = *at++;
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool readSignedVarint(const char *&at, const char *end, long long &value)
+{
+    unsigned long long raw;
+    if (!readVarint(at, end, raw))
+    {
+        return false;
+    }
+    value = (long long)(raw >> 1) ^ -(long long)(raw & 1);
+    return true;
+}
+
+constexpr decltype(EntitySchema<Vehicle>::fields) EntitySchema<Vehicle>::fields;
+constexpr decltype(EntitySchema<User>::fields) EntitySchema<User>::fields;
+constexpr decltype(EntitySchema<Trip>::fields) EntitySchema<Trip>::fields;
+
+template<typename M>
+void IntegerCodec<M>::format(M value, string &out)
+{
+    appendNumber(out, value);
+}
+
+template<typename M>
+template<typename Context>
+void IntegerCodec<M>::parse(const char *begin, const char *end, M &value, Context &)
+{
+    long long number = parseNumber(begin, end);
+    // like stoi did for int fields, a number the field cannot hold is rejected
+    long long largest = sizeof(M) >= sizeof(long long) ? LLONG_MAX : (1LL << (8 * sizeof(M) - 1)) - 1;
+    if (number > largest || number < -largest - 1)
+    {
+        throw out_of_range("IntegerCodec::parse");
+    }
+    value = M(number);
+}
+
+template<typename M>
+void IntegerCodec<M>::encode(M value, string &out)
+{
+    writeSignedVarint(out, value);
+}
+
+template<typename M>
+template<typename Context>
+void IntegerCodec<M>::decode(const char *&at, const char *end, M &value, Context &)
+{
+    long long number;
+    if (!readSignedVarint(at, end, number))
+    {
+        throw out_of_range("IntegerCodec::decode");
+    }
+    value = M(number);
+}
+
+void FieldCodec<bool>::format(bool value, string &out)
+{
+    out.push_back(value ? '1' : '0');
+}
+
+//Anything but 0 counts as set, as it always did
+template<typename Context>
+void FieldCodec<bool>::parse(const char *begin, const char *end, bool &value, Context &)
+{
+    value = !(end - begin == 1 && *begin == '0');
+}
+
+void FieldCodec<bool>::encode(bool value, string &out)
+{
+    out.push_back(value ? 1 : 0);
+}
+
+template<typename Context>
+void FieldCodec<bool>::decode(const char *&at, const char *end, bool &value, Context &)
+{
+    if (at == end)
+    {
+        throw out_of_range("FieldCodec<bool>::decode");
+    }
+    value = *at++ != 0;
+}
+
+//Six decimals, the text to_string gave the files so far
+void FieldCodec<double>::format(double value, string &out)
+{
+    char text[64];
+    int length = snprintf(text, sizeof text, "%f", value);
+    if (length >= (int)sizeof text)
+    {
+        out.append(to_string(value));
+        return;
+    }
+    out.append(text, length);
+}
+
+template<typename Context>
+void FieldCodec<double>::parse(const char *begin, const char *end, double &value, Context &)
+{
+    char text[64];
+    if (end - begin >= (long)sizeof text)
+    {
+        value = stod(string(begin, end));
+        return;
+    }
+    memcpy(text, begin, end - begin);
+    text[end - begin] = '\0';
+    char *stop;
+    value = strtod(text, &stop);
+    if (stop == text)
+    {
+        throw invalid_argument("FieldCodec<double>::parse");
+    }
+}
+
+void FieldCodec<double>::encode(double value, string &out)
+{
+    out.append((const char *)&value, sizeof value);
+}
+
+template<typename Context>
+void FieldCodec<double>::decode(const char *&at, const char *end, double &value, Context &)
+{
+    if (end - at < (long)sizeof value)
+    {
+        throw out_of_range("FieldCodec<double>::decode");
+    }
+    memcpy(&value, at, sizeof value);
+    at += sizeof value;
+}
+
+void FieldCodec<string>::format(const string &value, string &out)
+{
+    out.append(value);
+}
+
+template<typename Context>
+void FieldCodec<string>::parse(const char *begin, const char *end, string &value, Context &)
+{
+    value.assign(begin, end);
+}
+
+void FieldCodec<string>::encode(const string &value, string &out)
+{
+    writeVarint(out, value.length());
+    out.append(value);
+}
+
+template<typename Context>
+void FieldCodec<string>::decode(const char *&at, const char *end, string &value, Context &)
+{
+    unsigned long long length;
+    if (!readVarint(at, end, length) || length > (unsigned long long)(end - at))
+    {
+        throw out_of_range("FieldCodec<string>::decode");
+    }
+    value.assign(at, length);
+    at += length;
+}
+
+void FieldCodec<Date>::format(const Date &value, string &out)
+{
+    value.appendTo(out);
+}
+
+template<typename Context>
+void FieldCodec<Date>::parse(const char *begin, const char *end, Date &value, Context &)
+{
+    value = Date::parse(begin, end);
+}
+
+//A flag for the empty date followed by the day number
+void FieldCodec<Date>::encode(const Date &value, string &out)
+{
+    out.push_back(value.isEmpty() ? 0 : 1);
+    if (!value.isEmpty())
+    {
+        writeSignedVarint(out, value.getDayNumber());
+    }
+}
+
+template<typename Context>
+void FieldCodec<Date>::decode(const char *&at, const char *end, Date &value, Context &)
+{
+    long long dayNumber;
+    if (at == end)
+    {
+        throw out_of_range("FieldCodec<Date>::decode");
+    }
+    if (!*at++)
+    {
+        value = Date::parse(nullptr, nullptr);
+        return;
+    }
+    if (!readSignedVarint(at, end, dayNumber))
+    {
+        throw out_of_range("FieldCodec<Date>::decode");
+    }
+    value = Date::fromDayNumber(dayNumber);
+}
+
+void FieldCodec<Money>::format(Money value, string &out)
+{
+    out.append(value.toString());
+}
+
+template<typename Context>
+void FieldCodec<Money>::parse(const char *begin, const char *end, Money &value, Context &)
+{
+    try
+    {
+        value = Money::parse(string(begin, end));
+    }
+    catch (Error error)
+    {
+        throw invalid_argument(error.getMessage());
+    }
+}
+
+void FieldCodec<Money>::encode(Money value, string &out)
+{
+    writeSignedVarint(out, value.getPaise());
+}
+
+template<typename Context>
+void FieldCodec<Money>::decode(const char *&at, const char *end, Money &value, Context &)
+{
+    long long paise;
+    if (!readSignedVarint(at, end, paise))
+    {
+        throw out_of_range("FieldCodec<Money>::decode");
+    }
+    value = Money(paise);
+}
+
+template<typename R>
+void ReferenceCodec<R>::format(const R *value, string &out)
+{
+    appendNumber(out, value->getRecord());
+}
+
+template<typename R>
+template<typename Context>
+void ReferenceCodec<R>::parse(const char *begin, const char *end, const R *&value, Context &context)
+{
+    context.resolve(parseNumber(begin, end), value);
+}
+
+template<typename R>
+void ReferenceCodec<R>::encode(const R *value, string &out)
+{
+    writeVarint(out, value->getRecord());
+}
+
+template<typename R>
+template<typename Context>
+void ReferenceCodec<R>::decode(const char *&at, const char *end, const R *&value, Context &context)
+{
+    unsigned long long recordId;
+    if (!readVarint(at, end, recordId))
+    {
+        throw out_of_range("ReferenceCodec::decode");
+    }
+    context.resolve(recordId, value);
+}
+
+template<typename T>
+template<typename C, typename M>
+void RecordCodec<T>::formatField(const T &record, const SchemaField<C, M> &field, string &out, size_t position)
+{
+    if (position > 0)
+    {
+        out.push_back(DELIMETER);
+    }
+    FieldCodec<M>::format(record.*field.member, out);
+}
+
+template<typename T>
+template<size_t... I>
+void RecordCodec<T>::formatFields(const T &record, string &out, index_sequence<I...>)
+{
+    int expand[] = {0, (formatField(record, get<I>(EntitySchema<T>::fields), out, I), 0)...};
+    (void)expand;
+}
+
+template<typename T>
+void RecordCodec<T>::format(const T &record, string &out)
+{
+    formatFields(record, out, make_index_sequence<FIELDS>());
+}
+
+//Reads the field up to the next delimiter, at is left past it or null after
+//the last field of the line. Fields the line does not have are an error,
+//fields past the schema's are ignored.
+template<typename T>
+template<typename C, typename M, typename Context>
+void RecordCodec<T>::parseField(T &record, const SchemaField<C, M> &field, const char *&at, const char *end, Context &context)
+{
+    if (!at)
+    {
+        throw out_of_range(string("missing field ") + field.name);
+    }
+    const char *stop = (const char *)memchr(at, DELIMETER, end - at);
+    FieldCodec<M>::parse(at, stop ? stop : end, record.*field.member, context);
+    at = stop ? stop + 1 : nullptr;
+}
+
+template<typename T>
+template<typename Context, size_t... I>
+void RecordCodec<T>::parseFields(T &record, const char *at, const char *end, Context &context, index_sequence<I...>)
+{
+    int expand[] = {0, (parseField(record, get<I>(EntitySchema<T>::fields), at, end, context), 0)...};
+    (void)expand;
+}
+
+template<typename T>
+template<typename Context>
+T *RecordCodec<T>::parse(const char *begin, const char *end, Context &context)
+{
+    unique_ptr<T> record(EntitySchema<T>::make());
+    parseFields(*record, begin, end, context, make_index_sequence<FIELDS>());
+    return record.release();
+}
+
+template<typename T>
+template<typename Context>
+T *RecordCodec<T>::parse(const string &line, Context &context)
+{
+    return parse(line.data(), line.data() + line.length(), context);
+}
+
+template<typename T>
+template<typename C, typename M>
+void RecordCodec<T>::encodeField(const T &record, const SchemaField<C, M> &field, string &out)
+{
+    FieldCodec<M>::encode(record.*field.member, out);
+}
+
+template<typename T>
+template<size_t... I>
+void RecordCodec<T>::encodeFields(const T &record, string &out, index_sequence<I...>)
+{
+    int expand[] = {0, (encodeField(record, get<I>(EntitySchema<T>::fields), out), 0)...};
+    (void)expand;
+}
+
+template<typename T>
+void RecordCodec<T>::encode(const T &record, string &out)
+{
+    encodeFields(record, out, make_index_sequence<FIELDS>());
+}
+
+template<typename T>
+template<typename C, typename M, typename Context>
+void RecordCodec<T>::decodeField(T &record, const SchemaField<C, M> &field, const char *&at, const char *end, Context &context)
+{
+    FieldCodec<M>::decode(at, end, record.*field.member, context);
+}
+
+template<typename T>
+template<typename Context, size_t... I>
+void RecordCodec<T>::decodeFields(T &record, const char *at, const char *end, Context &context, index_sequence<I...>)
+{
+    int expand[] = {0, (decodeField(record, get<I>(EntitySchema<T>::fields), at, end, context), 0)...};
+    (void)expand;
+}
+
+template<typename T>
+template<typename Context>
+T *RecordCodec<T>::decode(const string &data, Context &context)
+{
+    unique_ptr<T> record(EntitySchema<T>::make());
+    decodeFields(*record, data.data(), data.data() + data.length(), context, make_index_sequence<FIELDS>());
+    return record.release();
+}
+
+const string WORKLOADMAGIC = "VMSW1";
+
+atomic<bool> WorkloadRecorder::enabled(false);
+mutex WorkloadRecorder::lock;
+FILE *WorkloadRecorder::out = nullptr;
+string WorkloadRecorder::pending;
+long long WorkloadRecorder::previous = -1;
+
+bool WorkloadRecorder::isEnabled(){
+    return enabled.load(memory_order_relaxed);
+}
+
+void WorkloadRecorder::enable(const string &fileName) throw(IOError){
+    lock_guard<mutex> guard(lock);
+    out = fopen(fileName.c_str(), "wb");
+    if(!out){
+        throw IOError();
+    }
+    pending = WORKLOADMAGIC;
+    previous = -1;
+    enabled.store(true, memory_order_relaxed);
+}
+
+void WorkloadRecorder::enableFromEnvironment(){
+    const char *fileName = getenv(WORKLOADENVIRONMENT);
+    if(!fileName || !*fileName){
+        return;
+    }
+    try{
+        enable(fileName);
+        atexit(flushAtExit);
+    }
+    catch(IOError e){
+        cerr<<e.getMessage()<<"\n";
+    }
+}
+
+void WorkloadRecorder::flushAtExit(){
+    flush();
+}
+
+void WorkloadRecorder::record(WorkloadOperation operation, long long start, long long end, int count, const string &arguments){
+    lock_guard<mutex> guard(lock);
+    if(!out){
+        return;
+    }
+    if(previous < 0){
+        previous = start;
+    }
+    pending.push_back(char(operation));
+    writeSignedVarint(pending, start - previous);
+    writeVarint(pending, end - start);
+    writeVarint(pending, count);
+    pending.append(arguments);
+    previous = start;
+    if(pending.length() >= WORKLOADBUFFERSIZE){
+        fwrite(pending.data(), 1, pending.length(), out);
+        pending.clear();
+    }
+}
+
+void WorkloadRecorder::flush(){
+    lock_guard<mutex> guard(lock);
+    if(!out){
+        return;
+    }
+    fwrite(pending.data(), 1, pending.length(), out);
+    fflush(out);
+    pending.clear();
+}
+
+//Reads a whole trace, ordered by when the calls started. A call cut short
+//at the end, as a program that was killed leaves it, is dropped.
+void WorkloadRecorder::read(const string &fileName, vector<WorkloadCall> &calls) throw(IOError){
+    ifstream in(fileName, ios::binary);
+    string magic(WORKLOADMAGIC.length(), '\0');
+    if(!in || !in.read(&magic[0], magic.length()) || magic != WORKLOADMAGIC){
+        throw IOError();
+    }
+    long long start = 0;
+    for(int operation; (operation = in.get()) != EOF;){
+        WorkloadCall call;
+        long long delta;
+        unsigned long long latency, count;
+        if(!readSignedVarint(in, delta) || !readVarint(in, latency) || !readVarint(in, count)){
+            break;
+        }
+        start += delta;
+        call.operation = WorkloadOperation(operation);
+        call.start = start;
+        call.latency = latency;
+        bool complete = true;
+        for(unsigned long long i = 0; complete && i < count; i++){
+            int tag = in.get();
+            long long number;
+            unsigned long long length;
+            if(tag == 0 && readSignedVarint(in, number)){
+                call.arguments.push_back(to_string(number));
+            }
+            else if(tag == 1 && readVarint(in, length) && length <= WORKLOADBUFFERSIZE){
+                string text(length, '\0');
+                complete = bool(in.read(&text[0], length));
+                call.arguments.push_back(text);
+            }
+            else{
+                complete = false;
+            }
+        }
+        if(!complete){
+            break;
+        }
+        calls.push_back(call);
+    }
+    stable_sort(calls.begin(), calls.end(), [](const WorkloadCall &a, const WorkloadCall &b){ return a.start < b.start; });
+    long long first = calls.empty() ? 0 : calls.front().start;
+    for(auto &call: calls){
+        call.start -= first;
+    }
+}
+
+int &RecordedCall::depth(){
+    thread_local int depth = 0;
+    return depth;
+}
+
+RecordedCall::RecordedCall(WorkloadOperation operation){
+    this->operation = operation;
+    this->count = 0;
+    bool outermost = depth()++ == 0;
+    this->start = outermost && operation != callUnrecorded && WorkloadRecorder::isEnabled() ? Tracer::now() : -1;
+}
+
+RecordedCall::~RecordedCall(){
+    depth()--;
+    if(this->start >= 0){
+        WorkloadRecorder::record(this->operation, this->start, Tracer::now(), this->count, this->arguments);
+    }
+}
+
+bool RecordedCall::isRecording() const{
+    return this->start >= 0;
+}
+
+void RecordedCall::text(const string &value){
+    if(this->isRecording()){
+        this->arguments.push_back(1);
+        writeVarint(this->arguments, value.length());
+        this->arguments.append(value);
+        this->count++;
+    }
+}
+
+void RecordedCall::number(long long value){
+    if(this->isRecording()){
+        this->arguments.push_back(0);
+        writeSignedVarint(this->arguments, value);
+        this->count++;
+    }
+}
+
+LatencyHistogram::LatencyHistogram(){
+    this->counts.assign(256, 0);
+    this->total = 0;
+    this->maximum = 0;
+}
+
+//Values below 4 have a bucket each, above that every power of two is cut
+//into four buckets by the two bits after the leading one
+size_t LatencyHistogram::bucketOf(long long nanoseconds){
+    if(nanoseconds < 4){
+        return max(nanoseconds, 0LL);
+    }
+    int exponent = 2;
+    while((nanoseconds >> (exponent + 1)) > 0){
+        exponent++;
+    }
+    return 4 * (exponent - 1) + ((nanoseconds >> (exponent - 2)) & 3);
+}
+
+long long LatencyHistogram::bucketStart(size_t bucket){
+    if(bucket < 4){
+        return bucket;
+    }
+    return (4LL + bucket % 4) << (bucket / 4 - 1);
+}
+
+void LatencyHistogram::add(long long nanoseconds){
+    this->counts[bucketOf(nanoseconds)]++;
+    this->total++;
+    this->maximum = max(this->maximum, nanoseconds);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other){
+    for(size_t bucket = 0; bucket < this->counts.size(); bucket++){
+        this->counts[bucket] += other.counts[bucket];
+    }
+    this->total += other.total;
+    this->maximum = max(this->maximum, other.maximum);
+}
+
+//The upper end of the bucket holding the percentile
+long long LatencyHistogram::percentile(double fraction) const{
+    long long wanted = (long long)ceil(fraction * this->total);
+    long long seen = 0;
+    for(size_t bucket = 0; bucket < this->counts.size(); bucket++){
+        seen += this->counts[bucket];
+        if(seen >= wanted && seen > 0){
+            return min(bucketStart(bucket + 1) - 1, this->maximum);
+        }
+    }
+    return this->maximum;
+}
+
+static string formatNanoseconds(long long nanoseconds)
+{
+    const char *units[] = {"ns", "us", "ms", "s"};
+    double value = nanoseconds;
+    int unit = 0;
+    for(; unit < 3 && value >= 1000; unit++){
+        value /= 1000;
+    }
+    stringstream out;
+    out<<fixed<<setprecision(unit == 0 ? 0 : value < 10 ? 2 : value < 100 ? 1 : 0)<<value<<units[unit];
+    return out.str();
+}
+
+//Percentiles, then a bar for every bucket that holds something
+void LatencyHistogram::print(ostream &out) const{
+    out<<"  p50 "<<formatNanoseconds(this->percentile(0.5))
+       <<"  p90 "<<formatNanoseconds(this->percentile(0.9))
+       <<"  p99 "<<formatNanoseconds(this->percentile(0.99))
+       <<"  p99.9 "<<formatNanoseconds(this->percentile(0.999))
+       <<"  max "<<formatNanoseconds(this->maximum)<<"\n";
+    long long largest = *max_element(this->counts.begin(), this->counts.end());
+    for(size_t bucket = 0; bucket < this->counts.size(); bucket++){
+        if(this->counts[bucket] == 0){
+            continue;
+        }
+        out<<"  "<<setw(8)<<formatNanoseconds(bucketStart(bucket))<<" "<<setw(10)<<this->counts[bucket]<<" "
+           <<string(max(1LL, this->counts[bucket] * 40 / largest), '#')<<"\n";
+    }
+}
+
+void ArchivedTrip ::display() const
+{
+    cout << "Archived Trip Details : " << endl;
+    cout << "Vehicle id : " << this->vehicleId << endl;
+    cout << "User id : " << this->userId << endl;
+    cout << "Start date : " << Date::fromDayNumber(this->startDay).toString() << endl;
+    cout << "End date : " << Date::fromDayNumber(this->endDay).toString() << endl;
+    cout << "Start Reading : " << this->startReading << endl;
+    cout << "End reading : " << this->endReading << endl;
+    cout << "Total run : " << this->endReading - this->startReading << endl;
+    cout << "Total fare : " << this->fare << endl;
+    cout << "Trip status : Completed" << endl;
+}
+
+//    Marks the start of every archive segment file
+const string ARCHIVEMAGIC = "VMSA1";
+
+TripArchive ::TripArchive(string prefix)
+{
+    this->prefix = prefix;
+    this->segmentCount = 0;
+    this->lastRecordId = 0;
+    // segments are numbered from 1 without gaps, only their headers are read
+    for (int segment = 1;; segment++)
+    {
+        ifstream in(this->segmentName(segment), ios::binary);
+        long count, firstId, lastId;
+        if (!in || !this->readHeader(in, count, firstId, lastId))
+        {
+            break;
+        }
+        this->segmentCount = segment;
+        this->lastRecordId = max(this->lastRecordId, lastId);
+        this->ranges.push_back(make_pair(firstId, lastId));
+    }
+}
+
+string TripArchive ::segmentName(int segment) const
+{
+    return this->prefix + to_string(segment);
+}
+
+long TripArchive ::getLastRecordId() const
+{
+    return this->lastRecordId;
+}
+
+bool TripArchive ::readHeader(istream &in, long &count, long &firstId, long &lastId) const
+{
+    string magic(ARCHIVEMAGIC.length(), '\0');
+    unsigned long long values[3];
+    if (!in.read(&magic[0], magic.length()) || magic != ARCHIVEMAGIC)
+    {
+        return false;
+    }
+    for (auto &value : values)
+    {
+        if (!readVarint(in, value))
+        {
+            return false;
+        }
+    }
+    count = values[0];
+    firstId = values[1];
+    lastId = values[2];
+    return true;
+}
+
+//Writes the trips (sorted by record id) as a new segment. Ids, dates and
+//readings are stored as deltas against the previous trip and fares in paise.
+void TripArchive ::addSegment(const vector<ArchivedTrip> &trips) throw(IOError)
+{
+    if (trips.empty())
+    {
+        return;
+    }
+    string data = ARCHIVEMAGIC;
+    writeVarint(data, trips.size());
+    writeVarint(data, trips.front().recordId);
+    writeVarint(data, trips.back().recordId);
+
+    ArchivedTrip previous = {0, 0, 0, 0, 0, 0, 0, Money()};
+    for (auto &trip : trips)
+    {
+        writeVarint(data, trip.recordId - previous.recordId);
+        writeVarint(data, trip.vehicleId);
+        writeVarint(data, trip.userId);
+        writeSignedVarint(data, trip.startDay - previous.startDay);
+        writeSignedVarint(data, trip.endDay - trip.startDay);
+        writeSignedVarint(data, trip.startReading - previous.startReading);
+        writeSignedVarint(data, trip.endReading - trip.startReading);
+        writeSignedVarint(data, trip.fare.getPaise());
+        previous = trip;
+    }
+
+    // the segment only becomes visible under its final name once complete
+    string name = this->segmentName(this->segmentCount + 1);
+    ofstream out(name + ".tmp", ios::binary | ios::trunc);
+    out.write(data.data(), data.length());
+    out.close();
+    if (!out || rename((name + ".tmp").c_str(), name.c_str()) != 0)
+    {
+        throw IOError();
+    }
+    this->segmentCount++;
+    this->lastRecordId = max(this->lastRecordId, trips.back().recordId);
+    this->ranges.push_back(make_pair(trips.front().recordId, trips.back().recordId));
+}
+
+//Decodes the trips of a segment whose header was just read from the stream.
+//Decoding stops early once the visitor returns false.
+void TripArchive ::decodeSegment(istream &in, long count, function<bool(const ArchivedTrip &)> visit) const throw(IOError)
+{
+    ArchivedTrip trip = {0, 0, 0, 0, 0, 0, 0, Money()};
+    for (long i = 0; i < count; i++)
+    {
+        unsigned long long idDelta, vehicleId, userId;
+        long long startDelta, days, readingDelta, run, fare;
+        if (!readVarint(in, idDelta) || !readVarint(in, vehicleId) ||
+            !readVarint(in, userId) || !readSignedVarint(in, startDelta) ||
+            !readSignedVarint(in, days) || !readSignedVarint(in, readingDelta) ||
+            !readSignedVarint(in, run) || !readSignedVarint(in, fare))
+        {
+            throw IOError();
+        }
+        trip.recordId += idDelta;
+        trip.vehicleId = vehicleId;
+        trip.userId = userId;
+        trip.startDay += startDelta;
+        trip.endDay = trip.startDay + days;
+        trip.startReading += readingDelta;
+        trip.endReading = trip.startReading + run;
+        trip.fare = Money(fare);
+        if (!visit(trip))
+        {
+            return;
+        }
+    }
+}
+
+void TripArchive ::forEach(function<void(const ArchivedTrip &)> visit) const throw(IOError)
+{
+    for (int segment = 1; segment <= this->segmentCount; segment++)
+    {
+        ifstream in(this->segmentName(segment), ios::binary);
+        long count, firstId, lastId;
+        if (!in || !this->readHeader(in, count, firstId, lastId))
+        {
+            throw IOError();
+        }
+        this->decodeSegment(in, count, [&](const ArchivedTrip &trip) {
+            visit(trip);
+            return true;
+        });
+    }
+}
+
+//Drops the trips, sorted by id, that are stored already. Only the segments
+//whose id range holds one of them are decoded, and only up to the last one.
+void TripArchive ::removeStored(vector<ArchivedTrip> &trips) const throw(IOError)
+{
+    auto byId = [](const ArchivedTrip &trip, long recordId) { return trip.recordId < recordId; };
+    unordered_set<long> stored;
+    for (int segment = 1; segment <= this->segmentCount; segment++)
+    {
+        long firstId = this->ranges[segment - 1].first;
+        long lastId = this->ranges[segment - 1].second;
+        auto first = lower_bound(trips.begin(), trips.end(), firstId, byId);
+        if (first == trips.end() || first->recordId > lastId)
+        {
+            continue;
+        }
+        unordered_set<long> wanted;
+        long last = first->recordId;
+        for (auto trip = first; trip != trips.end() && trip->recordId <= lastId; trip++)
+        {
+            wanted.insert(trip->recordId);
+            last = trip->recordId;
+        }
+        ifstream in(this->segmentName(segment), ios::binary);
+        long count;
+        if (!in || !this->readHeader(in, count, firstId, lastId))
+        {
+            throw IOError();
+        }
+        this->decodeSegment(in, count, [&](const ArchivedTrip &trip) {
+            if (wanted.count(trip.recordId))
+            {
+                stored.insert(trip.recordId);
+            }
+            return trip.recordId < last;
+        });
+    }
+    if (!stored.empty())
+    {
+        trips.erase(remove_if(trips.begin(), trips.end(),
+                              [&](const ArchivedTrip &trip) { return stored.count(trip.recordId) > 0; }),
+                    trips.end());
+    }
+}
+
+//Copies the segments to files named with another prefix
+void TripArchive ::copyTo(string prefix) const throw(IOError)
+{
+    for (int segment = 1; segment <= this->segmentCount; segment++)
+    {
+        string name = prefix + to_string(segment);
+        ifstream in(this->segmentName(segment), ios::binary);
+        ofstream out(name + ".tmp", ios::trunc | ios::binary);
+        out << in.rdbuf();
+        out.close();
+        if (!in || !out || !replaceFile(name + ".tmp", name))
+        {
+            throw IOError();
+        }
+    }
+}
+
+ArchivedTrip TripArchive ::getTrip(long recordId) const throw(IOError, RecordNotFoundError)
+{
+    for (int segment = 1; segment <= this->segmentCount; segment++)
+    {
+        ifstream in(this->segmentName(segment), ios::binary);
+        long count, firstId, lastId;
+        if (!in || !this->readHeader(in, count, firstId, lastId))
+        {
+            throw IOError();
+        }
+        // only the segment whose id range holds the trip is decoded
+        if (recordId < firstId || recordId > lastId)
+        {
+            continue;
+        }
+        bool found = false;
+        ArchivedTrip result;
+        this->decodeSegment(in, count, [&](const ArchivedTrip &trip) {
+            if (trip.recordId == recordId)
+            {
+                result = trip;
+                found = true;
+            }
+            return !found && trip.recordId < recordId;
+        });
+        if (found)
+        {
+            return result;
+        }
+    }
+    throw RecordNotFoundError();
+}
+
+template<typename T>
+MpscQueue<T>::MpscQueue(){
+    this->head = nullptr;
+}
+
+template<typename T>
+MpscQueue<T>::~MpscQueue(){
+    this->popAll();
+}
+
+template<typename T>
+void MpscQueue<T>::push(T value){
+    Node *node = new Node{value, this->head.load(memory_order_relaxed)};
+    while(!this->head.compare_exchange_weak(node->next, node,
+                                            memory_order_release,
+                                            memory_order_relaxed));
+}
+
+template<typename T>
+bool MpscQueue<T>::empty() const{
+    return this->head.load(memory_order_acquire) == nullptr;
+}
+
+//Takes every queued value, oldest first
+template<typename T>
+vector<T> MpscQueue<T>::popAll(){
+    Node *node = this->head.exchange(nullptr, memory_order_acquire);
+    vector<T> values;
+    while(node){
+        values.push_back(node->value);
+        Node *next = node->next;
+        delete node;
+        node = next;
+    }
+    reverse(values.begin(), values.end());
+    return values;
+}
+
+template<typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity){
+    this->capacity = capacity;
+    this->closed = false;
+}
+
+template<typename T>
+void BoundedQueue<T>::push(T value){
+    unique_lock<mutex> guard(this->lock);
+    this->notFull.wait(guard, [this]{ return this->values.size() < this->capacity; });
+    this->values.push_back(move(value));
+    this->notEmpty.notify_one();
+}
+
+//Waits for a value, returns false once the queue is closed and drained
+template<typename T>
+bool BoundedQueue<T>::pop(T &value){
+    unique_lock<mutex> guard(this->lock);
+    this->notEmpty.wait(guard, [this]{ return !this->values.empty() || this->closed; });
+    if(this->values.empty()){
+        return false;
+    }
+    value = move(this->values.front());
+    this->values.pop_front();
+    this->notFull.notify_one();
+    return true;
+}
+
+//No more values will be pushed, waiting consumers return
+template<typename T>
+void BoundedQueue<T>::close(){
+    lock_guard<mutex> guard(this->lock);
+    this->closed = true;
+    this->notEmpty.notify_all();
+}
+
+Persister::Persister(){
+    this->stopping = false;
+    this->failed = false;
+    this->worker = thread(&Persister::run, this);
+}
+
+//Writes whatever is still queued before the thread exits
+Persister::~Persister(){
+    this->stopping = true;
+    this->notify();
+    this->worker.join();
+}
+
+void Persister::notify(){
+    lock_guard<mutex> guard(this->wakeLock);
+    this->wake.notify_one();
+}
+
+void Persister::schedule(Persistable *table){
+    this->queue.push(Request{table, nullptr});
+    this->notify();
+}
+
+//Returns a future that becomes ready once every write scheduled before the
+//call is on disk. It holds an IOError if one of those writes failed.
+shared_future<void> Persister::flush(){
+    shared_ptr<promise<void>> flushed = make_shared<promise<void>>();
+    shared_future<void> result = flushed->get_future().share();
+    this->flush([flushed](exception_ptr error){
+        if(error){
+            flushed->set_exception(error);
+        }
+        else{
+            flushed->set_value();
+        }
+    });
+    return result;
+}
+
+//Calls done once every write scheduled before the call is on disk, with
+//the IOError of a write that failed or null. It runs on the persistence
+//thread, so it should only hand the result on.
+void Persister::flush(function<void(exception_ptr)> done){
+    this->queue.push(Request{nullptr, done});
+    this->notify();
+}
+
+void Persister::run(){
+    while(true){
+        {
+            unique_lock<mutex> guard(this->wakeLock);
+            this->wake.wait(guard, [this]{
+                return !this->queue.empty() || this->stopping;
+            });
+        }
+        vector<Request> requests = this->queue.popAll();
+        if(requests.empty() && this->stopping){
+            return;
+        }
+
+        // every table is written once per batch however often it changed
+        vector<Persistable *> written;
+        for(auto &request: requests){
+            if(request.table){
+                if(find(written.begin(), written.end(), request.table) != written.end()){
+                    continue;
+                }
+                written.push_back(request.table);
+                try{
+                    request.table->writePending();
+                }
+                catch(IOError error){
+                    this->failed = true;
+                }
+                continue;
+            }
+            request.flushed(this->failed ? make_exception_ptr(IOError()) : nullptr);
+            this->failed = false;
+            written.clear();
+        }
+    }
+}
+
+EventLoop::EventLoop(){
+    this->stopping = false;
+    this->worker = thread(&EventLoop::run, this);
+}
+
+//Runs whatever is still queued before the thread exits
+EventLoop::~EventLoop(){
+    this->stopping = true;
+    {
+        lock_guard<mutex> guard(this->wakeLock);
+        this->wake.notify_one();
+    }
+    this->worker.join();
+}
+
+void EventLoop::post(function<void()> task){
+    this->tasks.push(move(task));
+    lock_guard<mutex> guard(this->wakeLock);
+    this->wake.notify_one();
+}
+
+//Tasks posted while a turn runs wait for the next turn
+void EventLoop::run(){
+    while(true){
+        {
+            unique_lock<mutex> guard(this->wakeLock);
+            this->wake.wait(guard, [this]{
+                return !this->tasks.empty() || this->stopping;
+            });
+        }
+        vector<function<void()>> turn = this->tasks.popAll();
+        if(turn.empty() && this->stopping){
+            return;
+        }
+        for(auto &task: turn){
+            task();
+        }
+    }
+}
+
+TelemetryIngest::TelemetryIngest(){
+    this->received = 0;
+    this->batches = 0;
+    this->stopping = false;
+    this->worker = thread(&TelemetryIngest::run, this);
+}
+
+TelemetryIngest::~TelemetryIngest(){
+    {
+        lock_guard<mutex> guard(this->wakeLock);
+        this->stopping = true;
+        this->wake.notify_one();
+    }
+    this->worker.join();
+}
+
+//Producers do not wake the thread, it looks at the queue on its own schedule
+void TelemetryIngest::submit(const TelemetryReading &reading){
+    this->queue.push(reading);
+}
+
+//The latest odometer reported by the vehicle, false when it never reported
+bool TelemetryIngest::getOdometer(long vehicleId, long &odometer) const{
+    lock_guard<mutex> guard(this->odometersLock);
+    auto reading = this->odometers.find(vehicleId);
+    if(reading == this->odometers.end()){
+        return false;
+    }
+    odometer = reading->second.odometer;
+    return true;
+}
+
+TelemetryStats TelemetryIngest::getStats() const{
+    lock_guard<mutex> guard(this->odometersLock);
+    return TelemetryStats{this->received.load(), this->batches.load(), this->odometers.size()};
+}
+
+void TelemetryIngest::run(){
+    while(true){
+        {
+            unique_lock<mutex> guard(this->wakeLock);
+            this->wake.wait_for(guard, chrono::milliseconds(TELEMETRYBATCHMILLISECONDS),
+                                [this]{ return this->stopping.load(); });
+        }
+        vector<TelemetryReading> readings = this->queue.popAll();
+        if(readings.empty()){
+            if(this->stopping){
+                return;
+            }
+            continue;
+        }
+        TRACE_SPAN("TelemetryIngest::batch");
+        // units may resend or deliver late, the newest stamp wins
+        unordered_map<long, TelemetryReading> latest;
+        for(auto &reading: readings){
+            auto known = latest.find(reading.vehicleId);
+            if(known == latest.end() || known->second.timestamp <= reading.timestamp){
+                latest[reading.vehicleId] = reading;
+            }
+        }
+        {
+            lock_guard<mutex> guard(this->odometersLock);
+            for(auto &reading: latest){
+                auto known = this->odometers.find(reading.first);
+                if(known == this->odometers.end() || known->second.timestamp <= reading.second.timestamp){
+                    this->odometers[reading.first] = reading.second;
+                }
+            }
+            this->received += readings.size();
+            this->batches++;
+        }
+    }
+}
+
+template<typename T>
+Cursor<T>::Cursor(const vector<T*> *records){
+    this->records = records;
+    this->resumeAfter = 0;
+}
+
+//Returns a cursor that additionally requires the filter to hold
+template<typename T>
+Cursor<T> Cursor<T>::where(function<bool(const T &)> filter) const{
+    Cursor<T> narrowed = *this;
+    narrowed.filters.push_back(filter);
+    return narrowed;
+}
+
+//Returns a cursor that continues after the page that returned the token
+template<typename T>
+Cursor<T> Cursor<T>::after(long resumeToken) const{
+    Cursor<T> resumed = *this;
+    resumed.resumeAfter = resumeToken;
+    return resumed;
+}
+
+//Records are sorted by id, so resuming is a binary search
+template<typename T>
+typename vector<T*>::const_iterator Cursor<T>::begin() const{
+    return upper_bound(records->begin(), records->end(), this->resumeAfter,
+        [](long id, const T *record){ return id < record->getRecord(); });
+}
+
+template<typename T>
+bool Cursor<T>::matches(const T &record) const{
+    if(record.isDeleted()){
+        return false;
+    }
+    for(auto &filter: this->filters){
+        if(!filter(record)){
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+void Cursor<T>::forEach(function<void(const T &)> visit) const{
+    for(auto record = this->begin(); record != records->end(); record++){
+        if(this->matches(**record)){
+            visit(**record);
+        }
+    }
+}
+
+//Fills page with up to pageSize matching records, reusing its storage.
+//Returns the token for the next page or 0 once the records are exhausted.
+template<typename T>
+long Cursor<T>::nextPage(size_t pageSize, vector<const T*> &page) const{
+    page.clear();
+    for(auto record = this->begin(); record != records->end(); record++){
+        if(!this->matches(**record)){
+            continue;
+        }
+        page.push_back(*record);
+        if(page.size() == pageSize){
+            return (*record)->getRecord();
+        }
+    }
+    return 0;
+}
+
+template<typename T>
+const T *Cursor<T>::first() const throw(RecordNotFoundError){
+    for(auto record = this->begin(); record != records->end(); record++){
+        if(this->matches(**record)){
+            return *record;
+        }
+    }
+    throw RecordNotFoundError();
+}
+
+FileState FileState::of(const string &fileName){
+    FileState state = {0, 0, 0, 0};
+    struct stat status;
+    if(stat(fileName.c_str(), &status) == 0){
+        state.device = status.st_dev;
+        state.inode = status.st_ino;
+        state.size = status.st_size;
+        state.modified = status.st_mtime;
+    }
+    return state;
+}
+
+bool FileState::exists() const{
+    return this->device != 0 || this->inode != 0 || this->size != 0 || this->modified != 0;
+}
+
+bool FileState::isSameFile(const FileState &other) const{
+    return this->device == other.device && this->inode == other.inode;
+}
+
+bool FileState::operator==(const FileState &other) const{
+    return this->isSameFile(other) && this->size == other.size && this->modified == other.modified;
+}
+
+template<typename T>
+Table<T> ::Table(string filename, size_t recordWidth) throw (MemoryError){
+    this->fileName = filename;
+    this->recordWidth = recordWidth;
+    this->reservedRecordId = 0;
+    this->persister = nullptr;
+    this->rewritePending = false;
+    this->tombstones = 0;
+    this->generation = 0;
+    this->sequencePending = false;
+    this->knownFile = FileState::of("");
+    this->backingUp = false;
+    this->backupLastId = 0;
+    this->backupNextId = 0;
+    this->sharedSequence = nullptr;
+    this->slotCount = 0;
+}
+
+template<typename T>
+void Table<T>::setPersister(Persister *persister){
+    this->persister = persister;
+}
+
+template<typename T>
+void Table<T>::reserveRecordIds(long lastRecordId){
+    this->reservedRecordId = max(this->reservedRecordId, lastRecordId);
+}
+
+//Numbers new records from a sequence shared with other tables, moving it
+//past the ids this table already holds. The ids the other tables take leave
+//no gaps in this table's file, slots are given out separately.
+template<typename T>
+void Table<T>::shareSequence(atomic<long> *sequence){
+    lock_guard<mutex> guard(this->lock);
+    long lastRecordId = this->getNextRecordId() - 1;
+    long shared = sequence->load();
+    while(shared < lastRecordId && !sequence->compare_exchange_weak(shared, lastRecordId)){
+    }
+    this->sharedSequence = sequence;
+}
+
+//First of count consecutive ids for new records, called with the lock held
+template<typename T>
+long Table<T>::takeRecordIds(size_t count){
+    if(this->sharedSequence){
+        this->reserveRecordIds(this->sharedSequence->fetch_add(count));
+    }
+    return this->getNextRecordId();
+}
+
+//Reserves the ids handed out before the last run, including those of
+//records that were deleted since
+template<typename T>
+void Table<T>::loadSequence(){
+    if(this->fileName.empty()){
+        return;
+    }
+    ifstream in(this->fileName + ".seq");
+    long lastRecordId;
+    if(in>>lastRecordId){
+        this->reserveRecordIds(lastRecordId);
+    }
+}
+
+template<typename T>
+void Table<T>::writeSequence() throw(IOError){
+    long lastRecordId;
+    {
+        lock_guard<mutex> guard(this->lock);
+        if(!this->sequencePending){
+            return;
+        }
+        lastRecordId = this->getNextRecordId() - 1;
+        this->sequencePending = false;
+    }
+    ofstream out(this->fileName + ".seq", ios::trunc);
+    out<<lastRecordId<<"\n";
+    if(!out){
+        lock_guard<mutex> guard(this->lock);
+        this->sequencePending = true;
+        throw IOError();
+    }
+}
+
+template<typename T>
+size_t Table<T>::getTombstones() const{
+    return this->tombstones;
+}
+
+template<typename T>
+Cursor<T> Table<T>::cursor() const{
+    return Cursor<T>(&this->records);
+}
+
+template<typename T>
+bool Table<T>::isFixedWidth() const{
+    return this->recordWidth > 0;
+}
+
+template<typename T>
+long Table<T>::getNextRecordId() const{
+    // records are kept sorted by id, so the next id follows the last one.
+    // Using the count instead would collide with existing ids whenever a
+    // line of the file was skipped while loading.
+    if(this->records.empty()){
+        return this->reservedRecordId+1;
+    }
+    return max(this->records.back()->getRecord(), this->reservedRecordId)+1;
+}
+
+template<typename T>
+const T* const Table<T>::addNewRecord(T record) throw (MemoryError, IOError){
+    T *newRecord = new T(record);
+    if(!newRecord){
+        throw new MemoryError();
+    }
+    {
+        lock_guard<mutex> guard(this->lock);
+        newRecord->recordId = this->takeRecordIds(1);
+        this->records.push_back(newRecord);
+        this->generation++;
+    }
+    try{
+        this->persist(newRecord);
+    } catch(IOError error){
+        lock_guard<mutex> guard(this->lock);
+        this->records.pop_back();
+        delete newRecord;
+        throw;
+    }
+    return newRecord;
+}
+
+//Appends records that were allocated by the caller under contiguous ids and
+//makes them durable with a single write. The table takes them over.
+template<typename T>
+void Table<T>::appendRecords(const vector<T*> &newRecords) throw(IOError){
+    TRACE_SPAN("Table::appendRecords");
+    if(newRecords.empty()){
+        return;
+    }
+    size_t oldSize = this->records.size();
+    {
+        lock_guard<mutex> guard(this->lock);
+        long recordId = this->takeRecordIds(newRecords.size());
+        for(auto record: newRecords){
+            record->recordId = recordId++;
+            this->records.push_back(record);
+        }
+        this->generation++;
+    }
+    try{
+        this->persist(nullptr);
+    }
+    catch(IOError error){
+        lock_guard<mutex> guard(this->lock);
+        this->records.resize(oldSize);
+        throw;
+    }
+}
+
+//Puts a record into memory only, as a replica does with the primary's log.
+//An existing record with the same id takes over its data and is returned,
+//otherwise the table takes over the record itself.
+template<typename T>
+T *Table<T>::applyRecord(T *record){
+    lock_guard<mutex> guard(this->lock);
+    this->generation++;
+    auto position = lower_bound(records.begin(), records.end(), record->getRecord(),
+        [](const T *existing, long id){ return existing->getRecord() < id; });
+    if(position != records.end() && (*position)->getRecord() == record->getRecord()){
+        this->keepForBackup(record->getRecord(), *position);
+        // a record written again after its deletion comes back
+        if((*position)->deleted){
+            (*position)->deleted = false;
+            this->tombstones--;
+        }
+        (*position)->setDataFrom(record);
+        delete record;
+        return *position;
+    }
+    this->keepForBackup(record->getRecord(), nullptr);
+    records.insert(position, record);
+    return record;
+}
+
+template<typename T>
+void Table<T> :: updateRecord(T updatedRecord) throw (IOError,RecordNotFoundError){
+    T *pointerToRecord = this->getReferenceOfRecordForId(updatedRecord.getRecord());
+    T oldRecord = T(*pointerToRecord);
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->keepForBackup(pointerToRecord->getRecord(), pointerToRecord);
+        pointerToRecord->setDataFrom(&updatedRecord);
+        this->generation++;
+    }
+    try{
+        this->persist(pointerToRecord);
+    }
+    catch(IOError error){
+        lock_guard<mutex> guard(this->lock);
+        pointerToRecord->setDataFrom(&oldRecord);
+        throw;
+    }
+}
+
+//Changes many records as one: all of them under one lock and written with
+//one persist. When that fails every record is put back as it was.
+template<typename T>
+void Table<T>::updateRecords(vector<T> &updated) throw (IOError, RecordNotFoundError){
+    TRACE_SPAN("Table::updateRecords");
+    vector<T*> targets;
+    vector<T> previous;
+    targets.reserve(updated.size());
+    previous.reserve(updated.size());
+    // every record is looked up before the first one is changed
+    for(auto &record: updated){
+        targets.push_back(this->getReferenceOfRecordForId(record.getRecord()));
+    }
+    {
+        lock_guard<mutex> guard(this->lock);
+        for(size_t i = 0; i < targets.size(); i++){
+            previous.push_back(*targets[i]);
+            this->keepForBackup(targets[i]->getRecord(), targets[i]);
+            targets[i]->setDataFrom(&updated[i]);
+        }
+        this->generation++;
+    }
+    try{
+        this->persistRecords(targets);
+    }
+    catch(IOError error){
+        lock_guard<mutex> guard(this->lock);
+        for(size_t i = 0; i < targets.size(); i++){
+            targets[i]->setDataFrom(&previous[i]);
+        }
+        throw;
+    }
+}
+
+//Turns a record into a tombstone or back, in memory only
+template<typename T>
+T *Table<T>::markDeleted(long recordId, bool deleted) throw(RecordNotFoundError){
+    lock_guard<mutex> guard(this->lock);
+    auto position = this->findRecord(recordId);
+    if(position == records.end() || (*position)->deleted == deleted){
+        throw RecordNotFoundError();
+    }
+    this->keepForBackup(recordId, *position);
+    (*position)->deleted = deleted;
+    this->tombstones += deleted ? 1 : -1;
+    this->sequencePending = true;
+    this->generation++;
+    return *position;
+}
+
+//Drops a record from memory only, for a table that caches another store
+template<typename T>
+void Table<T>::evictRecord(long recordId){
+    lock_guard<mutex> guard(this->lock);
+    auto position = this->findRecord(recordId);
+    if(position == records.end()){
+        return;
+    }
+    if((*position)->deleted){
+        this->tombstones--;
+    }
+    delete *position;
+    this->records.erase(this->records.begin() + (position - this->records.begin()));
+    this->generation++;
+}
+
+//Deletes a record. It stays in memory as a tombstone that scans skip until
+//the table is compacted, in the file its line or slot is gone right away.
+template<typename T>
+void Table<T>::deleteRecord(long recordId) throw(IOError, RecordNotFoundError){
+    T *record = this->markDeleted(recordId, true);
+    try{
+        this->persist(record);
+    }
+    catch(IOError error){
+        this->markDeleted(recordId, false);
+        throw;
+    }
+}
+
+//Copies the live records for a compaction, visit sees each of them while
+//the table cannot change. Returns the generation the copy belongs to.
+template<typename T>
+long Table<T>::snapshotLive(vector<T*> &live, function<void(T *)> visit){
+    lock_guard<mutex> guard(this->lock);
+    live.clear();
+    live.reserve(this->records.size() - this->tombstones);
+    for(auto record: this->records){
+        if(!record->deleted){
+            live.push_back(record);
+            visit(record);
+        }
+    }
+    return this->generation;
+}
+
+//Replaces the records by a compacted copy and frees the tombstones, unless
+//the table changed after the copy was taken. The old records end up in live.
+template<typename T>
+bool Table<T>::installLive(vector<T*> &live, long generation){
+    lock_guard<mutex> guard(this->lock);
+    // tombstones whose slots are not cleared yet must stay
+    if(generation != this->generation || !this->dirtyRecordIds.empty()){
+        return false;
+    }
+    this->reserveRecordIds(this->getNextRecordId() - 1);
+    this->records.swap(live);
+    this->tombstones = 0;
+    this->generation++;
+    for(auto record: live){
+        if(record->deleted){
+            delete record;
+        }
+    }
+    live.clear();
+    return true;
+}
+
+//Called with the lock held before a record changes. While a backup has not
+//written the record yet, the version the backup started with is kept for it.
+template<typename T>
+void Table<T>::keepForBackup(long recordId, const T *record){
+    if(!this->backingUp || recordId < this->backupNextId || recordId > this->backupLastId ||
+       this->backupVersions.count(recordId)){
+        return;
+    }
+    this->backupVersions[recordId] = record && !record->deleted ? new T(*record) : nullptr;
+}
+
+//Makes the table's records as they are now the ones a backup reads, and
+//returns the last id handed out so far
+template<typename T>
+long Table<T>::startBackup(){
+    lock_guard<mutex> guard(this->lock);
+    this->backingUp = true;
+    this->backupLastId = this->records.empty() ? 0 : this->records.back()->getRecord();
+    this->backupNextId = 1;
+    return this->getNextRecordId() - 1;
+}
+
+//Formats the next count ids of the backup into contents, in the format of
+//the table's file, and frees the old versions they used. Returns false once
+//every record of the backup was read.
+template<typename T>
+bool Table<T>::readBackupChunk(string &contents, size_t count) throw(IOError){
+    TRACE_SPAN("Table::readBackupChunk");
+    lock_guard<mutex> guard(this->lock);
+    auto live = lower_bound(records.begin(), records.end(), this->backupNextId,
+        [](const T *record, long id){ return record->getRecord() < id; });
+    auto kept = this->backupVersions.lower_bound(this->backupNextId);
+    for(size_t read = 0; read < count; read++){
+        long liveId = live != records.end() ? (*live)->getRecord() : LONG_MAX;
+        long keptId = kept != this->backupVersions.end() ? kept->first : LONG_MAX;
+        long recordId = min(liveId, keptId);
+        if(recordId > this->backupLastId){
+            this->backupNextId = this->backupLastId + 1;
+            break;
+        }
+        const T *record = keptId == recordId ? kept->second : *live;
+        if(record && !record->deleted){
+            contents.append(this->formatRecord(record));
+            contents.push_back('\n');
+        }
+        if(liveId == recordId){
+            live++;
+        }
+        if(keptId == recordId){
+            kept++;
+        }
+        this->backupNextId = recordId + 1;
+    }
+    for(auto version = this->backupVersions.begin(); version != kept; version++){
+        delete version->second;
+    }
+    this->backupVersions.erase(this->backupVersions.begin(), kept);
+    return this->backupNextId <= this->backupLastId;
+}
+
+//Stops keeping versions for a backup that is done or failed
+template<typename T>
+void Table<T>::finishBackup(){
+    lock_guard<mutex> guard(this->lock);
+    this->backingUp = false;
+    for(auto &version: this->backupVersions){
+        delete version.second;
+    }
+    this->backupVersions.clear();
+}
+
+//Remembers the file as it is now, as the table's own. Called with fileLock
+//held by whoever just read or wrote it.
+template<typename T>
+void Table<T>::recordFileState(){
+    this->knownFile = FileState::of(this->fileName);
+}
+
+//Parses the changes another program made to the file since the table last
+//read or wrote it. Lines appended to the file are parsed on their own, a
+//file that was replaced or changed in place is parsed whole. A line that is
+//still being written is left for the next look, lines that do not parse
+//are skipped.
+template<typename T>
+FileChange Table<T>::readChanges(function<T *(const string &)> parse, vector<T*> &changed){
+    TRACE_SPAN("Table::readChanges");
+    string contents;
+    FileChange change;
+    {
+        lock_guard<mutex> guard(this->fileLock);
+        FileState current = FileState::of(this->fileName);
+        // a missing file is in the middle of being replaced
+        if(this->fileName.empty() || !current.exists() || current == this->knownFile){
+            return fileUnchanged;
+        }
+        change = current.isSameFile(this->knownFile) && current.size > this->knownFile.size ? fileAppended : fileReplaced;
+        ifstream in(this->fileName, ios::binary);
+        if(!in){
+            return fileUnchanged;
+        }
+        streamoff from = change == fileAppended ? this->knownFile.size : 0;
+        in.seekg(from);
+        contents.assign(current.size - from, '\0');
+        in.read(&contents[0], contents.length());
+        contents.resize(in.gcount());
+        if(change == fileAppended){
+            size_t complete = contents.rfind('\n');
+            if(complete == string::npos){
+                return fileUnchanged;
+            }
+            contents.resize(complete + 1);
+            current.size = from + contents.length();
+        }
+        this->knownFile = current;
+    }
+    istringstream lines(contents);
+    for(string line; getline(lines, line);){
+        line = trimRecord(line);
+        if(line.empty()){
+            continue;
+        }
+        try{
+            changed.push_back(parse(line));
+        }
+        catch(...){
+        }
+    }
+    return change;
+}
+
+//Merges a fresh copy of the whole file into the table under one lock, so
+//a reader sees either the old records or the new ones. Records keep their
+//objects, which trips point at, and take over the data of their copy; the
+//records missing from the copy become tombstones unless keep holds for
+//them, then the file is written again to bring them back. Nothing is merged
+//while changes of the table wait to be written, those replace the file.
+//Takes over the fresh records either way.
+template<typename T>
+bool Table<T>::mergeSnapshot(vector<T*> &fresh, function<bool(const T &)> keep, vector<T*> &changed, vector<T*> &removed) throw(IOError){
+    TRACE_SPAN("Table::mergeSnapshot");
+    auto byId = [](const T *a, const T *b){ return a->getRecord() < b->getRecord(); };
+    stable_sort(fresh.begin(), fresh.end(), byId);
+    bool kept = false;
+    {
+        lock_guard<mutex> guard(this->lock);
+        if(this->rewritePending || !this->dirtyRecordIds.empty()){
+            for(auto record: fresh){
+                delete record;
+            }
+            fresh.clear();
+            return false;
+        }
+        vector<T*> merged;
+        merged.reserve(max(this->records.size(), fresh.size()));
+        size_t old = 0, copy = 0;
+        while(old < this->records.size() || copy < fresh.size()){
+            // of lines with the same id the last one counts
+            if(copy + 1 < fresh.size() && fresh[copy]->getRecord() == fresh[copy+1]->getRecord()){
+                delete fresh[copy++];
+                continue;
+            }
+            T *record = old < this->records.size() ? this->records[old] : nullptr;
+            T *replacement = copy < fresh.size() ? fresh[copy] : nullptr;
+            if(record && (!replacement || record->getRecord() < replacement->getRecord())){
+                if(!record->deleted && keep(*record)){
+                    kept = true;
+                }
+                else if(!record->deleted){
+                    this->keepForBackup(record->getRecord(), record);
+                    record->deleted = true;
+                    this->tombstones++;
+                    removed.push_back(record);
+                }
+                merged.push_back(record);
+                old++;
+            }
+            else if(!record || replacement->getRecord() < record->getRecord()){
+                this->keepForBackup(replacement->getRecord(), nullptr);
+                merged.push_back(replacement);
+                changed.push_back(replacement);
+                copy++;
+            }
+            else{
+                if(record->deleted || record->toString() != replacement->toString()){
+                    this->keepForBackup(record->getRecord(), record);
+                    if(record->deleted){
+                        record->deleted = false;
+                        this->tombstones--;
+                    }
+                    record->setDataFrom(replacement);
+                    changed.push_back(record);
+                }
+                delete replacement;
+                merged.push_back(record);
+                old++;
+                copy++;
+            }
+        }
+        this->records.swap(merged);
+        this->generation++;
+        fresh.clear();
+    }
+    if(kept){
+        this->persist(nullptr);
+    }
+    return true;
+}
+
+//Makes a changed record durable. Without a persister the file is written
+//right away, otherwise the change is remembered and the persistence thread
+//writes it later. Fixed-width tables only write the slot of the record,
+//a null record stands for a change to the whole table.
+template<typename T>
+void Table<T>::persist(const T *record) throw(IOError){
+    // a table without a file only lives in memory
+    if(this->fileName.empty()){
+        return;
+    }
+    if(!this->persister){
+        if(this->isFixedWidth() && record){
+            this->writeRecordToFile(record);
+        }
+        else{
+            this->writeToFile();
+        }
+        this->writeSequence();
+        return;
+    }
+    {
+        lock_guard<mutex> guard(this->lock);
+        if(this->isFixedWidth() && record){
+            this->dirtyRecordIds.insert(record->getRecord());
+        }
+        else{
+            this->rewritePending = true;
+        }
+    }
+    this->persister->schedule(this);
+}
+
+//persist for a batch of changed records, the background writer is handed
+//all of them at once and a file of plain lines is rewritten once
+template<typename T>
+void Table<T>::persistRecords(const vector<T*> &changed) throw(IOError){
+    if(this->fileName.empty() || changed.empty()){
+        return;
+    }
+    if(!this->persister){
+        if(this->isFixedWidth()){
+            for(auto record: changed){
+                this->writeRecordToFile(record);
+            }
+        }
+        else{
+            this->writeToFile();
+        }
+        this->writeSequence();
+        return;
+    }
+    {
+        lock_guard<mutex> guard(this->lock);
+        if(this->isFixedWidth()){
+            for(auto record: changed){
+                this->dirtyRecordIds.insert(record->getRecord());
+            }
+        }
+        else{
+            this->rewritePending = true;
+        }
+    }
+    this->persister->schedule(this);
+}
+
+//Called on the persistence thread. The changes are serialized while holding
+//the lock and written after releasing it, so mutations are not blocked on I/O.
+template<typename T>
+void Table<T>::writePending() throw(IOError){
+    TRACE_SPAN("Table::writePending");
+    string contents;
+    unordered_map<long, long> layout;
+    vector<pair<long, string>> changes;
+    vector<long> positions;
+    bool rewrite;
+    {
+        lock_guard<mutex> guard(this->lock);
+        rewrite = this->rewritePending;
+        if(rewrite){
+            contents = this->serializeRecords(layout);
+        }
+        else{
+            // deleted records are looked up too, their slots are cleared
+            for(auto recordId: this->dirtyRecordIds){
+                auto record = this->findRecord(recordId);
+                if(record != this->records.end()){
+                    changes.push_back(make_pair(recordId, this->formatRecord(*record)+'\n'));
+                    positions.push_back(this->slotOf(recordId));
+                }
+            }
+        }
+        this->rewritePending = false;
+        this->dirtyRecordIds.clear();
+    }
+    try{
+        if(rewrite){
+            this->writeFileContents(contents);
+            // only writes give out slots and they all run on this thread
+            lock_guard<mutex> guard(this->lock);
+            this->slots.swap(layout);
+            this->slotCount = this->slots.size();
+        }
+        for(size_t i = 0; i < changes.size(); i++){
+            this->writeSlot(positions[i], changes[i].second);
+        }
+        this->writeSequence();
+    }
+    catch(IOError error){
+        // keep the changes pending so the next write retries them
+        lock_guard<mutex> guard(this->lock);
+        this->rewritePending = this->rewritePending || rewrite;
+        for(auto &change: changes){
+            this->dirtyRecordIds.insert(change.first);
+        }
+        throw;
+    }
+}
+
+template<typename T>
+string Table<T>::formatRecord(const T *record) const throw(IOError){
+    // the slot of a deleted record is left empty
+    string line;
+    if(!record->deleted){
+        RecordCodec<T>::format(*record, line);
+    }
+    if(!this->isFixedWidth()){
+        return line;
+    }
+    // the record and its newline have to fit in the slot
+    if(line.length() >= this->recordWidth){
+        throw IOError();
+    }
+    line.append(this->recordWidth - line.length() - 1, RECORDPADDING);
+    return line;
+}
+
+//Formats the live records one after another and fills layout with the slot
+//each of them gets, which holds once the contents are written
+template<typename T>
+string Table<T>::serializeRecords(unordered_map<long, long> &layout) const throw(IOError){
+    TRACE_SPAN("Table::serializeRecords");
+    string contents;
+    for(auto record: records){
+        if(record->deleted){
+            continue;
+        }
+        long slot = layout.size();
+        layout[record->getRecord()] = slot;
+        contents.append(formatRecord(record));
+        contents.push_back('\n');
+    }
+    return contents;
+}
+
+//Slot of a record in the fixed-width file, the next free one for a record
+//that has none yet
+template<typename T>
+long Table<T>::slotOf(long recordId){
+    auto slot = this->slots.find(recordId);
+    if(slot != this->slots.end()){
+        return slot->second;
+    }
+    this->slots[recordId] = this->slotCount;
+    return this->slotCount++;
+}
+
+//Replaces the file through a temporary file, so a reader such as a
+//replica never sees it half written
+template<typename T>
+void Table<T>::writeFileContents(const string &contents) throw(IOError){
+    TRACE_SPAN("Table::writeFileContents");
+    lock_guard<mutex> guard(this->fileLock);
+    string temporary = fileName + ".tmp";
+    this->fileStream.open(temporary,ios::out|ios::trunc|ios::binary);
+    if(!this->fileStream){
+        throw IOError();
+    }
+    this->fileStream.write(contents.data(), contents.length());
+    bool failed = !this->fileStream;
+    this->fileStream.close();
+    if(failed || !replaceFile(temporary, fileName)){
+        throw IOError();
+    }
+    this->recordFileState();
+}
+
+template<typename T>
+void Table<T>::writeSlot(long slot, const string &contents) throw(IOError){
+    TRACE_SPAN("Table::writeSlot");
+    lock_guard<mutex> guard(this->fileLock);
+    this->fileStream.open(fileName,ios::in|ios::out|ios::binary);
+    if(!this->fileStream){
+        throw IOError();
+    }
+    // a slot whose write failed before may be missing from the end of the
+    // file, it is left empty until it is written again
+    this->fileStream.seekp(0,ios::end);
+    streamoff fileEnd = this->fileStream.tellp();
+    streamoff offset = streamoff(slot)*this->recordWidth;
+    for(; fileEnd < offset; fileEnd += this->recordWidth){
+        fileStream<<string(this->recordWidth-1, RECORDPADDING)<<'\n';
+    }
+    this->fileStream.seekp(offset);
+    this->fileStream.write(contents.data(), contents.length());
+    bool failed = !this->fileStream;
+    this->fileStream.close();
+    if(failed){
+        throw IOError();
+    }
+    this->recordFileState();
+}
+
+template<typename T>
+void Table<T>:: writeToFile() throw(IOError){
+    unordered_map<long, long> layout;
+    this->writeFileContents(this->serializeRecords(layout));
+    this->slots.swap(layout);
+    this->slotCount = this->slots.size();
+}
+
+template<typename T>
+void Table<T>::writeRecordToFile(const T *record) throw(IOError){
+    this->writeSlot(this->slotOf(record->getRecord()), this->formatRecord(record)+'\n');
+}
+
+template<typename T>
+const T* const Table<T>::getRecordForId(long recordID) const throw(RecordNotFoundError){
+    try{
+        return this->getReferenceOfRecordForId(recordID);
+    }
+    catch(RecordNotFoundError err){
+        throw;
+    }
+}
+
+//The position of the record with the id, tombstones included, or the end
+template<typename T>
+typename vector<T*>::const_iterator Table<T>::findRecord(long recordId) const{
+    // records are sorted by id, so the id is found by binary search
+    auto position = lower_bound(records.begin(), records.end(), recordId,
+        [](const T *record, long id){ return record->getRecord() < id; });
+    if(position != records.end() && (*position)->getRecord() != recordId){
+        return records.end();
+    }
+    return position;
+}
+
+template<typename T>
+T* Table<T>::getReferenceOfRecordForId(long recordId) const throw (RecordNotFoundError){
+    TRACE_SPAN("Table::getRecordForId");
+    auto position = this->findRecord(recordId);
+    if(position == records.end() || (*position)->deleted){
+        throw RecordNotFoundError();
+    }
+    return *position;
+}
+
+template<typename T>
+void Table<T>::sortRecords(){
+    auto byId = [](const T *a, const T *b){ return a->getRecord() < b->getRecord(); };
+    if(!is_sorted(records.begin(), records.end(), byId)){
+        stable_sort(records.begin(), records.end(), byId);
+    }
+}
+
+bool AvailabilityKey ::operator==(const AvailabilityKey &other) const
+{
+    return this->startDay == other.startDay && this->endDay == other.endDay && this->type == other.type;
+}
+
+size_t AvailabilityKeyHash ::operator()(const AvailabilityKey &key) const
+{
+    size_t hash = std::hash<long>()(key.startDay);
+    hash = hash * 31 + std::hash<long>()(key.endDay);
+    return hash * 31 + key.type;
+}
+
+AvailabilityCache ::AvailabilityCache(size_t capacity)
+{
+    this->capacity = capacity;
+    this->stats = CacheStats{0, 0, 0, 0};
+}
+
+AvailabilityKey AvailabilityCache ::makeKey(Date startDate, Date endDate, VehicleType type)
+{
+    return AvailabilityKey{startDate.isEmpty() ? LONG_MIN : startDate.getDayNumber(),
+                           endDate.isEmpty() ? LONG_MAX : endDate.getDayNumber(),
+                           type};
+}
+
+bool AvailabilityCache ::lookup(const AvailabilityKey &key, vector<const Vehicle *> &vehicles)
+{
+    lock_guard<mutex> guard(this->lock);
+    auto position = this->positions.find(key);
+    if (position == this->positions.end())
+    {
+        this->stats.misses++;
+        return false;
+    }
+    this->entries.splice(this->entries.begin(), this->entries, position->second);
+    vehicles = position->second->second;
+    this->stats.hits++;
+    return true;
+}
+
+void AvailabilityCache ::store(const AvailabilityKey &key, const vector<const Vehicle *> &vehicles)
+{
+    lock_guard<mutex> guard(this->lock);
+    auto position = this->positions.find(key);
+    if (position != this->positions.end())
+    {
+        this->entries.erase(position->second);
+    }
+    else if (this->entries.size() == this->capacity)
+    {
+        this->positions.erase(this->entries.back().first);
+        this->entries.pop_back();
+    }
+    this->entries.push_front(make_pair(key, vehicles));
+    this->positions[key] = this->entries.begin();
+}
+
+//Drops the results for the vehicle type whose date range overlaps the
+//given one, the only searches a trip over that range can change
+void AvailabilityCache ::invalidate(VehicleType type, long startDay, long endDay)
+{
+    lock_guard<mutex> guard(this->lock);
+    for (auto entry = this->entries.begin(); entry != this->entries.end();)
+    {
+        const AvailabilityKey &key = entry->first;
+        if (key.type == type && key.startDay <= endDay && startDay <= key.endDay)
+        {
+            this->positions.erase(key);
+            entry = this->entries.erase(entry);
+            this->stats.invalidations++;
+        }
+        else
+        {
+            entry++;
+        }
+    }
+}
+
+//Drops every result for the vehicle type, as a new vehicle can show up in all
+void AvailabilityCache ::invalidate(VehicleType type)
+{
+    this->invalidate(type, LONG_MIN, LONG_MAX);
+}
+
+CacheStats AvailabilityCache ::getStats()
+{
+    lock_guard<mutex> guard(this->lock);
+    CacheStats current = this->stats;
+    current.entries = this->entries.size();
+    return current;
+}
+
+//    Lines handed to a parser thread at a time during a bulk import
+const size_t IMPORTCHUNKLINES = 4096;
+
+//Splits one CSV line into its fields, honouring double quoted fields
+vector<string> splitCsvLine(const string &line)
+{
+    vector<string> fields(1);
+    bool quoted = false;
+    for (size_t i = 0; i < line.length(); i++)
+    {
+        char c = line[i];
+        if (quoted)
+        {
+            if (c == '"' && i + 1 < line.length() && line[i + 1] == '"')
+            {
+                fields.back().push_back('"');
+                i++;
+            }
+            else if (c == '"')
+            {
+                quoted = false;
+            }
+            else
+            {
+                fields.back().push_back(c);
+            }
+        }
+        else if (c == '"')
+        {
+            quoted = true;
+        }
+        else if (c == ',')
+        {
+            fields.push_back("");
+        }
+        else if (c != '\r')
+        {
+            fields.back().push_back(c);
+        }
+    }
+    return fields;
+}
+
+//Validation helpers for imported fields
+static bool isWholeNumber(const string &text)
+{
+    return !text.empty() && text.length() < 10 &&
+           all_of(text.begin(), text.end(), [](char c) { return isdigit(c); });
+}
+
+static bool isValidDate(const string &text)
+{
+    vector<string> parts;
+    stringstream ss(text);
+    for (string part; getline(ss, part, DATEDELIMETER);)
+    {
+        parts.push_back(part);
+    }
+    if (parts.size() != 3 || !isWholeNumber(parts[0]) || !isWholeNumber(parts[1]) || !isWholeNumber(parts[2]))
+    {
+        return false;
+    }
+    int day = stoi(parts[0]), month = stoi(parts[1]), year = stoi(parts[2]);
+    return day >= 1 && day <= 31 && month >= 1 && month <= 12 && year >= 1900;
+}
+
+//Parses a partner CSV row "registrationNumber,type,seats,companyName,
+//pricePerKm,pucExpirationDate" into a vehicle, or explains why it cannot
+static Vehicle *parseImportedRecord(const vector<string> &fields, Vehicle *, string &reason)
+{
+    if (fields.size() != 6)
+    {
+        reason = "expected 6 fields";
+        return nullptr;
+    }
+    if (fields[0].empty())
+    {
+        reason = "missing registration number";
+        return nullptr;
+    }
+    int type = fields[1] == "bike" ? 1 : fields[1] == "car" ? 2 : fields[1] == "bus" ? 3
+             : isWholeNumber(fields[1]) ? stoi(fields[1]) : 0;
+    if (type < VehicleType::bike || type > VehicleType::bus)
+    {
+        reason = "unknown vehicle type";
+        return nullptr;
+    }
+    if (!isWholeNumber(fields[2]) || stoi(fields[2]) == 0)
+    {
+        reason = "invalid number of seats";
+        return nullptr;
+    }
+    Money price;
+    try
+    {
+        price = Money::parse(fields[4]);
+    }
+    catch (Error e)
+    {
+        reason = "invalid price per km";
+        return nullptr;
+    }
+    if (price < Money())
+    {
+        reason = "invalid price per km";
+        return nullptr;
+    }
+    if (!isValidDate(fields[5]))
+    {
+        reason = "invalid PUC expiration date";
+        return nullptr;
+    }
+    return new Vehicle(fields[0], VehicleType(type), stoi(fields[2]), fields[3],
+                       price.getPaise() / 100.0, Date(fields[5]));
+}
+
+//Parses a partner CSV row "name,contact,email" into a user
+static User *parseImportedRecord(const vector<string> &fields, User *, string &reason)
+{
+    if (fields.size() != 3)
+    {
+        reason = "expected 3 fields";
+        return nullptr;
+    }
+    if (fields[0].empty())
+    {
+        reason = "missing name";
+        return nullptr;
+    }
+    if (fields[1].empty() || !all_of(fields[1].begin(), fields[1].end(), [](char c) { return isdigit(c) || c == '+'; }))
+    {
+        reason = "invalid contact number";
+        return nullptr;
+    }
+    if (fields[2].find('@') == string::npos)
+    {
+        reason = "invalid email";
+        return nullptr;
+    }
+    return new User(fields[0], fields[1], fields[2]);
+}
+
+//First column name of a feed that starts with a header line
+static string importHeader(Vehicle *) { return "registrationNumber"; }
+static string importHeader(User *) { return "name"; }
+
+//Keys that identify the same vehicle or user across imports
+static string importKey(const Vehicle &vehicle) { return vehicle.getRegistrationNumber(); }
+static string importKey(const User &user) { return user.getContact(); }
+
+//    Size of the exporter's output buffer
+const size_t EXPORTBUFFERSIZE = 1 << 16;
+
+//    Columns of an exported trip, in order
+const char *const EXPORTCOLUMNS[] = {
+    "tripId", "startDate", "endDate", "startReading", "endReading", "distance",
+    "fare", "completed", "vehicleId", "registrationNumber", "vehicleType",
+    "seats", "companyName", "pricePerKm", "userId", "userName", "contact", "email"};
+
+TripExporter ::TripExporter(FILE *out, ExportFormat format)
+{
+    this->out = out;
+    this->format = format;
+    this->buffer.resize(EXPORTBUFFERSIZE);
+    this->used = 0;
+    this->field = 0;
+}
+
+void TripExporter ::append(const char *data, size_t length) throw(IOError)
+{
+    while (length > 0)
+    {
+        if (this->used == this->buffer.size())
+        {
+            if (fwrite(this->buffer.data(), 1, this->used, this->out) != this->used)
+            {
+                throw IOError();
+            }
+            this->used = 0;
+        }
+        size_t chunk = min(length, this->buffer.size() - this->used);
+        memcpy(this->buffer.data() + this->used, data, chunk);
+        this->used += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void TripExporter ::append(const string &text) throw(IOError)
+{
+    this->append(text.data(), text.length());
+}
+
+//Writes the separator and, for JSON, the key of the next field
+void TripExporter ::beginField(const char *name) throw(IOError)
+{
+    if (this->format == jsonLinesFormat)
+    {
+        this->append(this->field == 0 ? "{\"" : ",\"", 2);
+        this->append(name, strlen(name));
+        this->append("\":", 2);
+    }
+    else if (this->field > 0)
+    {
+        this->append(",", 1);
+    }
+    this->field++;
+}
+
+void TripExporter ::writeText(const char *name, const string &text) throw(IOError)
+{
+    this->beginField(name);
+    if (this->format == csvFormat)
+    {
+        // fields are only quoted when they have to be
+        if (text.find_first_of(",\"\r\n") == string::npos)
+        {
+            this->append(text);
+            return;
+        }
+        this->append("\"", 1);
+        for (char c : text)
+        {
+            this->append(c == '"' ? "\"\"" : &c, c == '"' ? 2 : 1);
+        }
+        this->append("\"", 1);
+        return;
+    }
+    this->append("\"", 1);
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            char escaped[2] = {'\\', c};
+            this->append(escaped, 2);
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            this->append(escaped, 6);
+        }
+        else
+        {
+            this->append(&c, 1);
+        }
+    }
+    this->append("\"", 1);
+}
+
+void TripExporter ::writeRaw(const char *name, const string &text) throw(IOError)
+{
+    this->beginField(name);
+    this->append(text);
+}
+
+void TripExporter ::writeNumber(const char *name, long long number) throw(IOError)
+{
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    unsigned long long magnitude = number < 0 ? 0ULL - number : number;
+    do
+    {
+        *--start = char('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (number < 0)
+    {
+        *--start = '-';
+    }
+    this->beginField(name);
+    this->append(start, end - start);
+}
+
+//Dates are written as d/m/yyyy like in the data files
+void TripExporter ::writeDate(const char *name, long dayNumber, bool empty) throw(IOError)
+{
+    if (empty)
+    {
+        this->writeText(name, "");
+        return;
+    }
+    long day, month, year;
+    Date::splitDayNumber(dayNumber, day, month, year);
+    char text[32];
+    int length = snprintf(text, sizeof(text), "%ld/%ld/%ld", day, month, year);
+    this->writeText(name, string(text, length));
+}
+
+void TripExporter ::writeHeader() throw(IOError)
+{
+    if (this->format != csvFormat)
+    {
+        return;
+    }
+    for (auto column : EXPORTCOLUMNS)
+    {
+        this->writeRaw(column, column);
+    }
+    this->append("\n", 1);
+    this->field = 0;
+}
+
+void TripExporter ::writeRow(long tripId, long startDay, long endDay, bool datesEmpty,
+                             long startReading, long endReading, Money fare, bool completed,
+                             long vehicleId, const Vehicle *vehicle,
+                             long userId, const User *user) throw(IOError)
+{
+    this->writeNumber("tripId", tripId);
+    this->writeDate("startDate", startDay, datesEmpty);
+    this->writeDate("endDate", endDay, datesEmpty);
+    this->writeNumber("startReading", startReading);
+    this->writeNumber("endReading", endReading);
+    this->writeNumber("distance", completed ? endReading - startReading : 0);
+    this->writeRaw("fare", fare.toString());
+    this->writeRaw("completed", this->format == jsonLinesFormat ? (completed ? "true" : "false") : (completed ? "1" : "0"));
+    this->writeNumber("vehicleId", vehicleId);
+    // a vehicle or user that no longer exists leaves its fields empty
+    this->writeText("registrationNumber", vehicle ? vehicle->getRegistrationNumber() : "");
+    this->writeText("vehicleType", vehicle ? vehicle->getVehicleTypeName() : "");
+    this->writeNumber("seats", vehicle ? vehicle->getSeats() : 0);
+    this->writeText("companyName", vehicle ? vehicle->getCompanyName() : "");
+    this->writeRaw("pricePerKm", Money::fromRupees(vehicle ? vehicle->getPricePerKm() : 0).toString());
+    this->writeNumber("userId", userId);
+    this->writeText("userName", user ? user->getName() : "");
+    this->writeText("contact", user ? user->getContact() : "");
+    this->writeText("email", user ? user->getEmail() : "");
+    this->append(this->format == jsonLinesFormat ? "}\n" : "\n", this->format == jsonLinesFormat ? 2 : 1);
+    this->field = 0;
+}
+
+void TripExporter ::write(const Trip &trip) throw(IOError)
+{
+    bool datesEmpty = trip.getStartDate().isEmpty() || trip.getEndDate().isEmpty();
+    this->writeRow(trip.getRecord(),
+                   datesEmpty ? 0 : trip.getStartDate().getDayNumber(),
+                   datesEmpty ? 0 : trip.getEndDate().getDayNumber(), datesEmpty,
+                   trip.getStartReading(), trip.getEndReading(), trip.getFare(), trip.isCompleted(),
+                   trip.getVehicle().getRecord(), &trip.getVehicle(),
+                   trip.getUser().getRecord(), &trip.getUser());
+}
+
+void TripExporter ::write(const ArchivedTrip &trip, const Vehicle *vehicle, const User *user) throw(IOError)
+{
+    this->writeRow(trip.recordId, trip.startDay, trip.endDay, false,
+                   trip.startReading, trip.endReading, trip.fare, true,
+                   trip.vehicleId, vehicle, trip.userId, user);
+}
+
+//Writes out whatever is still buffered
+void TripExporter ::finish() throw(IOError)
+{
+    if (fwrite(this->buffer.data(), 1, this->used, this->out) != this->used || fflush(this->out) != 0)
+    {
+        throw IOError();
+    }
+    this->used = 0;
+}
+
+//The data files are read from location, which is prepended to their names
+//(a directory with a trailing separator or a file name prefix). A database
+//given as userSource lends its users instead of reading users.txt.
+Database ::Database(string location, const Database *userSource, bool readOnly) throw(IOError, MemoryError)
+{
+    TRACE_SPAN("Database::open");
+    // the lookups made while loading are not calls of the workload
+    RecordedCall unrecorded(callUnrecorded);
+    try
+    {
+        this->persister = nullptr;
+        this->mutationLog = nullptr;
+        this->telemetry = nullptr;
+        this->hotReload = nullptr;
+        this->backup = nullptr;
+        this->telemetryFeed = nullptr;
+        this->archivedDay = 0;
+        this->location = location;
+        this->compaction = new Compaction(this);
+        this->registrationSearch = new TextIndex();
+        this->nameSearch = new TextIndex();
+        this->emailSearch = new TextIndex();
+        this->tripCalendar = new TripCalendar();
+        this->availabilityCache = new AvailabilityCache(AVAILABILITYCACHESIZE);
+        this->readOnly = readOnly;
+        this->ownsUsers = userSource == nullptr;
+        this->vehicleTable = new Table<Vehicle>(location + "vehicle.txt");
+        this->userStore = userSource ? userSource->userStore : nullptr;
+        if (userSource)
+        {
+            this->userTable = userSource->userTable;
+        }
+        else if (PAGEDUSERS)
+        {
+            // a table without a file, the users are written to the store
+            this->userTable = new Table<User>("");
+            this->userStore = new UserStore(location + "users.db", USERPAGECACHE);
+        }
+        else
+        {
+            this->userTable = new Table<User>(location + "users.txt");
+        }
+        this->tripTable = new Table<Trip>(location + "trips.txt", TRIPRECORDWIDTH);
+        this->tripArchive = new TripArchive(location + TRIPARCHIVEPREFIX);
+
+        this->fetchAllVehicles();
+        if (this->ownsUsers && this->userStore)
+        {
+            this->openUserStore(location);
+        }
+        else if (this->ownsUsers)
+        {
+            this->fetchAllUsers();
+        }
+        this->fetchAllTrips();
+
+        // archived and deleted records keep their ids, new ones must never reuse them
+        this->vehicleTable->loadSequence();
+        if (this->ownsUsers)
+        {
+            this->userTable->loadSequence();
+        }
+        this->tripTable->loadSequence();
+        this->tripTable->reserveRecordIds(this->tripArchive->getLastRecordId());
+        if (readOnly)
+        {
+            return;
+        }
+        this->archivedDay = Date().getDayNumber();
+        this->archiveCompletedTrips(ARCHIVEAFTERDAYS);
+
+        if (ASYNCPERSISTENCE)
+        {
+            this->persister = new Persister();
+            this->vehicleTable->setPersister(this->persister);
+            if (this->ownsUsers)
+            {
+                this->userTable->setPersister(this->persister);
+            }
+            this->tripTable->setPersister(this->persister);
+        }
+    }
+    catch (...)
+    {
+        throw;
+    }
+}
+
+//Builds a vehicle from one line of vehicle.txt
+Vehicle *Database ::parseVehicle(const string &line) const
+{
+    return RecordCodec<Vehicle>::parse(line, *this);
+}
+
+//Builds a user from one line of users.txt
+User *Database ::parseUser(const string &line) const
+{
+    return RecordCodec<User>::parse(line, *this);
+}
+
+//Builds a trip from one line of trips.txt, its vehicle and user have to be
+//loaded already
+Trip *Database ::parseTrip(const string &line) const
+{
+    return RecordCodec<Trip>::parse(line, *this);
+}
+
+//Finds the records a trip refers to, for the codecs reading trips
+void Database ::resolve(long recordId, const Vehicle *&vehicle) const
+{
+    vehicle = this->vehicleTable->getReferenceOfRecordForId(recordId);
+}
+
+void Database ::resolve(long recordId, const User *&user) const
+{
+    user = this->getUserForId(recordId);
+}
+
+//Users are kept in users.db in the binary layout of their schema, stores
+//from before that hold the lines of users.txt until they are converted
+User *Database ::decodeUser(const string &record) const
+{
+    if (this->userStore->holdsText())
+    {
+        return this->parseUser(record);
+    }
+    return RecordCodec<User>::decode(record, *this);
+}
+
+void Database ::fetchAllVehicles() throw(IOError, MemoryError)
+{
+    TRACE_SPAN("Database::fetchAllVehicles");
+    // taken before reading, a change made meanwhile is then seen as one
+    this->vehicleTable->recordFileState();
+    this->vehicleTable->fileStream.open(this->vehicleTable->fileName);
+
+    if (!this->vehicleTable->fileStream)
+    {
+        throw IOError();
+    }
+    for (string line; getline(this->vehicleTable->fileStream, line);)
+    {
+        line = trimRecord(line);
+        if (line.empty())
+        {
+            continue;
+        }
+        this->vehicleTable->records.push_back(this->parseVehicle(line));
+    }
+
+    this->vehicleTable->fileStream.close();
+    this->vehicleTable->sortRecords();
+    for (auto vehicle : this->vehicleTable->records)
+    {
+        this->registrationSearch->index(vehicle->getRecord(), vehicle->getRegistrationNumber());
+    }
+}
+
+void Database ::fetchAllUsers() throw(IOError, MemoryError)
+{
+    TRACE_SPAN("Database::fetchAllUsers");
+    this->userTable->recordFileState();
+    this->userTable->fileStream.open(this->userTable->fileName);
+
+    if (!this->userTable->fileStream)
+    {
+        throw IOError();
+    }
+
+    for (string line; getline(this->userTable->fileStream, line);)
+    {
+        line = trimRecord(line);
+        if (line.empty())
+        {
+            continue;
+        }
+        this->userTable->records.push_back(this->parseUser(line));
+    }
+
+    this->userTable->fileStream.close();
+    this->userTable->sortRecords();
+    for (auto user : this->userTable->records)
+    {
+        this->onRecordAdded(user);
+    }
+}
+
+//Paged mode: the users stay on disk and are loaded as trips and lookups
+//need them. A users.txt from before is imported into a new store once.
+void Database ::openUserStore(string location) throw(IOError, MemoryError)
+{
+    TRACE_SPAN("Database::openUserStore");
+    if (this->userStore->isNew() && !this->readOnly)
+    {
+        ifstream in(location + "users.txt");
+        for (string line; getline(in, line);)
+        {
+            line = trimRecord(line);
+            if (line.empty())
+            {
+                continue;
+            }
+            try
+            {
+                unique_ptr<User> user(this->parseUser(line));
+                string record;
+                RecordCodec<User>::encode(*user, record);
+                this->userStore->put(user->getRecord(), user->getContact(), record);
+            }
+            catch (IOError error)
+            {
+                throw;
+            }
+            catch (...)
+            {
+            }
+        }
+        this->userStore->writePending();
+    }
+    else if (this->userStore->holdsText() && !this->readOnly)
+    {
+        this->userStore->convertValues([this](const string &record) {
+            unique_ptr<User> user(this->parseUser(record));
+            string value;
+            RecordCodec<User>::encode(*user, value);
+            return value;
+        });
+        this->userStore->writePending();
+    }
+    this->userTable->reserveRecordIds(this->userStore->getLastRecordId());
+}
+
+//Has the store's pages written, by the persistence thread when there is one
+void Database ::persistUsers() throw(IOError)
+{
+    if (this->persister)
+    {
+        this->persister->schedule(this->userStore);
+        return;
+    }
+    this->userStore->writePending();
+}
+
+//Whether an imported record clashes with one that is not in memory
+bool Database ::isStored(const Vehicle &) const
+{
+    return false;
+}
+
+bool Database ::isStored(const User &user) const
+{
+    long recordId;
+    return this->userStore && this->userStore->findContact(user.getContact(), recordId);
+}
+
+void Database ::fetchAllTrips() throw(IOError, MemoryError)
+{
+    TRACE_SPAN("Database::fetchAllTrips");
+    this->tripTable->fileStream.open(this->tripTable->fileName);
+    if (!this->tripTable->fileStream)
+    {
+        throw IOError();
+    }
+
+    // a file that is not laid out in fixed-width slots yet (for example one
+    // written with plain lines) is converted once after loading
+    bool needsLayout = false;
+    long slot = 0;
+    for (string line; getline(this->tripTable->fileStream, line); slot++)
+    {
+        if (this->tripTable->isFixedWidth() && line.length() + 1 != this->tripTable->recordWidth)
+        {
+            needsLayout = true;
+        }
+        line = trimRecord(line);
+        if (line.empty())
+        {
+            continue;
+        }
+
+        try
+        {
+            Trip *record = this->parseTrip(line);
+            this->tripTable->records.push_back(record);
+            this->tripTable->slots[record->getRecord()] = slot;
+            this->indexTrip(record);
+        }
+        catch (...)
+        {
+        }
+    }
+
+    this->tripTable->fileStream.close();
+    this->tripTable->sortRecords();
+    this->tripTable->slotCount = slot;
+    // files from before slots were packed keep an empty slot for every id
+    // that was not in the table, more of them than records are packed too
+    if (slot > 2 * (long)this->tripTable->records.size())
+    {
+        needsLayout = true;
+    }
+
+    if (needsLayout && !this->readOnly)
+    {
+        this->tripTable->writeToFile();
+    }
+}
+
+//Moves completed trips that ended more than olderThanDays ago out of the
+//trips table into a new archive segment, keeping only the active working set
+//in memory and in trips.txt. Called on the database's own thread.
+void Database ::archiveCompletedTrips(long olderThanDays) throw(IOError)
+{
+    TRACE_SPAN("Database::archiveCompletedTrips");
+    // a backup still reads the trips from the table
+    if (this->tripTable->backingUp)
+    {
+        return;
+    }
+    long cutoff = Date().getDayNumber() - olderThanDays;
+    vector<ArchivedTrip> archived;
+    vector<Trip *> archivedTrips;
+    vector<Trip *> remaining;
+
+    for (auto trip : this->tripTable->records)
+    {
+        if (!trip->isDeleted() && trip->isCompleted() && !trip->getEndDate().isEmpty() &&
+            trip->getEndDate().getDayNumber() < cutoff)
+        {
+            ArchivedTrip entry = {
+                trip->getRecord(),
+                trip->getVehicle().getRecord(),
+                trip->getUser().getRecord(),
+                trip->getStartDate().getDayNumber(),
+                trip->getEndDate().getDayNumber(),
+                trip->getStartReading(),
+                trip->getEndReading(),
+                trip->getFare()};
+            archived.push_back(entry);
+            archivedTrips.push_back(trip);
+        }
+        else
+        {
+            remaining.push_back(trip);
+        }
+    }
+    if (archivedTrips.empty())
+    {
+        return;
+    }
+
+    // the segment is written before the trips leave trips.txt, so a failure
+    // in between can leave a trip in both places, never in neither. Such
+    // trips are in the archive already and only leave trips.txt now.
+    size_t due = archived.size();
+    this->tripArchive->removeStored(archived);
+    if (archived.size() == due && due < ARCHIVEMINTRIPS)
+    {
+        return;
+    }
+    this->tripArchive->addSegment(archived);
+    vector<Trip *> old;
+    {
+        lock_guard<mutex> guard(this->tripTable->lock);
+        old.swap(this->tripTable->records);
+        this->tripTable->records = remaining;
+        this->tripTable->reserveRecordIds(this->tripArchive->getLastRecordId());
+        this->tripTable->generation++;
+    }
+    try
+    {
+        this->tripTable->persist(nullptr);
+    }
+    catch (IOError error)
+    {
+        lock_guard<mutex> guard(this->tripTable->lock);
+        this->tripTable->records.swap(old);
+        this->tripTable->generation++;
+        throw;
+    }
+    for (auto trip : archivedTrips)
+    {
+        this->unindexTrip(trip);
+        delete trip;
+    }
+}
+
+ArchivedTrip Database ::getArchivedTrip(long recordId) const throw(IOError, RecordNotFoundError)
+{
+    TRACE_SPAN("Database::getArchivedTrip");
+    return this->tripArchive->getTrip(recordId);
+}
+
+void Database ::forEachArchivedTrip(function<void(const ArchivedTrip &)> visit) const throw(IOError)
+{
+    this->tripArchive->forEach(visit);
+}
+
+//Sort key of a trip in the adjacency lists
+static long tripStartKey(const Trip *trip)
+{
+    return trip->getStartDate().isEmpty() ? LONG_MIN : trip->getStartDate().getDayNumber();
+}
+
+//Adds the trip to the lists of its user and its vehicle, after any trip
+//that starts on the same day so insertion order is kept for ties
+void Database ::indexTrip(const Trip *trip)
+{
+    auto byStart = [](long key, const Trip *other) { return key < tripStartKey(other); };
+    for (auto list : {&this->tripsByUser[trip->getUser().getRecord()],
+                      &this->tripsByVehicle[trip->getVehicle().getRecord()]})
+    {
+        list->insert(upper_bound(list->begin(), list->end(), tripStartKey(trip), byStart), trip);
+    }
+    this->tripCalendar->add(trip);
+}
+
+void Database ::unindexTrip(const Trip *trip)
+{
+    for (auto list : {&this->tripsByUser[trip->getUser().getRecord()],
+                      &this->tripsByVehicle[trip->getVehicle().getRecord()]})
+    {
+        list->erase(remove(list->begin(), list->end(), trip), list->end());
+    }
+    this->tripCalendar->remove(trip);
+}
+
+//Keeps the indexes and the availability cache in step with a new record
+void Database ::onRecordAdded(const Vehicle *vehicle)
+{
+    this->availabilityCache->invalidate(vehicle->getVehicleType());
+    this->registrationSearch->index(vehicle->getRecord(), vehicle->getRegistrationNumber());
+}
+
+void Database ::onRecordAdded(const User *user)
+{
+    this->nameSearch->index(user->getRecord(), user->getName());
+    this->emailSearch->index(user->getRecord(), user->getEmail());
+    if (this->userStore && !this->readOnly)
+    {
+        string record;
+        RecordCodec<User>::encode(*user, record);
+        this->userStore->put(user->getRecord(), user->getContact(), record);
+        this->persistUsers();
+    }
+}
+
+void Database ::onRecordAdded(const Trip *trip)
+{
+    this->indexTrip(trip);
+    this->invalidateAvailability(*trip);
+}
+
+void Database ::invalidateAvailability(const Trip &trip)
+{
+    AvailabilityKey range = AvailabilityCache::makeKey(trip.getStartDate(), trip.getEndDate(),
+                                                       trip.getVehicle().getVehicleType());
+    this->availabilityCache->invalidate(trip.getVehicle().getVehicleType(), range.startDay, range.endDay);
+}
+
+Compaction ::Compaction(Database *database)
+{
+    this->database = database;
+    this->pending = false;
+    this->ready = false;
+}
+
+//Runs on the persistence thread
+void Compaction ::writePending() throw(IOError)
+{
+    this->database->prepareCompaction();
+}
+
+//Copies the live records of the tables and rebuilds the trip indexes from
+//them. The files are rewritten as well, which packs the slots of trips.txt.
+void Database ::prepareCompaction()
+{
+    TRACE_SPAN("Database::prepareCompaction");
+    Compaction &result = *this->compaction;
+    unordered_map<long, vector<pair<long, const Trip *>>> startsByUser, startsByVehicle;
+    unordered_map<long, vector<const Trip *>> byUser, byVehicle;
+    vector<Vehicle *> vehicles;
+    vector<User *> users;
+    vector<Trip *> trips;
+    long vehicleGeneration = this->vehicleTable->snapshotLive(vehicles, [](Vehicle *) {});
+    long userGeneration = this->ownsUsers ? this->userTable->snapshotLive(users, [](User *) {}) : 0;
+    // the trips are only read while the table is locked, so the start
+    // dates are taken along for ordering the lists
+    long tripGeneration = this->tripTable->snapshotLive(trips, [&](Trip *trip) {
+        startsByUser[trip->getUser().getRecord()].push_back(make_pair(tripStartKey(trip), trip));
+        startsByVehicle[trip->getVehicle().getRecord()].push_back(make_pair(tripStartKey(trip), trip));
+    });
+    auto byStart = [](const pair<long, const Trip *> &a, const pair<long, const Trip *> &b) { return a.first < b.first; };
+    for (auto index : {make_pair(&startsByUser, &byUser), make_pair(&startsByVehicle, &byVehicle)})
+    {
+        for (auto &starts : *index.first)
+        {
+            stable_sort(starts.second.begin(), starts.second.end(), byStart);
+            vector<const Trip *> &list = (*index.second)[starts.first];
+            for (auto &start : starts.second)
+            {
+                list.push_back(start.second);
+            }
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(result.lock);
+        result.vehicles.swap(vehicles);
+        result.users.swap(users);
+        result.trips.swap(trips);
+        result.vehicleGeneration = vehicleGeneration;
+        result.userGeneration = userGeneration;
+        result.tripGeneration = tripGeneration;
+        result.tripsByUser.swap(byUser);
+        result.tripsByVehicle.swap(byVehicle);
+        result.ready = true;
+    }
+    if (!this->readOnly)
+    {
+        this->vehicleTable->persist(nullptr);
+        if (this->ownsUsers)
+        {
+            this->userTable->persist(nullptr);
+        }
+        this->tripTable->persist(nullptr);
+    }
+}
+
+//Called on the database's own thread. Installs a prepared compaction, or
+//starts one when a table holds too many tombstones. A result is dropped
+//for every table that changed after it was prepared; the next call starts
+//over if that table is still above the threshold.
+void Database ::compactIfDue()
+{
+    // a database that stays open moves completed trips out once a day
+    long today = Date().getDayNumber();
+    if (today != this->archivedDay && !this->readOnly)
+    {
+        this->archivedDay = today;
+        try
+        {
+            this->archiveCompletedTrips(ARCHIVEAFTERDAYS);
+        }
+        catch (IOError error)
+        {
+            // trips that reached the archive leave trips.txt on the next run
+        }
+    }
+    Compaction &result = *this->compaction;
+    bool install;
+    {
+        lock_guard<mutex> guard(result.lock);
+        install = result.ready;
+    }
+    if (install)
+    {
+        lock_guard<mutex> guard(result.lock);
+        this->vehicleTable->installLive(result.vehicles, result.vehicleGeneration);
+        if (this->ownsUsers)
+        {
+            this->userTable->installLive(result.users, result.userGeneration);
+        }
+        if (this->tripTable->installLive(result.trips, result.tripGeneration))
+        {
+            this->tripsByUser.swap(result.tripsByUser);
+            this->tripsByVehicle.swap(result.tripsByVehicle);
+        }
+        result.vehicles.clear();
+        result.users.clear();
+        result.trips.clear();
+        result.tripsByUser.clear();
+        result.tripsByVehicle.clear();
+        result.ready = false;
+        result.pending = false;
+        return;
+    }
+
+    if (this->vehicleTable->getTombstones() < COMPACTAFTERTOMBSTONES &&
+        (!this->ownsUsers || this->userTable->getTombstones() < COMPACTAFTERTOMBSTONES) &&
+        this->tripTable->getTombstones() < COMPACTAFTERTOMBSTONES)
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(result.lock);
+        if (result.pending)
+        {
+            return;
+        }
+        result.pending = true;
+    }
+    if (this->persister)
+    {
+        this->persister->schedule(this->compaction);
+        return;
+    }
+    // without a persistence thread the work is done right here
+    this->prepareCompaction();
+    this->compactIfDue();
+}
+
+HotReload ::HotReload(Database *database, string location)
+{
+    this->database = database;
+    this->vehicleSnapshot = false;
+    this->userSnapshot = false;
+    this->ready = false;
+    this->stopping = false;
+    this->notifier = -1;
+#ifdef __linux__
+    // the directory is watched, replacing a file renames another one over it
+    this->notifier = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (this->notifier >= 0 &&
+        inotify_add_watch(this->notifier, location.empty() ? "." : location.c_str(),
+                          IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        close(this->notifier);
+        this->notifier = -1;
+    }
+#endif
+    this->worker = thread(&HotReload::run, this);
+}
+
+HotReload ::~HotReload()
+{
+    this->stopping = true;
+    this->worker.join();
+#ifdef __linux__
+    if (this->notifier >= 0)
+    {
+        close(this->notifier);
+    }
+#endif
+    for (auto vehicle : this->vehicles)
+    {
+        delete vehicle;
+    }
+    for (auto user : this->users)
+    {
+        delete user;
+    }
+}
+
+//Sleeps until one of the files may have changed, or for one poll interval
+//without inotify. Returns false when it only woke up to look at stopping.
+bool HotReload ::waitForChange()
+{
+#ifdef __linux__
+    if (this->notifier >= 0)
+    {
+        pollfd descriptor = {this->notifier, POLLIN, 0};
+        if (::poll(&descriptor, 1, RELOADPOLLMILLISECONDS) <= 0)
+        {
+            return false;
+        }
+        bool changed = false;
+        alignas(inotify_event) char events[4096];
+        ssize_t length;
+        while ((length = read(this->notifier, events, sizeof(events))) > 0)
+        {
+            for (char *at = events; at < events + length;)
+            {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(at);
+                string name = event->len ? event->name : "";
+                changed = changed || name == "vehicle.txt" || name == "users.txt";
+                at += sizeof(inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+#endif
+    this_thread::sleep_for(chrono::milliseconds(RELOADPOLLMILLISECONDS));
+    return true;
+}
+
+void HotReload ::run()
+{
+    while (!this->stopping)
+    {
+        if (!this->waitForChange())
+        {
+            continue;
+        }
+        try
+        {
+            this->database->prepareReload(*this);
+        }
+        catch (...)
+        {
+            // the next change or poll looks again
+        }
+    }
+}
+
+//Adds freshly parsed records to those waiting, a replaced file drops the
+//records parsed before it
+template <class T>
+static void queueFileChange(FileChange change, vector<T *> &parsed, vector<T *> &queued, bool &snapshot)
+{
+    if (change == fileReplaced)
+    {
+        for (auto record : queued)
+        {
+            delete record;
+        }
+        queued.clear();
+        snapshot = true;
+    }
+    queued.insert(queued.end(), parsed.begin(), parsed.end());
+}
+
+//Runs on the watching thread. Users are only watched when they are this
+//database's own and kept in users.txt.
+void Database ::prepareReload(HotReload &reload)
+{
+    vector<Vehicle *> vehicles;
+    FileChange change = this->vehicleTable->readChanges([this](const string &line) { return this->parseVehicle(line); }, vehicles);
+    if (change != fileUnchanged)
+    {
+        lock_guard<mutex> guard(reload.lock);
+        queueFileChange(change, vehicles, reload.vehicles, reload.vehicleSnapshot);
+        reload.ready = true;
+    }
+    if (!this->ownsUsers || this->userStore)
+    {
+        return;
+    }
+    vector<User *> users;
+    change = this->userTable->readChanges([this](const string &line) { return this->parseUser(line); }, users);
+    if (change != fileUnchanged)
+    {
+        lock_guard<mutex> guard(reload.lock);
+        queueFileChange(change, users, reload.users, reload.userSnapshot);
+        reload.ready = true;
+    }
+}
+
+//Starts taking in the changes other programs make to the files
+void Database ::watchFiles()
+{
+    if (!this->hotReload && !this->readOnly)
+    {
+        this->hotReload = new HotReload(this, this->location);
+    }
+}
+
+//Numbers new vehicles and trips from sequences shared with other databases,
+//as the shards of one database do
+void Database ::shareRecordIds(atomic<long> *vehicleIds, atomic<long> *tripIds)
+{
+    this->vehicleTable->shareSequence(vehicleIds);
+    this->tripTable->shareSequence(tripIds);
+}
+
+//Starts a new mutation log for followers. Only the long running primary
+//does, one-shot commands would wipe the log it is writing.
+void Database ::shipMutations() throw(IOError)
+{
+    if (!this->mutationLog && !this->readOnly)
+    {
+        this->mutationLog = new MutationLog(this->location + "mutations.log");
+    }
+}
+
+//Starts taking in the readings appended to the telemetry file
+void Database ::watchTelemetry()
+{
+    if (!this->telemetryFeed)
+    {
+        this->telemetryFeed = new TelemetryFeed(this, this->location);
+    }
+}
+
+TelemetryFeed ::TelemetryFeed(Database *database, string location)
+{
+    this->database = database;
+    this->fileName = location + TELEMETRYFEED;
+    this->offset = 0;
+    this->stopping = false;
+    this->worker = thread(&TelemetryFeed::run, this);
+}
+
+TelemetryFeed ::~TelemetryFeed()
+{
+    this->stopping = true;
+    this->worker.join();
+}
+
+void TelemetryFeed ::run()
+{
+    while (!this->stopping)
+    {
+        this->poll();
+        this_thread::sleep_for(chrono::milliseconds(TELEMETRYFEEDMILLISECONDS));
+    }
+}
+
+//The id of the vehicle with the registration number. A remembered id is
+//checked again, the vehicle may have been renamed or deleted since.
+bool TelemetryFeed ::findVehicle(const string &registrationNo, long &vehicleId)
+{
+    Table<Vehicle> *table = this->database->vehicleTable;
+    lock_guard<mutex> guard(table->lock);
+    auto known = this->vehicleIds.find(registrationNo);
+    if (known != this->vehicleIds.end())
+    {
+        auto position = table->findRecord(known->second);
+        if (position != table->records.end() && !(*position)->isDeleted() &&
+            (*position)->getRegistrationNumber() == registrationNo)
+        {
+            vehicleId = known->second;
+            return true;
+        }
+        this->vehicleIds.erase(known);
+    }
+    for (auto vehicle : table->records)
+    {
+        if (!vehicle->isDeleted() && vehicle->getRegistrationNumber() == registrationNo)
+        {
+            vehicleId = this->vehicleIds[registrationNo] = vehicle->getRecord();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TelemetryFeed ::poll()
+{
+    ifstream feed(this->fileName, ios::binary);
+    if (!feed)
+    {
+        return;
+    }
+    feed.seekg(0, ios::end);
+    streamoff size = feed.tellg();
+    if (size < this->offset)
+    {
+        this->offset = 0;
+    }
+    if (size == this->offset)
+    {
+        return;
+    }
+    feed.seekg(this->offset);
+    string pending(size - this->offset, '\0');
+    feed.read(&pending[0], pending.length());
+    // a line that is still being written is left for the next poll
+    size_t complete = pending.rfind('\n');
+    if (complete == string::npos)
+    {
+        return;
+    }
+    TelemetryIngest &telemetry = this->database->getTelemetry();
+    istringstream lines(pending.substr(0, complete));
+    for (string line; getline(lines, line);)
+    {
+        vector<string> fields = split(trimRecord(line), DELIMETER);
+        long vehicleId;
+        if (fields.size() != 3 || !this->findVehicle(fields[0], vehicleId))
+        {
+            continue;
+        }
+        telemetry.submit(TelemetryReading{vehicleId, atol(fields[1].c_str()), atoll(fields[2].c_str())});
+    }
+    this->offset += complete + 1;
+}
+
+//Called on the database's own thread. Applies what the watcher parsed: an
+//appended line adds its record or replaces the one with its id, a replaced
+//file is merged in whole (see Table::mergeSnapshot). The changes go to the
+//mutation log like any other, so followers see them too.
+void Database ::applyFileChanges() throw(IOError)
+{
+    if (!this->hotReload || !this->hotReload->ready)
+    {
+        return;
+    }
+    TRACE_SPAN("Database::applyFileChanges");
+    RecordedCall unrecorded(callUnrecorded);
+    HotReload &reload = *this->hotReload;
+    vector<Vehicle *> vehicles;
+    vector<User *> users;
+    bool vehicleSnapshot, userSnapshot;
+    {
+        lock_guard<mutex> guard(reload.lock);
+        vehicles.swap(reload.vehicles);
+        users.swap(reload.users);
+        vehicleSnapshot = reload.vehicleSnapshot;
+        userSnapshot = reload.userSnapshot;
+        reload.vehicleSnapshot = false;
+        reload.userSnapshot = false;
+        reload.ready = false;
+    }
+
+    vector<Vehicle *> changedVehicles, removedVehicles;
+    if (vehicleSnapshot)
+    {
+        this->vehicleTable->mergeSnapshot(vehicles, [this](const Vehicle &vehicle) {
+            return !this->getTripsForVehicle(vehicle.getRecord()).empty();
+        }, changedVehicles, removedVehicles);
+    }
+    for (auto vehicle : vehicles)
+    {
+        changedVehicles.push_back(this->vehicleTable->applyRecord(vehicle));
+    }
+    for (auto vehicle : changedVehicles)
+    {
+        this->onRecordAdded(vehicle);
+        this->logMutation('U', vehicle);
+    }
+    for (auto vehicle : removedVehicles)
+    {
+        this->registrationSearch->remove(vehicle->getRecord());
+        this->logMutation('D', vehicle);
+    }
+    // a vehicle's old type is not known any more, every type is searched again
+    if (!changedVehicles.empty() || !removedVehicles.empty())
+    {
+        for (VehicleType type : {bike, car, bus})
+        {
+            this->availabilityCache->invalidate(type);
+        }
+    }
+
+    vector<User *> changedUsers, removedUsers;
+    if (userSnapshot)
+    {
+        this->userTable->mergeSnapshot(users, [this](const User &user) {
+            return !this->getTripsForUser(user.getRecord()).empty();
+        }, changedUsers, removedUsers);
+    }
+    for (auto user : users)
+    {
+        changedUsers.push_back(this->userTable->applyRecord(user));
+    }
+    for (auto user : changedUsers)
+    {
+        this->onRecordAdded(user);
+        this->logMutation('U', user);
+    }
+    for (auto user : removedUsers)
+    {
+        this->nameSearch->remove(user->getRecord());
+        this->emailSearch->remove(user->getRecord());
+        this->logMutation('D', user);
+    }
+    this->compactIfDue();
+}
+
+//Starts an online backup into location and returns a future that is ready
+//once it is complete, or holds the IOError that stopped it. The backup shows
+//the database as it is when this is called, later writes are not in it.
+shared_future<void> Database ::startBackup(string location) throw(IOError)
+{
+    TRACE_SPAN("Database::startBackup");
+    if (location == this->location)
+    {
+        throw BackupError("the backup would replace the database's own files");
+    }
+    if (this->backup)
+    {
+        if (this->backup->result.wait_for(chrono::seconds(0)) != future_status::ready)
+        {
+            throw BackupError("another backup is still running");
+        }
+        delete this->backup;
+        this->backup = nullptr;
+    }
+    // changes other programs made to the files belong to this point in time
+    this->applyFileChanges();
+    this->backup = new Backup(this, location);
+    return this->backup->result;
+}
+
+//Called on the database's thread, so no change is half made while the
+//tables are marked. Paged users are not versioned, they are copied before
+//this returns.
+Backup ::Backup(Database *database, string location) throw(IOError)
+{
+    this->database = database;
+    this->location = location;
+    this->result = this->written.get_future().share();
+    // a location ending in a separator is a directory of its own
+    if (!location.empty() && (location.back() == '/' || location.back() == '\\'))
+    {
+        string directory = location.substr(0, location.length() - 1);
+#ifdef _WIN32
+        int made = mkdir(directory.c_str());
+#else
+        int made = mkdir(directory.c_str(), 0755);
+#endif
+        if (made != 0 && errno != EEXIST)
+        {
+            throw BackupError("cannot create " + directory);
+        }
+    }
+    if (database->ownsUsers && database->userStore)
+    {
+        this->copyPagedUsers();
+    }
+    this->vehicleSequence = database->vehicleTable->startBackup();
+    this->userSequence = database->ownsUsers && !database->userStore ? database->userTable->startBackup() : 0;
+    this->tripSequence = database->tripTable->startBackup();
+    this->worker = thread(&Backup::run, this);
+}
+
+Backup ::~Backup()
+{
+    this->worker.join();
+}
+
+void Backup ::run()
+{
+    TRACE_SPAN("Backup::run");
+    Database &database = *this->database;
+    bool users = database.ownsUsers && !database.userStore;
+    try
+    {
+        this->copyTable(database.vehicleTable, "vehicle.txt", this->vehicleSequence);
+        if (users)
+        {
+            this->copyTable(database.userTable, "users.txt", this->userSequence);
+        }
+        this->copyTable(database.tripTable, "trips.txt", this->tripSequence);
+        // segments are only added while the database loads
+        database.tripArchive->copyTo(this->location + TRIPARCHIVEPREFIX);
+        this->written.set_value();
+    }
+    catch (IOError &error)
+    {
+        // the tables the backup did not get to stop keeping versions
+        database.vehicleTable->finishBackup();
+        if (users)
+        {
+            database.userTable->finishBackup();
+        }
+        database.tripTable->finishBackup();
+        this->written.set_exception(current_exception());
+    }
+}
+
+//Streams the table's backup into its file in the location, in the table's
+//own format. The file only gets its name once it is complete.
+template <typename T>
+void Backup ::copyTable(Table<T> *table, string fileName, long sequence) throw(IOError)
+{
+    TRACE_SPAN("Backup::copyTable");
+    string path = this->location + fileName;
+    ofstream out(path + ".tmp", ios::trunc | ios::binary);
+    string chunk;
+    bool more = true;
+    try
+    {
+        while (out && more)
+        {
+            chunk.clear();
+            more = table->readBackupChunk(chunk, BACKUPCHUNKRECORDS);
+            out.write(chunk.data(), chunk.length());
+        }
+    }
+    catch (IOError &error)
+    {
+        table->finishBackup();
+        throw;
+    }
+    table->finishBackup();
+    out.close();
+    if (!out || !replaceFile(path + ".tmp", path))
+    {
+        throw BackupError("cannot write " + path);
+    }
+    // the ids of records deleted before the backup are not given out again
+    ofstream sequenceFile(path + ".seq", ios::trunc);
+    sequenceFile << sequence << "\n";
+    if (!sequenceFile)
+    {
+        throw BackupError("cannot write " + path + ".seq");
+    }
+}
+
+//Writes the users of users.db as a users.txt, which a database in paged mode
+//imports on first use
+void Backup ::copyPagedUsers() throw(IOError)
+{
+    TRACE_SPAN("Backup::copyPagedUsers");
+    string path = this->location + "users.txt";
+    ofstream out(path + ".tmp", ios::trunc | ios::binary);
+    string line;
+    this->database->forEachUser([&](const User &user) {
+        line.clear();
+        RecordCodec<User>::format(user, line);
+        line.push_back('\n');
+        out.write(line.data(), line.length());
+    });
+    out.close();
+    if (!out || !replaceFile(path + ".tmp", path))
+    {
+        throw BackupError("cannot write " + path);
+    }
+}
+
+CacheStats Database ::getAvailabilityCacheStats() const
+{
+    return this->availabilityCache->getStats();
+}
+
+//Trips booked by the user ordered by start date, the user's "my bookings"
+const vector<const Trip *> Database ::getTripsForUser(long userId) const
+{
+    RecordedCall call(callTripsForUser);
+    call.number(userId);
+    auto trips = this->tripsByUser.find(userId);
+    if (trips == this->tripsByUser.end())
+    {
+        return vector<const Trip *>();
+    }
+    return trips->second;
+}
+
+//Trip history of the vehicle ordered by start date
+const vector<const Trip *> Database ::getTripsForVehicle(long vehicleId) const
+{
+    RecordedCall call(callTripsForVehicle);
+    call.number(vehicleId);
+    auto trips = this->tripsByVehicle.find(vehicleId);
+    if (trips == this->tripsByVehicle.end())
+    {
+        return vector<const Trip *>();
+    }
+    return trips->second;
+}
+
+//Trips starting between the two days, both included, ordered by start date:
+//today's or tomorrow's pickups, the bookings of a week
+const vector<const Trip *> Database ::getTripsStarting(Date firstDay, Date lastDay) const
+{
+    RecordedCall call(callTripsStarting);
+    call.text(firstDay.toString());
+    call.text(lastDay.toString());
+    TRACE_SPAN("Database::getTripsStarting");
+    return this->tripCalendar->startingBetween(firstDay.getDayNumber(), lastDay.getDayNumber());
+}
+
+//Trips ending between the two days, ordered by end date: the returns due
+const vector<const Trip *> Database ::getTripsEnding(Date firstDay, Date lastDay) const
+{
+    RecordedCall call(callTripsEnding);
+    call.text(firstDay.toString());
+    call.text(lastDay.toString());
+    TRACE_SPAN("Database::getTripsEnding");
+    return this->tripCalendar->endingBetween(firstDay.getDayNumber(), lastDay.getDayNumber());
+}
+
+//Trips whose dates include the day, completed ones too, ordered by start date
+const vector<const Trip *> Database ::getTripsActiveOn(Date day) const
+{
+    RecordedCall call(callTripsActiveOn);
+    call.text(day.toString());
+    TRACE_SPAN("Database::getTripsActiveOn");
+    return this->tripCalendar->activeOn(day.getDayNumber());
+}
+
+const TripCalendar &Database ::getTripCalendar() const
+{
+    return *this->tripCalendar;
+}
+
+Cursor<Vehicle> Database ::vehicles() const
+{
+    return this->vehicleTable->cursor();
+}
+
+Cursor<User> Database ::users() const
+{
+    return this->userTable->cursor();
+}
+
+Cursor<Trip> Database ::trips() const
+{
+    return this->tripTable->cursor();
+}
+
+const Vehicle *const Database ::getVehicle(string RegistrationNo)
+    const throw(RecordNotFoundError)
+{
+    RecordedCall call(callGetVehicle);
+    call.text(RegistrationNo);
+    TRACE_SPAN("Database::getVehicle");
+    for (auto record : this->vehicleTable->records)
+    {
+        Vehicle *vehicle = dynamic_cast<Vehicle *>(record);
+        if (vehicle && !vehicle->isDeleted())
+        {
+            if (vehicle->getRegistrationNumber() == RegistrationNo)
+            {
+                return vehicle;
+            }
+        }
+    }
+    throw RecordNotFoundError();
+}
+
+//The user with the id. In paged mode a user that is not in memory yet is
+//read from the store and kept in the table while it is one of the last
+//RESIDENTUSERS read.
+const User *Database ::getUserForId(long recordId) const throw(RecordNotFoundError)
+{
+    RecordedCall call(callGetUserForId);
+    call.number(recordId);
+    try
+    {
+        return this->userTable->getReferenceOfRecordForId(recordId);
+    }
+    catch (RecordNotFoundError error)
+    {
+        if (!this->userStore)
+        {
+            throw;
+        }
+    }
+    // a page that cannot be read leaves its users unreachable
+    string record;
+    User *stored;
+    try
+    {
+        if (!this->userStore->get(recordId, record))
+        {
+            throw RecordNotFoundError();
+        }
+        stored = this->decodeUser(record);
+    }
+    catch (IOError error)
+    {
+        throw RecordNotFoundError();
+    }
+    catch (out_of_range &error)
+    {
+        throw RecordNotFoundError();
+    }
+    User *user = this->userTable->applyRecord(stored);
+    this->nameSearch->index(user->getRecord(), user->getName());
+    this->emailSearch->index(user->getRecord(), user->getEmail());
+    this->storedUsers.push_back(recordId);
+    this->evictStoredUsers();
+    return user;
+}
+
+//Keeps at most RESIDENTUSERS of the users read from the store in memory.
+//Users with trips stay, the trips point to them.
+void Database ::evictStoredUsers() const
+{
+    while (this->storedUsers.size() > RESIDENTUSERS)
+    {
+        long recordId = this->storedUsers.front();
+        this->storedUsers.pop_front();
+        auto trips = this->tripsByUser.find(recordId);
+        if (trips != this->tripsByUser.end() && !trips->second.empty())
+        {
+            continue;
+        }
+        this->nameSearch->remove(recordId);
+        this->emailSearch->remove(recordId);
+        this->userTable->evictRecord(recordId);
+    }
+}
+
+//Every user, including those of the store that are not in memory
+void Database ::forEachUser(function<void(const User &)> visit) const throw(IOError)
+{
+    if (!this->userStore)
+    {
+        this->users().forEach(visit);
+        return;
+    }
+    this->userStore->forEach([&](const string &record) {
+        unique_ptr<User> user(this->decodeUser(record));
+        visit(*user);
+    });
+}
+
+const User *const Database ::getUser(string contactNo) const throw(RecordNotFoundError)
+{
+    RecordedCall call(callGetUser);
+    call.text(contactNo);
+    TRACE_SPAN("Database::getUser");
+    long recordId;
+    if (this->userStore)
+    {
+        try
+        {
+            if (!this->userStore->findContact(contactNo, recordId))
+            {
+                throw RecordNotFoundError();
+            }
+        }
+        catch (IOError error)
+        {
+            throw RecordNotFoundError();
+        }
+        return this->getUserForId(recordId);
+    }
+    for (auto record : this->userTable->records)
+    {
+        User *user = dynamic_cast<User *>(record);
+        if (user && !user->isDeleted())
+        {
+            if (user->getContact() == contactNo)
+            {
+                return user;
+            }
+        }
+    }
+    throw RecordNotFoundError();
+}
+
+const vector<const Vehicle *> Database ::getVehicle(Date startDate, Date endDate, VehicleType type) const
+{
+    RecordedCall call(callFindVehicles);
+    call.text(startDate.toString());
+    call.text(endDate.toString());
+    call.number(type);
+    TRACE_SPAN("Database::getAvailableVehicles");
+    vector<const Vehicle *> vehicles = vector<const Vehicle *>();
+    AvailabilityKey key = AvailabilityCache::makeKey(startDate, endDate, type);
+    if (this->availabilityCache->lookup(key, vehicles))
+    {
+        return vehicles;
+    }
+
+    for (auto vrecord : this->vehicleTable->records)
+    {
+        Vehicle *vehicle = dynamic_cast<Vehicle *>(vrecord);
+        if (vehicle && !vehicle->isDeleted() && vehicle->getVehicleType() == type)
+        {
+            bool tripFound = false;
+            // only the trips of this vehicle need to be checked
+            for (auto trip : this->getTripsForVehicle(vehicle->getRecord()))
+            {
+                if (!trip->isCompleted() &&
+                    !(trip->getStartDate() >= endDate &&
+                    trip->getEndDate() >= endDate) &&
+                    !(trip->getStartDate() <= startDate && 
+                    trip->getEndDate() <= startDate)
+                    )
+                {
+                    tripFound = true;
+                    break;
+                }
+            }
+            if (!tripFound)
+            {
+                vehicles.push_back(vehicle);
+            }
+        }
+    }
+    this->availabilityCache->store(key, vehicles);
+    return vehicles;
+}
+
+void Database ::cleanUp()
+{
+    // the watcher parses with the tables, it stops before anything else
+    delete this->hotReload;
+    // a running backup is finished first, it reads the tables too
+    delete this->backup;
+    delete this->telemetryFeed;
+    // the persister finishes the queued writes before the tables go away
+    delete this->persister;
+    delete this->compaction;
+    delete this->registrationSearch;
+    delete this->nameSearch;
+    delete this->emailSearch;
+    delete this->tripCalendar;
+    if (this->ownsUsers)
+    {
+        delete this->userStore;
+    }
+    delete this->telemetry;
+    delete this->mutationLog;
+    delete this->availabilityCache;
+    delete this->vehicleTable;
+    if (this->ownsUsers)
+    {
+        delete this->userTable;
+    }
+    delete this->tripTable;
+    delete this->tripArchive;
+}
+
+Database ::~Database()
+{
+    this->cleanUp();
+}
+
+//What-if analysis: total fare of every completed trip, current and archived,
+//when re-priced with the engine's tariffs. Trips are priced in fixed size
+//batches so memory does not grow with the history.
+Money Database ::repriceHistory(const PricingEngine &engine) const throw(IOError)
+{
+    TRACE_SPAN("Database::repriceHistory");
+    RecordedCall unrecorded(callUnrecorded);
+    const size_t BATCHSIZE = 1 << 16;
+    PricingBatch batch;
+    vector<long long> fares;
+    long long total = 0;
+    auto priceBatch = [&]() {
+        engine.reprice(batch, fares);
+        for (auto fare : fares)
+        {
+            total += fare;
+        }
+        batch.clear();
+    };
+
+    for (auto trip : this->tripTable->records)
+    {
+        if (trip->isCompleted() && !trip->isDeleted())
+        {
+            auto &vehicle = trip->getVehicle();
+            batch.add(vehicle.getVehicleType(), vehicle.getPricePerKm(),
+                      trip->getEndReading() - trip->getStartReading(),
+                      trip->getStartDate().getDayNumber(), trip->getEndDate().getDayNumber());
+        }
+        if (batch.size() == BATCHSIZE)
+        {
+            priceBatch();
+        }
+    }
+    this->tripArchive->forEach([&](const ArchivedTrip &trip) {
+        try
+        {
+            auto vehicle = this->vehicleTable->getRecordForId(trip.vehicleId);
+            batch.add(vehicle->getVehicleType(), vehicle->getPricePerKm(),
+                      trip.endReading - trip.startReading, trip.startDay, trip.endDay);
+        }
+        catch (RecordNotFoundError error)
+        {
+        }
+        if (batch.size() == BATCHSIZE)
+        {
+            priceBatch();
+        }
+    });
+    priceBatch();
+    return Money(total);
+}
+
+//Bulk import pipeline: the calling thread reads the input in chunks of lines,
+//a pool of threads parses and validates the chunks, and a single stage takes
+//the parsed chunks back in input order to drop duplicates of existing or
+//earlier rows and collect the new records. Only a bounded number of chunks
+//is in flight, so the raw input is never held in memory. The records are
+//appended in one go at the end, under contiguous ids and with a single write.
+//Rows that are rejected are written to rejects as "line;reason;row".
+template <class T>
+ImportReport Database ::importRecords(Table<T> *table, istream &in, ostream &rejects, unsigned threads) throw(IOError)
+{
+    TRACE_SPAN("Database::import");
+    RecordedCall unrecorded(callUnrecorded);
+    struct Row
+    {
+        long line;
+        T *record;
+        string reason;
+        string raw;
+    };
+    struct Chunk
+    {
+        long sequence;
+        // input lines with their line numbers
+        vector<pair<long, string>> lines;
+        vector<Row> rows;
+    };
+    if (this->readOnly)
+    {
+        throw ReadOnlyError();
+    }
+    threads = max(1u, threads);
+    const size_t maxInFlight = threads * 2;
+
+    BoundedQueue<Chunk> toParse(maxInFlight);
+    mutex parsedLock;
+    condition_variable parsedChanged;
+    map<long, Chunk> parsed;
+    long nextToAppend = 0;
+    bool readingDone = false;
+    long chunksRead = 0;
+
+    vector<thread> parsers;
+    for (unsigned i = 0; i < threads; i++)
+    {
+        parsers.push_back(thread([&]() {
+            Chunk chunk;
+            while (toParse.pop(chunk))
+            {
+                for (auto &line : chunk.lines)
+                {
+                    Row row = {line.first, nullptr, "", line.second};
+                    vector<string> fields = splitCsvLine(row.raw);
+                    bool storable = row.raw.find(DELIMETER) == string::npos;
+                    if (!storable)
+                    {
+                        row.reason = string("field contains '") + DELIMETER + "'";
+                    }
+                    else
+                    {
+                        row.record = parseImportedRecord(fields, (T *)nullptr, row.reason);
+                    }
+                    chunk.rows.push_back(row);
+                }
+                chunk.lines.clear();
+                lock_guard<mutex> guard(parsedLock);
+                parsed[chunk.sequence] = move(chunk);
+                parsedChanged.notify_all();
+            }
+        }));
+    }
+
+    ImportReport report = {0, 0, 0, 0};
+    vector<T *> accepted;
+    thread appender([&]() {
+        unordered_set<string> keys;
+        table->cursor().forEach([&](const T &record) {
+            keys.insert(importKey(record));
+        });
+        while (true)
+        {
+            Chunk chunk;
+            {
+                unique_lock<mutex> guard(parsedLock);
+                parsedChanged.wait(guard, [&]() {
+                    return parsed.count(nextToAppend) || (readingDone && nextToAppend == chunksRead);
+                });
+                if (!parsed.count(nextToAppend))
+                {
+                    return;
+                }
+                chunk = move(parsed[nextToAppend]);
+                parsed.erase(nextToAppend);
+                nextToAppend++;
+                parsedChanged.notify_all();
+            }
+            for (auto &row : chunk.rows)
+            {
+                if (row.record && (!keys.insert(importKey(*row.record)).second || this->isStored(*row.record)))
+                {
+                    delete row.record;
+                    row.record = nullptr;
+                    row.reason = "duplicate";
+                }
+                if (!row.record)
+                {
+                    rejects << row.line << DELIMETER << row.reason << DELIMETER << row.raw << "\n";
+                    report.rejected++;
+                    continue;
+                }
+                accepted.push_back(row.record);
+            }
+        }
+    });
+
+    // the reader is the first stage; it waits while too many chunks are
+    // between it and the appender
+    long lineNumber = 0;
+    string line;
+    bool more = true;
+    while (more)
+    {
+        Chunk chunk;
+        chunk.sequence = chunksRead;
+        while (chunk.lines.size() < IMPORTCHUNKLINES && (more = bool(getline(in, line))))
+        {
+            lineNumber++;
+            // blank lines and a header line are not rows
+            if (trimRecord(line).empty() ||
+                (lineNumber == 1 && splitCsvLine(line)[0] == importHeader((T *)nullptr)))
+            {
+                continue;
+            }
+            chunk.lines.push_back(make_pair(lineNumber, line));
+        }
+        if (chunk.lines.empty())
+        {
+            break;
+        }
+        {
+            unique_lock<mutex> guard(parsedLock);
+            parsedChanged.wait(guard, [&]() { return chunksRead - nextToAppend < long(maxInFlight); });
+            chunksRead++;
+        }
+        toParse.push(move(chunk));
+    }
+    toParse.close();
+    {
+        lock_guard<mutex> guard(parsedLock);
+        readingDone = true;
+        parsedChanged.notify_all();
+    }
+    for (auto &parser : parsers)
+    {
+        parser.join();
+    }
+    appender.join();
+
+    try
+    {
+        table->appendRecords(accepted);
+    }
+    catch (IOError error)
+    {
+        for (auto record : accepted)
+        {
+            delete record;
+        }
+        throw;
+    }
+    for (auto record : accepted)
+    {
+        this->onRecordAdded(record);
+        this->logMutation('A', record);
+    }
+    report.imported = accepted.size();
+    if (!accepted.empty())
+    {
+        report.firstRecordId = accepted.front()->getRecord();
+        report.lastRecordId = accepted.back()->getRecord();
+    }
+    return report;
+}
+
+ImportReport Database ::importVehicles(istream &in, ostream &rejects, unsigned threads) throw(IOError)
+{
+    return this->importRecords(this->vehicleTable, in, rejects, threads);
+}
+
+ImportReport Database ::importUsers(istream &in, ostream &rejects, unsigned threads) throw(IOError)
+{
+    return this->importRecords(this->userTable, in, rejects, threads);
+}
+
+MutationLog ::MutationLog(string fileName) throw(IOError)
+{
+    this->sequence = 0;
+    this->out.open(fileName, ios::out | ios::trunc | ios::binary);
+    // a new epoch for every run, so followers notice a restart even when the
+    // new log has grown past what they read of the old one
+    long long epoch = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    this->out << "epoch" << DELIMETER << epoch << '\n';
+    this->out.flush();
+    if (!this->out)
+    {
+        throw IOError();
+    }
+}
+
+//Appends one entry and pushes it to the file right away so followers see it
+void MutationLog ::append(char table, char operation, const string &record) throw(IOError)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->sequence++;
+    this->out << this->sequence << DELIMETER << table << DELIMETER << operation << DELIMETER << record << '\n';
+    this->out.flush();
+    if (!this->out)
+    {
+        throw IOError();
+    }
+}
+
+//Letter of a table in the mutation log
+static char logTableName(const Vehicle *) { return 'V'; }
+static char logTableName(const User *) { return 'U'; }
+static char logTableName(const Trip *) { return 'T'; }
+
+template <class T>
+void Database ::logMutation(char operation, const T *record) throw(IOError)
+{
+    TRACE_SPAN("Database::logMutation");
+    if (this->mutationLog)
+    {
+        this->mutationLog->append(logTableName(record), operation, record->toString());
+    }
+}
+
+//Applies one line of a primary's mutation log to this replica and returns
+//the entry's sequence number. Adds and updates are both applied as "insert
+//or replace", so replaying entries that are already in the loaded files
+//is harmless. A malformed entry, or one whose record, vehicle or user is
+//not known, leaves the replica as it was and returns 0.
+long Database ::applyLogEntry(const string &entry)
+{
+    TRACE_SPAN("Database::applyLogEntry");
+    RecordedCall unrecorded(callUnrecorded);
+    size_t tableAt = entry.find(DELIMETER);
+    if (tableAt == string::npos || entry.length() < tableAt + 5)
+    {
+        return 0;
+    }
+    long sequence = atol(entry.c_str());
+    char table = entry[tableAt + 1];
+    char operation = entry[tableAt + 3];
+    string record = entry.substr(tableAt + 5);
+    try
+    {
+        if (operation == 'D')
+        {
+            long recordId = atol(record.c_str());
+            if (table == 'V')
+            {
+                this->availabilityCache->invalidate(this->vehicleTable->markDeleted(recordId, true)->getVehicleType());
+                this->registrationSearch->remove(recordId);
+            }
+            else if (table == 'U')
+            {
+                this->userTable->markDeleted(recordId, true);
+                this->nameSearch->remove(recordId);
+                this->emailSearch->remove(recordId);
+                if (this->userStore)
+                {
+                    this->userStore->dropCache();
+                }
+            }
+            else if (table == 'T')
+            {
+                const Trip *trip = this->tripTable->getRecordForId(recordId);
+                this->unindexTrip(trip);
+                this->invalidateAvailability(*trip);
+                this->tripTable->markDeleted(recordId, true);
+            }
+            this->compactIfDue();
+        }
+        else if (table == 'V')
+        {
+            unique_ptr<Vehicle> vehicle(this->parseVehicle(record));
+            try
+            {
+                this->availabilityCache->invalidate(this->vehicleTable->getRecordForId(vehicle->getRecord())->getVehicleType());
+            }
+            catch (RecordNotFoundError error)
+            {
+            }
+            // the table owns the record once it is applied
+            Vehicle *applied = this->vehicleTable->applyRecord(vehicle.get());
+            vehicle.release();
+            this->onRecordAdded(applied);
+        }
+        else if (table == 'U')
+        {
+            unique_ptr<User> user(this->parseUser(record));
+            User *applied = this->userTable->applyRecord(user.get());
+            user.release();
+            this->onRecordAdded(applied);
+            // the primary changed users.db under the cached pages
+            if (this->userStore)
+            {
+                this->userStore->dropCache();
+            }
+        }
+        else if (table == 'T')
+        {
+            unique_ptr<Trip> trip(this->parseTrip(record));
+            const Trip *existing = nullptr;
+            try
+            {
+                existing = this->tripTable->getRecordForId(trip->getRecord());
+            }
+            catch (RecordNotFoundError error)
+            {
+            }
+            if (existing)
+            {
+                this->unindexTrip(existing);
+                this->invalidateAvailability(*existing);
+            }
+            Trip *applied;
+            try
+            {
+                applied = this->tripTable->applyRecord(trip.get());
+            }
+            catch (...)
+            {
+                // the trip is unchanged, so it goes back into the indexes
+                if (existing)
+                {
+                    this->indexTrip(existing);
+                }
+                throw;
+            }
+            trip.release();
+            this->onRecordAdded(applied);
+        }
+    }
+    catch (Error error)
+    {
+        // the record, its vehicle or its user is not known, or a date is malformed
+        return 0;
+    }
+    catch (logic_error &error)
+    {
+        // a number that does not parse
+        return 0;
+    }
+    return sequence;
+}
+
+//Assigns vehicles to a batch of booking requests so that as many as possible
+//are satisfied, then books all of them at once. Every vehicle's free time is
+//cut into gaps between its uncompleted trips. Requests are served in order
+//of their end day, each taking the gap of its type that starts latest while
+//still holding the whole request (best fit), which is the greedy that is
+//optimal for interval scheduling on several machines. That holds while the
+//gaps run on to the end of time; when a later trip closes a gap best fit
+//can leave out a request that another assignment would have served. A gap
+//that ends before the request being served can never hold a later one and
+//is dropped, so every gap is looked at a bounded number of times.
+//Days are inclusive: a vehicle serves one booking per day.
+//The trips are added with one write under contiguous ids, or not at all.
+vector<BookingResult> Database ::bookBatch(const vector<BookingRequest> &requests) throw(IOError)
+{
+    TRACE_SPAN("Database::bookBatch");
+    RecordedCall call(callBookBatch);
+    for (size_t i = 0; call.isRecording() && i < requests.size(); i++)
+    {
+        call.number(requests[i].userId);
+        call.text(requests[i].startDate.toString());
+        call.text(requests[i].endDate.toString());
+        call.number(requests[i].type);
+    }
+    if (this->readOnly)
+    {
+        throw ReadOnlyError();
+    }
+    this->applyFileChanges();
+    this->compactIfDue();
+    struct Gap
+    {
+        long end;
+        const Vehicle *vehicle;
+    };
+    vector<BookingResult> results(requests.size(), BookingResult{nullptr, 0});
+    vector<const User *> users(requests.size(), nullptr);
+    vector<size_t> order;
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        const BookingRequest &request = requests[i];
+        try
+        {
+            users[i] = this->getUserForId(request.userId);
+        }
+        catch (RecordNotFoundError error)
+        {
+            continue;
+        }
+        if (request.startDate.isEmpty() || request.endDate.isEmpty() ||
+            request.endDate.getDayNumber() < request.startDate.getDayNumber())
+        {
+            continue;
+        }
+        order.push_back(i);
+    }
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        long endA = requests[a].endDate.getDayNumber(), endB = requests[b].endDate.getDayNumber();
+        if (endA != endB)
+        {
+            return endA < endB;
+        }
+        return requests[a].startDate.getDayNumber() > requests[b].startDate.getDayNumber();
+    });
+
+    // free gaps of every vehicle type keyed by the day they start
+    map<int, multimap<long, Gap>> gaps;
+    for (auto vehicle : this->vehicleTable->records)
+    {
+        if (vehicle->isDeleted())
+        {
+            continue;
+        }
+        vector<pair<long, long>> busy;
+        for (auto trip : this->getTripsForVehicle(vehicle->getRecord()))
+        {
+            if (trip->isCompleted())
+            {
+                continue;
+            }
+            AvailabilityKey range = AvailabilityCache::makeKey(trip->getStartDate(), trip->getEndDate(), vehicle->getVehicleType());
+            busy.push_back(make_pair(range.startDay, range.endDay));
+        }
+        sort(busy.begin(), busy.end());
+        auto &typeGaps = gaps[vehicle->getVehicleType()];
+        long freeFrom = LONG_MIN;
+        for (auto &interval : busy)
+        {
+            if (interval.first > freeFrom)
+            {
+                typeGaps.insert(make_pair(freeFrom, Gap{interval.first - 1, vehicle}));
+            }
+            if (interval.second == LONG_MAX)
+            {
+                freeFrom = LONG_MAX;
+                break;
+            }
+            freeFrom = max(freeFrom, interval.second + 1);
+        }
+        if (freeFrom != LONG_MAX)
+        {
+            typeGaps.insert(make_pair(freeFrom, Gap{LONG_MAX, vehicle}));
+        }
+    }
+
+    vector<Trip *> trips;
+    vector<size_t> booked;
+    for (auto i : order)
+    {
+        const BookingRequest &request = requests[i];
+        long start = request.startDate.getDayNumber(), end = request.endDate.getDayNumber();
+        auto &typeGaps = gaps[request.type];
+        auto candidate = typeGaps.upper_bound(start);
+        while (candidate != typeGaps.begin())
+        {
+            candidate--;
+            if (candidate->second.end >= end)
+            {
+                break;
+            }
+            candidate = typeGaps.erase(candidate);
+        }
+        if (candidate == typeGaps.end() || candidate->first > start || candidate->second.end < end)
+        {
+            continue;
+        }
+        Gap gap = candidate->second;
+        typeGaps.erase(candidate);
+        if (gap.end > end)
+        {
+            typeGaps.insert(make_pair(end + 1, Gap{gap.end, gap.vehicle}));
+        }
+        trips.push_back(new Trip(gap.vehicle, users[i], request.startDate, request.endDate));
+        booked.push_back(i);
+        results[i].vehicle = gap.vehicle;
+    }
+
+    // trips are appended in the order of the requests
+    vector<size_t> byRequest(trips.size());
+    iota(byRequest.begin(), byRequest.end(), 0);
+    sort(byRequest.begin(), byRequest.end(), [&](size_t a, size_t b) { return booked[a] < booked[b]; });
+    vector<Trip *> ordered;
+    for (auto index : byRequest)
+    {
+        ordered.push_back(trips[index]);
+    }
+    try
+    {
+        this->tripTable->appendRecords(ordered);
+    }
+    catch (IOError error)
+    {
+        for (auto trip : ordered)
+        {
+            delete trip;
+        }
+        throw;
+    }
+    for (auto index : byRequest)
+    {
+        results[booked[index]].tripId = trips[index]->getRecord();
+        this->onRecordAdded(trips[index]);
+        this->logMutation('A', trips[index]);
+    }
+    return results;
+}
+
+//    Random batches the self check books, each small enough to be checked
+//    against every possible assignment
+const int SELFCHECKBATCHES = 300;
+
+//Books random small batches on scratch files at location and compares the
+//number bookBatch satisfies with the best any assignment can do, found by
+//trying them all. Every other batch has vehicles booked by an earlier batch
+//first, so that their free time is cut into gaps that end. Best fit is only
+//known to be optimal without those, there it may fall short and the check
+//only asks for bookings that do not clash. Prints a line of each kind to out.
+bool Database ::selfCheck(string location, ostream &out) throw(IOError, MemoryError)
+{
+    string prefix = location + "selfcheck.";
+    // removes the files of the last batch, leaving them empty for the next
+    auto clear = [&](bool reopen) {
+        for (string name : {"vehicle.txt", "users.txt", "trips.txt"})
+        {
+            for (string suffix : {"", ".seq", ".tmp"})
+            {
+                ::remove((prefix + name + suffix).c_str());
+            }
+            if (reopen && !ofstream(prefix + name))
+            {
+                throw IOError();
+            }
+        }
+    };
+    // the same batches on every run, so a failure can be looked into
+    mt19937 random(1);
+    auto pick = [&](int low, int high) { return uniform_int_distribution<int>(low, high)(random); };
+    long firstDay = Date().getDayNumber() + 30;
+    // counted apart for the batches on free vehicles and the ones after earlier bookings
+    int fewer[2] = {0, 0}, wrong[2] = {0, 0};
+    for (int batch = 0; batch < SELFCHECKBATCHES; batch++)
+    {
+        int bookedBefore = batch % 2;
+        clear(true);
+        Database database(prefix);
+        User user("Self Check", "9000000000", "check@example.com");
+        database.addNewRecord(&user);
+        vector<Vehicle> vehicles;
+        for (int i = pick(1, 3); i > 0; i--)
+        {
+            vehicles.push_back(Vehicle("SC" + to_string(i), VehicleType(pick(bike, car)), 2, "Check", 1,
+                                       Date::fromDayNumber(firstDay + 1000)));
+            database.addNewRecord(&vehicles.back());
+        }
+        auto request = [&]() {
+            long start = firstDay + pick(0, 9);
+            return BookingRequest{user.getRecord(), Date::fromDayNumber(start),
+                                  Date::fromDayNumber(start + pick(0, 3)), VehicleType(pick(bike, car))};
+        };
+        vector<BookingRequest> earlier(bookedBefore ? pick(1, 3) : 0), requests(pick(1, 7));
+        generate(earlier.begin(), earlier.end(), request);
+        generate(requests.begin(), requests.end(), request);
+        database.bookBatch(earlier);
+
+        // days each vehicle is taken, by the earlier batch and then by the search
+        vector<vector<pair<long, long>>> busy;
+        for (auto &vehicle : vehicles)
+        {
+            busy.push_back({});
+            for (auto trip : database.getTripsForVehicle(vehicle.getRecord()))
+            {
+                busy.back().push_back(make_pair(trip->getStartDate().getDayNumber(), trip->getEndDate().getDayNumber()));
+            }
+        }
+        function<int(size_t)> best = [&](size_t next) {
+            if (next == requests.size())
+            {
+                return 0;
+            }
+            int most = best(next + 1);
+            long start = requests[next].startDate.getDayNumber(), end = requests[next].endDate.getDayNumber();
+            for (size_t i = 0; i < vehicles.size(); i++)
+            {
+                bool free = vehicles[i].getVehicleType() == requests[next].type;
+                for (auto &range : busy[i])
+                {
+                    free = free && (range.second < start || range.first > end);
+                }
+                if (free)
+                {
+                    busy[i].push_back(make_pair(start, end));
+                    most = max(most, 1 + best(next + 1));
+                    busy[i].pop_back();
+                }
+            }
+            return most;
+        };
+        int expected = best(0), booked = 0;
+        bool clashes = false;
+        vector<BookingResult> results = database.bookBatch(requests);
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            booked += results[i].vehicle != nullptr;
+            clashes = clashes || (results[i].vehicle && results[i].vehicle->getVehicleType() != requests[i].type);
+        }
+        for (auto &vehicle : vehicles)
+        {
+            auto trips = database.getTripsForVehicle(vehicle.getRecord());
+            sort(trips.begin(), trips.end(), [](const Trip *a, const Trip *b) {
+                return a->getStartDate().getDayNumber() < b->getStartDate().getDayNumber();
+            });
+            for (size_t i = 1; i < trips.size(); i++)
+            {
+                clashes = clashes || trips[i]->getStartDate().getDayNumber() <= trips[i - 1]->getEndDate().getDayNumber();
+            }
+        }
+        fewer[bookedBefore] += booked < expected;
+        wrong[bookedBefore] += clashes || booked > expected;
+    }
+    clear(false);
+    bool passed = !fewer[0] && !wrong[0] && !wrong[1];
+    out << (fewer[0] || wrong[0] ? "FAILED  " : "ok      ") << "book-batch on free vehicles against every assignment, "
+        << (SELFCHECKBATCHES + 1) / 2 << " batches, " << fewer[0] << " booked fewer, " << wrong[0] << " clashed\n";
+    out << (wrong[1] ? "FAILED  " : "ok      ") << "book-batch after earlier bookings against every assignment, "
+        << SELFCHECKBATCHES / 2 << " batches, " << fewer[1] << " booked fewer, " << wrong[1] << " clashed\n";
+    return passed;
+}
+
+//Makes one recorded call again. Throws what the call throws, or one of the
+//standard exceptions of the number conversions for a damaged trace.
+void Database ::replayCall(const WorkloadCall &call)
+{
+    const vector<string> &arguments = call.arguments;
+    auto date = [](const string &text) { return text.empty() ? Date() : Date(text); };
+    switch (call.operation)
+    {
+    case callGetVehicle:
+        this->getVehicle(arguments.at(0));
+        break;
+    case callFindVehicles:
+        this->getVehicle(date(arguments.at(0)), date(arguments.at(1)), VehicleType(stoi(arguments.at(2))));
+        break;
+    case callGetUser:
+        this->getUser(arguments.at(0));
+        break;
+    case callGetUserForId:
+        this->getUserForId(stol(arguments.at(0)));
+        break;
+    case callTripsForUser:
+        this->getTripsForUser(stol(arguments.at(0)));
+        break;
+    case callTripsForVehicle:
+        this->getTripsForVehicle(stol(arguments.at(0)));
+        break;
+    case callSearchVehicles:
+        this->searchVehicles(arguments.at(0), stoul(arguments.at(1)));
+        break;
+    case callSearchUsers:
+        this->searchUsers(arguments.at(0), stoul(arguments.at(1)));
+        break;
+    case callTripsStarting:
+        this->getTripsStarting(date(arguments.at(0)), date(arguments.at(1)));
+        break;
+    case callTripsEnding:
+        this->getTripsEnding(date(arguments.at(0)), date(arguments.at(1)));
+        break;
+    case callTripsActiveOn:
+        this->getTripsActiveOn(date(arguments.at(0)));
+        break;
+    case callUpdateWhere:
+        this->updateWhere(arguments.at(0), stoul(arguments.at(1)));
+        break;
+    case callAdd:
+    case callUpdate:
+    {
+        // the table and the record as it is stored in its file
+        char table = arguments.at(0).at(0);
+        bool add = call.operation == callAdd;
+        if (table == 'V')
+        {
+            unique_ptr<Vehicle> vehicle(this->parseVehicle(arguments.at(1)));
+            add ? this->addNewRecord(vehicle.get()) : this->updateRecord(vehicle.get());
+        }
+        else if (table == 'U')
+        {
+            unique_ptr<User> user(this->parseUser(arguments.at(1)));
+            add ? this->addNewRecord(user.get()) : this->updateRecord(user.get());
+        }
+        else
+        {
+            unique_ptr<Trip> trip(this->parseTrip(arguments.at(1)));
+            add ? this->addNewRecord(trip.get()) : this->updateRecord(trip.get());
+        }
+        break;
+    }
+    case callDelete:
+    {
+        char table = arguments.at(0).at(0);
+        long recordId = stol(arguments.at(1));
+        if (table == 'V')
+        {
+            Vehicle vehicle = *this->vehicleTable->getRecordForId(recordId);
+            this->deleteRecord(&vehicle);
+        }
+        else if (table == 'U')
+        {
+            User user = *this->getUserForId(recordId);
+            this->deleteRecord(&user);
+        }
+        else
+        {
+            Trip trip = *this->tripTable->getRecordForId(recordId);
+            this->deleteRecord(&trip);
+        }
+        break;
+    }
+    case callBookBatch:
+    {
+        // user, start, end and type of every request
+        vector<BookingRequest> requests;
+        for (size_t at = 0; at + 3 < arguments.size(); at += 4)
+        {
+            requests.push_back(BookingRequest{stol(arguments[at]), date(arguments[at + 1]), date(arguments[at + 2]),
+                                              VehicleType(stoi(arguments[at + 3]))});
+        }
+        this->bookBatch(requests);
+        break;
+    }
+    default:
+        throw IOError();
+    }
+}
+
+//Replays recorded calls against this database, which is meant to be opened
+//on a copy of the data files the trace was recorded on. With speed 0 the
+//calls run as fast as possible, otherwise each starts at its recorded time
+//divided by speed and its latency counts from then, so falling behind shows
+//in the numbers. Threads take the calls in the order they started; reads
+//run side by side, changes one at a time.
+ReplayReport Database ::replayWorkload(const vector<WorkloadCall> &calls, double speed, unsigned threads)
+{
+    TRACE_SPAN("Database::replayWorkload");
+    ReplayReport report;
+    report.calls = calls.size();
+    for (auto &call : calls)
+    {
+        report.recorded.add(call.latency);
+    }
+    threads = max(threads, 1u);
+    shared_timed_mutex changes;
+    atomic<size_t> next(0);
+    atomic<long long> failures(0);
+    vector<LatencyHistogram> latencies(threads);
+    long long begin = Tracer::now();
+    auto replay = [&](unsigned worker) {
+        for (size_t i; (i = next++) < calls.size();)
+        {
+            const WorkloadCall &call = calls[i];
+            long long start = Tracer::now();
+            if (speed > 0)
+            {
+                long long due = begin + (long long)(call.start / speed);
+                // sleeping overshoots, the last stretch is waited out
+                if (due - start > 200000)
+                {
+                    this_thread::sleep_for(chrono::nanoseconds(due - start - 200000));
+                }
+                while (Tracer::now() < due)
+                {
+                    this_thread::yield();
+                }
+                start = due;
+            }
+            // paged users are loaded into the table on a lookup
+            bool change = call.operation == callAdd || call.operation == callUpdate ||
+                          call.operation == callDelete || call.operation == callBookBatch ||
+                          call.operation == callUpdateWhere ||
+                          (this->userStore && (call.operation == callGetUser || call.operation == callGetUserForId));
+            try
+            {
+                if (change)
+                {
+                    unique_lock<shared_timed_mutex> guard(changes);
+                    this->replayCall(call);
+                }
+                else
+                {
+                    shared_lock<shared_timed_mutex> guard(changes);
+                    this->replayCall(call);
+                }
+            }
+            catch (...)
+            {
+                failures++;
+            }
+            latencies[worker].add(Tracer::now() - start);
+        }
+    };
+    vector<thread> workers;
+    for (unsigned worker = 1; worker < threads; worker++)
+    {
+        workers.push_back(thread(replay, worker));
+    }
+    replay(0);
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    report.seconds = (Tracer::now() - begin) / 1e9;
+    report.failures = failures;
+    for (auto &latency : latencies)
+    {
+        report.replayed.merge(latency);
+    }
+    return report;
+}
+
+//Streams every trip, the archived history first and then the live table,
+//through the exporter
+void Database ::exportTrips(TripExporter &exporter) const throw(IOError)
+{
+    TRACE_SPAN("Database::exportTrips");
+    RecordedCall unrecorded(callUnrecorded);
+    exporter.writeHeader();
+    this->tripArchive->forEach([&](const ArchivedTrip &trip) {
+        const Vehicle *vehicle = nullptr;
+        const User *user = nullptr;
+        try
+        {
+            vehicle = this->vehicleTable->getRecordForId(trip.vehicleId);
+        }
+        catch (RecordNotFoundError error)
+        {
+        }
+        try
+        {
+            user = this->getUserForId(trip.userId);
+        }
+        catch (RecordNotFoundError error)
+        {
+        }
+        exporter.write(trip, vehicle, user);
+    });
+    this->trips().forEach([&](const Trip &trip) {
+        exporter.write(trip);
+    });
+    exporter.finish();
+}
+
+//Returns a future that is ready once every change made so far is on disk.
+//It is ready right away when the tables are written synchronously.
+shared_future<void> Database ::flush()
+{
+    TRACE_SPAN("Database::flush");
+    if (!this->persister)
+    {
+        promise<void> done;
+        done.set_value();
+        return done.get_future().share();
+    }
+    return this->persister->flush();
+}
+
+//Calls done once every change made so far is on disk, on the persistence
+//thread, or right away when the tables are written synchronously
+void Database ::flush(function<void(exception_ptr)> done)
+{
+    if (!this->persister)
+    {
+        done(nullptr);
+        return;
+    }
+    this->persister->flush(done);
+}
+
+const Table<Vehicle> *const Database ::getVehicleRef() const
+{
+    return this->vehicleTable;
+}
+
+const Table<User> *const Database ::getUserRef() const
+{
+    return this->userTable;
+}
+
+const Table<Trip> *const Database ::getTripRef() const
+{
+    return this->tripTable;
+}
+
+TelemetryIngest &Database ::getTelemetry() const
+{
+    call_once(this->telemetryStarted, [this] { this->telemetry = new TelemetryIngest(); });
+    return *this->telemetry;
+}
+
+template <class T>
+void Database ::addNewRecord(T *record) throw(IOError, MemoryError)
+{
+    TRACE_SPAN("Database::addNewRecord");
+    RecordedCall call(callAdd);
+    if (call.isRecording())
+    {
+        call.text(string(1, logTableName(record)));
+        call.text(record->toString());
+    }
+    if (this->readOnly)
+    {
+        throw ReadOnlyError();
+    }
+    this->applyFileChanges();
+    this->compactIfDue();
+    try
+    {
+        Vehicle *v = dynamic_cast<Vehicle *>(record);
+        if (v)
+        {
+            auto savedRecord = this->vehicleTable->addNewRecord(*v);
+            record->recordId = savedRecord->recordId;
+            this->onRecordAdded(savedRecord);
+            this->logMutation('A', savedRecord);
+            return;
+        }
+
+        User *u = dynamic_cast<User *>(record);
+        if (u)
+        {
+            auto savedRecord = this->userTable->addNewRecord(*u);
+            record->recordId = savedRecord->recordId;
+            this->onRecordAdded(savedRecord);
+            this->logMutation('A', savedRecord);
+            return;
+        }
+        Trip *t = dynamic_cast<Trip *>(record);
+        if (t)
+        {
+            auto savedRecord = this->tripTable->addNewRecord(*t);
+            record->recordId = savedRecord->recordId;
+            this->onRecordAdded(savedRecord);
+            this->logMutation('A', savedRecord);
+            return;
+        }
+    }
+    catch (...)
+    {
+        throw;
+    }
+}
+
+template <class T>
+void Database ::updateRecord(T *record) throw(IOError, RecordNotFoundError)
+{
+    TRACE_SPAN("Database::updateRecord");
+    RecordedCall call(callUpdate);
+    if (call.isRecording())
+    {
+        call.text(string(1, logTableName(record)));
+        call.text(record->toString());
+    }
+    if (this->readOnly)
+    {
+        throw ReadOnlyError();
+    }
+    this->applyFileChanges();
+    this->compactIfDue();
+    try
+    {
+        Vehicle *v = dynamic_cast<Vehicle *>(record);
+        if (v)
+        {
+            VehicleType oldType = this->vehicleTable->getRecordForId(v->getRecord())->getVehicleType();
+            this->vehicleTable->updateRecord(*v);
+            this->registrationSearch->index(v->getRecord(), v->getRegistrationNumber());
+            // cached results hold the vehicle itself, only a new type moves it
+            if (oldType != v->getVehicleType())
+            {
+                this->availabilityCache->invalidate(oldType);
+                this->availabilityCache->invalidate(v->getVehicleType());
+            }
+            this->logMutation('U', v);
+            return;
+        }
+
+        User *u = dynamic_cast<User *>(record);
+        if (u)
+        {
+            // in paged mode the user may have to be read in again first
+            this->getUserForId(u->getRecord());
+            this->userTable->updateRecord(*u);
+            this->onRecordAdded(u);
+            this->logMutation('U', u);
+            return;
+        }
+
+        Trip *t = dynamic_cast<Trip *>(record);
+        if (t)
+        {
+            // the start date may change, so the trip is placed again
+            const Trip *saved = this->tripTable->getRecordForId(t->getRecord());
+            Trip before = *saved;
+            this->unindexTrip(saved);
+            try
+            {
+                this->tripTable->updateRecord(*t);
+            }
+            catch (...)
+            {
+                this->indexTrip(saved);
+                throw;
+            }
+            this->indexTrip(saved);
+            // only completing a trip or moving it changes availability
+            if (before.isCompleted() != saved->isCompleted() ||
+                before.getStartDate().toString() != saved->getStartDate().toString() ||
+                before.getEndDate().toString() != saved->getEndDate().toString() ||
+                &before.getVehicle() != &saved->getVehicle())
+            {
+                this->invalidateAvailability(before);
+                this->invalidateAvailability(*saved);
+            }
+            this->logMutation('U', saved);
+            return;
+        }
+    }
+    catch (...)
+    {
+        throw;
+    }
+}
+
+//Applies the changes of a set-based update: the records are changed in one
+//pass and written with one persist, the indexes only for what changed
+template <class T>
+void Database ::updateRecords(vector<T> &records) throw(IOError, RecordNotFoundError)
+{
+    TRACE_SPAN("Database::updateRecords");
+    if (this->readOnly)
+    {
+        throw ReadOnlyError();
+    }
+    this->applyFileChanges();
+    this->compactIfDue();
+    if (!records.empty())
+    {
+        this->applyUpdates(records);
+    }
+}
+
+void Database ::applyUpdates(vector<Vehicle> &vehicles) throw(IOError, RecordNotFoundError)
+{
+    vector<VehicleType> oldTypes;
+    for (auto &vehicle : vehicles)
+    {
+        oldTypes.push_back(this->vehicleTable->getRecordForId(vehicle.getRecord())->getVehicleType());
+    }
+    this->vehicleTable->updateRecords(vehicles);
+    for (size_t i = 0; i < vehicles.size(); i++)
+    {
+        const Vehicle *saved = this->vehicleTable->getRecordForId(vehicles[i].getRecord());
+        this->registrationSearch->index(saved->getRecord(), saved->getRegistrationNumber());
+        if (oldTypes[i] != saved->getVehicleType())
+        {
+            this->availabilityCache->invalidate(oldTypes[i]);
+            this->availabilityCache->invalidate(saved->getVehicleType());
+        }
+        this->logMutation('U', saved);
+    }
+}
+
+void Database ::applyUpdates(vector<User> &users) throw(IOError, RecordNotFoundError)
+{
+    this->userTable->updateRecords(users);
+    for (auto &user : users)
+    {
+        this->nameSearch->index(user.getRecord(), user.getName());
+        this->emailSearch->index(user.getRecord(), user.getEmail());
+        if (this->userStore)
+        {
+            string record;
+            RecordCodec<User>::encode(user, record);
+            this->userStore->put(user.getRecord(), user.getContact(), record);
+        }
+        this->logMutation('U', &user);
+    }
+    if (this->userStore)
+    {
+        this->persistUsers();
+    }
+}
+
+void Database ::applyUpdates(vector<Trip> &trips) throw(IOError, RecordNotFoundError)
+{
+    vector<const Trip *> saved;
+    vector<Trip> before;
+    for (auto &trip : trips)
+    {
+        saved.push_back(this->tripTable->getRecordForId(trip.getRecord()));
+        before.push_back(*saved.back());
+    }
+    for (auto trip : saved)
+    {
+        this->unindexTrip(trip);
+    }
+    try
+    {
+        this->tripTable->updateRecords(trips);
+    }
+    catch (...)
+    {
+        for (auto trip : saved)
+        {
+            this->indexTrip(trip);
+        }
+        throw;
+    }
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+        this->indexTrip(saved[i]);
+        this->invalidateAvailability(before[i]);
+        this->invalidateAvailability(*saved[i]);
+        this->logMutation('U', saved[i]);
+    }
+}
+
+//Deletes a record, which the tables keep as a tombstone until they are
+//compacted. Vehicles and users that still have trips cannot be deleted.
+template <class T>
+void Database ::deleteRecord(T *record) throw(IOError, RecordNotFoundError, RecordInUseError)
+{
+    TRACE_SPAN("Database::deleteRecord");
+    RecordedCall call(callDelete);
+    call.text(string(1, logTableName(record)));
+    call.number(record->getRecord());
+    if (this->readOnly)
+    {
+        throw ReadOnlyError();
+    }
+    this->applyFileChanges();
+    this->compactIfDue();
+
+    Vehicle *v = dynamic_cast<Vehicle *>(record);
+    if (v)
+    {
+        const Vehicle *saved = this->vehicleTable->getRecordForId(v->getRecord());
+        if (!this->getTripsForVehicle(saved->getRecord()).empty())
+        {
+            throw RecordInUseError();
+        }
+        this->vehicleTable->deleteRecord(saved->getRecord());
+        this->availabilityCache->invalidate(saved->getVehicleType());
+        this->registrationSearch->remove(saved->getRecord());
+        this->logMutation('D', saved);
+    }
+
+    User *u = dynamic_cast<User *>(record);
+    if (u)
+    {
+        const User *saved = this->getUserForId(u->getRecord());
+        if (!this->getTripsForUser(saved->getRecord()).empty())
+        {
+            throw RecordInUseError();
+        }
+        this->userTable->deleteRecord(saved->getRecord());
+        this->nameSearch->remove(saved->getRecord());
+        this->emailSearch->remove(saved->getRecord());
+        if (this->userStore)
+        {
+            this->userStore->remove(saved->getRecord());
+            this->persistUsers();
+        }
+        this->logMutation('D', saved);
+    }
+
+    Trip *t = dynamic_cast<Trip *>(record);
+    if (t)
+    {
+        const Trip *saved = this->tripTable->getRecordForId(t->getRecord());
+        this->unindexTrip(saved);
+        try
+        {
+            this->tripTable->deleteRecord(saved->getRecord());
+        }
+        catch (...)
+        {
+            this->indexTrip(saved);
+            throw;
+        }
+        this->invalidateAvailability(*saved);
+        this->logMutation('D', saved);
+    }
+    this->compactIfDue();
+}
+
+AsyncDatabase ::AsyncDatabase(Database *database)
+{
+    this->database = database;
+    this->unanswered = 0;
+}
+
+//Waits until every call made so far is answered, then stops the loop.
+//It must not be destroyed from one of its own answers.
+AsyncDatabase ::~AsyncDatabase()
+{
+    unique_lock<mutex> guard(this->lock);
+    this->answered.wait(guard, [this] { return this->unanswered == 0; });
+}
+
+void AsyncDatabase ::accept()
+{
+    lock_guard<mutex> guard(this->lock);
+    this->unanswered++;
+}
+
+void AsyncDatabase ::finish(long calls)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->unanswered -= calls;
+    if (this->unanswered == 0)
+    {
+        this->answered.notify_all();
+    }
+}
+
+void AsyncDatabase ::getVehicleAsync(string registrationNo, function<void(const Vehicle *, exception_ptr)> done)
+{
+    this->accept();
+    this->loop.post([this, registrationNo, done] {
+        const Vehicle *vehicle = nullptr;
+        exception_ptr error;
+        try
+        {
+            vehicle = this->database->getVehicle(registrationNo);
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+        done(vehicle, error);
+        this->finish(1);
+    });
+}
+
+void AsyncDatabase ::getUserAsync(string contactNo, function<void(const User *, exception_ptr)> done)
+{
+    this->accept();
+    this->loop.post([this, contactNo, done] {
+        const User *user = nullptr;
+        exception_ptr error;
+        try
+        {
+            user = this->database->getUser(contactNo);
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+        done(user, error);
+        this->finish(1);
+    });
+}
+
+//Answers with the record id the record was saved under
+template <class T>
+void AsyncDatabase ::addNewRecordAsync(T record, function<void(long, exception_ptr)> done)
+{
+    this->accept();
+    this->loop.post([this, record, done]() mutable {
+        try
+        {
+            this->database->addNewRecord(&record);
+        }
+        catch (...)
+        {
+            done(0, current_exception());
+            this->finish(1);
+            return;
+        }
+        long recordId = record.getRecord();
+        this->whenWritten([this, recordId, done](exception_ptr error) {
+            done(recordId, error);
+            this->finish(1);
+        });
+    });
+}
+
+//The first booking of a turn schedules the batch, so it runs after every
+//task that was already queued and takes their bookings along
+void AsyncDatabase ::bookAsync(BookingRequest request, function<void(const BookingResult &, exception_ptr)> done)
+{
+    this->accept();
+    this->loop.post([this, request, done] {
+        this->bookings.push_back(Booking{request, done});
+        if (this->bookings.size() == 1)
+        {
+            this->loop.post([this] { this->bookPending(); });
+        }
+    });
+}
+
+void AsyncDatabase ::bookPending()
+{
+    vector<Booking> pending;
+    pending.swap(this->bookings);
+    vector<BookingRequest> requests;
+    for (auto &booking : pending)
+    {
+        requests.push_back(booking.request);
+    }
+    vector<BookingResult> results;
+    try
+    {
+        results = this->database->bookBatch(requests);
+    }
+    catch (...)
+    {
+        exception_ptr error = current_exception();
+        for (auto &booking : pending)
+        {
+            booking.done(BookingResult{nullptr, 0}, error);
+        }
+        this->finish(pending.size());
+        return;
+    }
+    this->whenWritten([this, pending, results](exception_ptr error) {
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            pending[i].done(results[i], error);
+        }
+        this->finish(pending.size());
+    });
+}
+
+//Calls done on the loop once the changes made so far are on disk. Every
+//write of a turn waits for the same flush.
+void AsyncDatabase ::whenWritten(function<void(exception_ptr)> done)
+{
+    this->waitingForDisk.push_back(done);
+    if (this->waitingForDisk.size() == 1)
+    {
+        this->loop.post([this] { this->flushWaiting(); });
+    }
+}
+
+void AsyncDatabase ::flushWaiting()
+{
+    vector<function<void(exception_ptr)>> waiting;
+    waiting.swap(this->waitingForDisk);
+    this->database->flush([this, waiting](exception_ptr error) {
+        this->loop.post([waiting, error] {
+            for (auto &done : waiting)
+            {
+                done(error);
+            }
+        });
+    });
+}
+
+string TextIndex ::normalize(const string &text)
+{
+    string key = text;
+    transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return tolower(c); });
+    return key;
+}
+
+//The distinct trigrams of a key, three bytes packed into a number
+vector<uint32_t> TextIndex ::trigramsOf(const string &key)
+{
+    vector<uint32_t> grams;
+    for (size_t i = 0; i + 3 <= key.length(); i++)
+    {
+        grams.push_back((uint32_t)(unsigned char)key[i] << 16 | (uint32_t)(unsigned char)key[i + 1] << 8 |
+                        (unsigned char)key[i + 2]);
+    }
+    sort(grams.begin(), grams.end());
+    grams.erase(unique(grams.begin(), grams.end()), grams.end());
+    return grams;
+}
+
+//Indexes the text of a record, replacing what it was indexed under before
+void TextIndex ::index(long recordId, const string &text)
+{
+    string key = normalize(text);
+    auto known = this->keys.find(recordId);
+    if (known != this->keys.end())
+    {
+        if (known->second == key)
+        {
+            return;
+        }
+        this->remove(recordId);
+    }
+    this->keys[recordId] = key;
+    this->prefixes.insert(make_pair(key, recordId));
+    // ids mostly grow, so a record usually lands at the end of its lists
+    for (auto gram : trigramsOf(key))
+    {
+        vector<long> &list = this->trigrams[gram];
+        list.insert(upper_bound(list.begin(), list.end(), recordId), recordId);
+    }
+}
+
+void TextIndex ::remove(long recordId)
+{
+    auto known = this->keys.find(recordId);
+    if (known == this->keys.end())
+    {
+        return;
+    }
+    this->prefixes.erase(make_pair(known->second, recordId));
+    for (auto gram : trigramsOf(known->second))
+    {
+        vector<long> &list = this->trigrams[gram];
+        list.erase(lower_bound(list.begin(), list.end(), recordId));
+        if (list.empty())
+        {
+            this->trigrams.erase(gram);
+        }
+    }
+    this->keys.erase(known);
+}
+
+//Best matches first: the exact key, keys starting with the text, then keys
+//with the text at the start of a word and anywhere else, shorter keys first
+//within each. Texts under three characters have no trigrams and only match
+//prefixes and the start of words, found by going through the keys.
+vector<SearchHit> TextIndex ::search(const string &text, size_t limit) const
+{
+    TRACE_SPAN("TextIndex::search");
+    string query = normalize(text);
+    vector<SearchHit> hits;
+    if (query.empty() || !limit)
+    {
+        return hits;
+    }
+
+    struct Candidate
+    {
+        int rank;
+        size_t length;
+        long recordId;
+        bool operator<(const Candidate &other) const
+        {
+            return make_tuple(rank, length, recordId) < make_tuple(other.rank, other.length, other.recordId);
+        }
+    };
+    // the ordered keys give the prefix matches, but in key order
+    vector<Candidate> prefixed;
+    for (auto key = this->prefixes.lower_bound(make_pair(query, LONG_MIN));
+         key != this->prefixes.end() && key->first.compare(0, query.length(), query) == 0; key++)
+    {
+        prefixed.push_back(Candidate{key->first == query ? 0 : 1, key->first.length(), key->second});
+    }
+    size_t taken = min(limit, prefixed.size());
+    partial_sort(prefixed.begin(), prefixed.begin() + taken, prefixed.end());
+    for (size_t i = 0; i < taken; i++)
+    {
+        hits.push_back(SearchHit{prefixed[i].recordId, prefixed[i].rank});
+    }
+    if (hits.size() == limit)
+    {
+        return hits;
+    }
+
+    vector<Candidate> inside;
+    auto consider = [&](long recordId, const string &key) {
+        size_t at = key.find(query, 1);
+        if (at == string::npos)
+        {
+            return;
+        }
+        // a prefix match was already taken from the ordered keys
+        if (key.compare(0, query.length(), query) == 0)
+        {
+            return;
+        }
+        bool wordStart = false;
+        for (; at != string::npos && !wordStart; at = key.find(query, at + 1))
+        {
+            wordStart = !isalnum((unsigned char)key[at - 1]);
+        }
+        if (query.length() >= 3 || wordStart)
+        {
+            inside.push_back(Candidate{wordStart ? 2 : 3, key.length(), recordId});
+        }
+    };
+
+    vector<uint32_t> grams = trigramsOf(query);
+    if (grams.empty())
+    {
+        for (auto &key : this->keys)
+        {
+            consider(key.first, key.second);
+        }
+    }
+    else
+    {
+        // intersect the lists starting with the shortest one
+        vector<const vector<long> *> lists;
+        for (auto gram : grams)
+        {
+            auto list = this->trigrams.find(gram);
+            if (list == this->trigrams.end())
+            {
+                return hits;
+            }
+            lists.push_back(&list->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<long> *a, const vector<long> *b) { return a->size() < b->size(); });
+        vector<long> candidates = *lists[0], narrowed;
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); i++)
+        {
+            narrowed.clear();
+            set_intersection(candidates.begin(), candidates.end(), lists[i]->begin(), lists[i]->end(),
+                             back_inserter(narrowed));
+            candidates.swap(narrowed);
+        }
+        for (auto recordId : candidates)
+        {
+            consider(recordId, this->keys.at(recordId));
+        }
+    }
+    size_t wanted = min(limit - hits.size(), inside.size());
+    partial_sort(inside.begin(), inside.begin() + wanted, inside.end());
+    for (size_t i = 0; i < wanted; i++)
+    {
+        hits.push_back(SearchHit{inside[i].recordId, inside[i].rank});
+    }
+    return hits;
+}
+
+//Weeks are counted from the day numbers, rounding down for days before 1970
+long TripCalendar ::weekOf(long day)
+{
+    return day >= 0 ? day / 7 : (day - 6) / 7;
+}
+
+void TripCalendar ::add(const Trip *trip)
+{
+    if (trip->getStartDate().isEmpty() || trip->getEndDate().isEmpty())
+    {
+        return;
+    }
+    long start = trip->getStartDate().getDayNumber();
+    // a trip ending before it starts is taken to last its first day
+    long end = max(start, trip->getEndDate().getDayNumber());
+    this->placed[trip] = make_pair(start, end);
+    this->starts[start].push_back(trip);
+    this->ends[end].push_back(trip);
+    for (long week = weekOf(start); week <= weekOf(end); week++)
+    {
+        this->weeks[week].push_back(trip);
+    }
+}
+
+void TripCalendar ::remove(const Trip *trip)
+{
+    auto days = this->placed.find(trip);
+    if (days == this->placed.end())
+    {
+        return;
+    }
+    long start = days->second.first, end = days->second.second;
+    this->placed.erase(days);
+    auto unlist = [trip](vector<const Trip *> &list) {
+        list.erase(find(list.begin(), list.end(), trip));
+        return list.empty();
+    };
+    if (unlist(this->starts[start]))
+    {
+        this->starts.erase(start);
+    }
+    if (unlist(this->ends[end]))
+    {
+        this->ends.erase(end);
+    }
+    for (long week = weekOf(start); week <= weekOf(end); week++)
+    {
+        if (unlist(this->weeks[week]))
+        {
+            this->weeks.erase(week);
+        }
+    }
+}
+
+//Appends the trips of the days from firstDay to lastDay in the order of the days
+void TripCalendar ::collect(const map<long, vector<const Trip *>> &days, long firstDay, long lastDay, vector<const Trip *> &trips)
+{
+    for (auto day = days.lower_bound(firstDay); day != days.end() && day->first <= lastDay; day++)
+    {
+        trips.insert(trips.end(), day->second.begin(), day->second.end());
+    }
+}
+
+vector<const Trip *> TripCalendar ::startingBetween(long firstDay, long lastDay) const
+{
+    vector<const Trip *> trips;
+    collect(this->starts, firstDay, lastDay, trips);
+    return trips;
+}
+
+vector<const Trip *> TripCalendar ::endingBetween(long firstDay, long lastDay) const
+{
+    vector<const Trip *> trips;
+    collect(this->ends, firstDay, lastDay, trips);
+    return trips;
+}
+
+//Only the trips running in the day's week are looked at
+vector<const Trip *> TripCalendar ::activeOn(long day) const
+{
+    vector<pair<long, const Trip *>> active;
+    auto week = this->weeks.find(weekOf(day));
+    if (week == this->weeks.end())
+    {
+        return vector<const Trip *>();
+    }
+    for (auto trip : week->second)
+    {
+        const pair<long, long> &days = this->placed.at(trip);
+        if (days.first <= day && day <= days.second)
+        {
+            active.push_back(make_pair(days.first, trip));
+        }
+    }
+    stable_sort(active.begin(), active.end(),
+                [](const pair<long, const Trip *> &a, const pair<long, const Trip *> &b) { return a.first < b.first; });
+    vector<const Trip *> trips;
+    for (auto &trip : active)
+    {
+        trips.push_back(trip.second);
+    }
+    return trips;
+}
+
+//Vehicles whose registration number matches the text, best first
+vector<const Vehicle *> Database ::searchVehicles(const string &text, size_t limit) const
+{
+    RecordedCall call(callSearchVehicles);
+    call.text(text);
+    call.number(limit);
+    vector<const Vehicle *> vehicles;
+    for (auto &hit : this->registrationSearch->search(text, limit))
+    {
+        vehicles.push_back(this->vehicleTable->getRecordForId(hit.recordId));
+    }
+    return vehicles;
+}
+
+//Users whose name or email matches the text, best first. A user found by
+//both keeps the better of its ranks.
+vector<const User *> Database ::searchUsers(const string &text, size_t limit) const
+{
+    RecordedCall call(callSearchUsers);
+    call.text(text);
+    call.number(limit);
+    vector<SearchHit> hits = this->nameSearch->search(text, limit);
+    for (auto &hit : this->emailSearch->search(text, limit))
+    {
+        hits.push_back(hit);
+    }
+    // stable, so equal ranks keep the order each index gave them
+    stable_sort(hits.begin(), hits.end(), [](const SearchHit &a, const SearchHit &b) { return a.rank < b.rank; });
+    vector<const User *> users;
+    unordered_set<long> seen;
+    for (auto &hit : hits)
+    {
+        if (users.size() < limit && seen.insert(hit.recordId).second)
+        {
+            users.push_back(this->userTable->getRecordForId(hit.recordId));
+        }
+    }
+    return users;
+}
+
+//    Marks the first page of users.db
+const string USERSTOREMAGIC = "VMSU2";
+
+//    Marks a users.db whose users are still stored as lines of users.txt,
+//    their values are converted the first time it is opened for writing
+const string TEXTUSERSTOREMAGIC = "VMSU1";
+
+static void putUint(string &out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        out.push_back(char(value >> (8 * i)));
+    }
+}
+
+static uint64_t getUint(const char *in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= uint64_t((unsigned char)in[i]) << (8 * i);
+    }
+    return value;
+}
+
+UserStore ::UserStore(string fileName, size_t poolCapacity) throw(IOError)
+{
+    this->fileName = fileName;
+    this->poolCapacity = poolCapacity;
+    this->headerDirty = false;
+    this->textValues = false;
+    this->file.open(fileName, ios::in | ios::out | ios::binary);
+    this->created = !this->file;
+    if (this->created)
+    {
+        this->file.clear();
+        this->file.open(fileName, ios::in | ios::out | ios::trunc | ios::binary);
+        if (!this->file)
+        {
+            throw IOError();
+        }
+        this->pageCount = 1;
+        this->lastRecordId = 0;
+        this->idRoot = this->allocate(true);
+        this->contactRoot = this->allocate(true);
+        this->writePending();
+        return;
+    }
+    char header[USERPAGESIZE];
+    if (!this->file.read(header, USERPAGESIZE))
+    {
+        throw IOError();
+    }
+    this->textValues = string(header, TEXTUSERSTOREMAGIC.length()) == TEXTUSERSTOREMAGIC;
+    if (!this->textValues && string(header, USERSTOREMAGIC.length()) != USERSTOREMAGIC)
+    {
+        throw IOError();
+    }
+    const char *at = header + USERSTOREMAGIC.length();
+    this->pageCount = getUint(at, 4);
+    this->idRoot = getUint(at + 4, 4);
+    this->contactRoot = getUint(at + 8, 4);
+    this->lastRecordId = getUint(at + 12, 8);
+}
+
+UserStore ::~UserStore()
+{
+    try
+    {
+        this->writePending();
+    }
+    catch (IOError error)
+    {
+    }
+}
+
+//True when the file did not exist and was created empty
+bool UserStore ::isNew() const
+{
+    return this->created;
+}
+
+bool UserStore ::holdsText() const
+{
+    return this->textValues;
+}
+
+//Rewrites every stored value, the keys stay as they are
+void UserStore ::convertValues(function<string(const string &)> convert) throw(IOError)
+{
+    lock_guard<mutex> guard(this->lock);
+    shared_ptr<BTreeNode> node = this->fetch(this->idRoot);
+    while (!node->leaf)
+    {
+        node = this->fetch(node->children[0]);
+    }
+    while (true)
+    {
+        for (auto &record : node->values)
+        {
+            record = convert(record);
+        }
+        node->dirty = true;
+        if (!node->next)
+        {
+            break;
+        }
+        node = this->fetch(node->next);
+    }
+    this->textValues = false;
+    this->headerDirty = true;
+}
+
+//Contact of a stored value, its key has to go when the user is changed
+bool UserStore ::contactOf(const string &record, string &contact)
+{
+    if (this->textValues)
+    {
+        vector<string> fields = split(record, DELIMETER);
+        if (fields.size() > 2)
+        {
+            contact = fields[2];
+        }
+        return fields.size() > 2;
+    }
+    try
+    {
+        unique_ptr<User> user(RecordCodec<User>::decode(record, *this));
+        contact = user->getContact();
+        return true;
+    }
+    catch (out_of_range &error)
+    {
+        return false;
+    }
+}
+
+long UserStore ::getLastRecordId()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->lastRecordId;
+}
+
+//Ids are stored big-endian so that the bytes sort like the numbers
+string UserStore ::idKey(long recordId)
+{
+    string key;
+    for (int i = 7; i >= 0; i--)
+    {
+        key.push_back(char(uint64_t(recordId) >> (8 * i)));
+    }
+    return key;
+}
+
+size_t UserStore ::nodeSize(const BTreeNode &node)
+{
+    size_t size = 7;
+    for (size_t i = 0; i < node.keys.size(); i++)
+    {
+        size += 2 + node.keys[i].length() + (node.leaf ? 2 + node.values[i].length() : 4);
+    }
+    return size;
+}
+
+//A page from the pool, read from the file if it is not there. The pool only
+//gives up pages that no caller holds any more.
+shared_ptr<BTreeNode> UserStore ::fetch(uint32_t page) throw(IOError)
+{
+    auto cached = this->poolPositions.find(page);
+    if (cached != this->poolPositions.end())
+    {
+        this->pool.splice(this->pool.begin(), this->pool, cached->second);
+        return cached->second->second;
+    }
+    char data[USERPAGESIZE];
+    this->file.clear();
+    this->file.seekg(streamoff(page) * USERPAGESIZE);
+    if (!this->file.read(data, USERPAGESIZE))
+    {
+        throw IOError();
+    }
+    auto node = make_shared<BTreeNode>();
+    node->leaf = data[0] != 0;
+    size_t count = getUint(data + 1, 2);
+    uint32_t link = getUint(data + 3, 4);
+    node->next = node->leaf ? link : 0;
+    if (!node->leaf)
+    {
+        node->children.push_back(link);
+    }
+    node->dirty = false;
+    const char *at = data + 7;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t keyLength = getUint(at, 2);
+        node->keys.push_back(string(at + 2, keyLength));
+        at += 2 + keyLength;
+        if (node->leaf)
+        {
+            size_t valueLength = getUint(at, 2);
+            node->values.push_back(string(at + 2, valueLength));
+            at += 2 + valueLength;
+        }
+        else
+        {
+            node->children.push_back(getUint(at, 4));
+            at += 4;
+        }
+    }
+    this->pool.push_front(make_pair(page, node));
+    this->poolPositions[page] = this->pool.begin();
+    this->evict();
+    return node;
+}
+
+uint32_t UserStore ::allocate(bool leaf)
+{
+    auto node = make_shared<BTreeNode>();
+    node->leaf = leaf;
+    node->next = 0;
+    node->dirty = true;
+    uint32_t page = this->pageCount++;
+    this->headerDirty = true;
+    this->pool.push_front(make_pair(page, node));
+    this->poolPositions[page] = this->pool.begin();
+    return page;
+}
+
+void UserStore ::evict() throw(IOError)
+{
+    auto candidate = this->pool.end();
+    while (this->pool.size() > this->poolCapacity && candidate != this->pool.begin())
+    {
+        candidate--;
+        if (candidate->second.use_count() > 1)
+        {
+            continue;
+        }
+        if (candidate->second->dirty)
+        {
+            this->writeNode(candidate->first, *candidate->second);
+        }
+        this->poolPositions.erase(candidate->first);
+        candidate = this->pool.erase(candidate);
+    }
+}
+
+void UserStore ::writeNode(uint32_t page, const BTreeNode &node) throw(IOError)
+{
+    string data;
+    data.push_back(node.leaf ? 1 : 0);
+    putUint(data, node.keys.size(), 2);
+    putUint(data, node.leaf ? node.next : node.children[0], 4);
+    for (size_t i = 0; i < node.keys.size(); i++)
+    {
+        putUint(data, node.keys[i].length(), 2);
+        data += node.keys[i];
+        if (node.leaf)
+        {
+            putUint(data, node.values[i].length(), 2);
+            data += node.values[i];
+        }
+        else
+        {
+            putUint(data, node.children[i + 1], 4);
+        }
+    }
+    data.resize(USERPAGESIZE, '\0');
+    this->file.clear();
+    this->file.seekp(streamoff(page) * USERPAGESIZE);
+    if (!this->file.write(data.data(), data.length()))
+    {
+        throw IOError();
+    }
+}
+
+void UserStore ::writeHeader() throw(IOError)
+{
+    string data = this->textValues ? TEXTUSERSTOREMAGIC : USERSTOREMAGIC;
+    putUint(data, this->pageCount, 4);
+    putUint(data, this->idRoot, 4);
+    putUint(data, this->contactRoot, 4);
+    putUint(data, this->lastRecordId, 8);
+    data.resize(USERPAGESIZE, '\0');
+    this->file.clear();
+    this->file.seekp(0);
+    if (!this->file.write(data.data(), data.length()))
+    {
+        throw IOError();
+    }
+}
+
+//Puts the key into the subtree at page. When the page had to be split the
+//new right page and the first key it covers are returned for the parent.
+bool UserStore ::insert(uint32_t page, const string &key, const string &value, string &splitKey, uint32_t &splitPage) throw(IOError)
+{
+    shared_ptr<BTreeNode> node = this->fetch(page);
+    size_t position = upper_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+    bool appending = position == node->keys.size();
+    if (node->leaf)
+    {
+        if (position > 0 && node->keys[position - 1] == key)
+        {
+            node->values[position - 1] = value;
+        }
+        else
+        {
+            node->keys.insert(node->keys.begin() + position, key);
+            node->values.insert(node->values.begin() + position, value);
+        }
+    }
+    else
+    {
+        string childKey;
+        uint32_t childPage;
+        if (!this->insert(node->children[position], key, value, childKey, childPage))
+        {
+            return false;
+        }
+        node->keys.insert(node->keys.begin() + position, childKey);
+        node->children.insert(node->children.begin() + position + 1, childPage);
+    }
+    node->dirty = true;
+    if (nodeSize(*node) <= USERPAGESIZE)
+    {
+        return false;
+    }
+
+    // split where the left half reaches half a page. Ids are handed out in
+    // order, so a key added at the right end leaves the left page full.
+    size_t half = 0, middle = 0;
+    for (; middle + 1 < node->keys.size() && half < USERPAGESIZE / 2; middle++)
+    {
+        half += 2 + node->keys[middle].length() + (node->leaf ? 2 + node->values[middle].length() : 4);
+    }
+    if (appending)
+    {
+        middle = node->keys.size() - 1;
+    }
+    splitPage = this->allocate(node->leaf);
+    shared_ptr<BTreeNode> right = this->fetch(splitPage);
+    if (node->leaf)
+    {
+        splitKey = node->keys[middle];
+        right->keys.assign(node->keys.begin() + middle, node->keys.end());
+        right->values.assign(node->values.begin() + middle, node->values.end());
+        node->keys.resize(middle);
+        node->values.resize(middle);
+        right->next = node->next;
+        node->next = splitPage;
+    }
+    else
+    {
+        // the middle key moves up, its right child starts the new page
+        splitKey = node->keys[middle];
+        right->keys.assign(node->keys.begin() + middle + 1, node->keys.end());
+        right->children.assign(node->children.begin() + middle + 1, node->children.end());
+        node->keys.resize(middle);
+        node->children.resize(middle + 1);
+    }
+    right->dirty = true;
+    return true;
+}
+
+void UserStore ::insert(uint32_t &root, const string &key, const string &value) throw(IOError)
+{
+    // an entry must leave room for a split
+    if (key.length() + value.length() > USERPAGESIZE / 4)
+    {
+        throw IOError();
+    }
+    string splitKey;
+    uint32_t splitPage;
+    if (this->insert(root, key, value, splitKey, splitPage))
+    {
+        uint32_t newRoot = this->allocate(false);
+        shared_ptr<BTreeNode> node = this->fetch(newRoot);
+        node->keys.push_back(splitKey);
+        node->children.push_back(root);
+        node->children.push_back(splitPage);
+        root = newRoot;
+    }
+}
+
+//Finds the first entry whose key is not less than key
+bool UserStore ::seek(uint32_t root, const string &key, string &foundKey, string &value) throw(IOError)
+{
+    shared_ptr<BTreeNode> node = this->fetch(root);
+    while (!node->leaf)
+    {
+        size_t position = upper_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+        node = this->fetch(node->children[position]);
+    }
+    size_t position = lower_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+    // emptied leaves may follow
+    while (position == node->keys.size())
+    {
+        if (!node->next)
+        {
+            return false;
+        }
+        node = this->fetch(node->next);
+        position = 0;
+    }
+    foundKey = node->keys[position];
+    value = node->values[position];
+    return true;
+}
+
+void UserStore ::erase(uint32_t root, const string &key) throw(IOError)
+{
+    shared_ptr<BTreeNode> node = this->fetch(root);
+    while (!node->leaf)
+    {
+        size_t position = upper_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+        node = this->fetch(node->children[position]);
+    }
+    auto position = lower_bound(node->keys.begin(), node->keys.end(), key);
+    if (position != node->keys.end() && *position == key)
+    {
+        node->values.erase(node->values.begin() + (position - node->keys.begin()));
+        node->keys.erase(position);
+        node->dirty = true;
+    }
+}
+
+bool UserStore ::get(long recordId, string &record) throw(IOError)
+{
+    TRACE_SPAN("UserStore::get");
+    lock_guard<mutex> guard(this->lock);
+    string key = idKey(recordId), foundKey;
+    return this->seek(this->idRoot, key, foundKey, record) && foundKey == key;
+}
+
+//Contacts are keyed together with the id, so the first key that starts
+//with the contact belongs to the user with the lowest id having it
+bool UserStore ::findContact(const string &contact, long &recordId) throw(IOError)
+{
+    TRACE_SPAN("UserStore::findContact");
+    lock_guard<mutex> guard(this->lock);
+    string prefix = contact + '\0', foundKey, value;
+    if (!this->seek(this->contactRoot, prefix, foundKey, value) ||
+        foundKey.compare(0, prefix.length(), prefix) != 0)
+    {
+        return false;
+    }
+    recordId = getUint(value.data(), 8);
+    return true;
+}
+
+//Adds or replaces a user, moving its contact key when the contact changed
+void UserStore ::put(long recordId, const string &contact, const string &record) throw(IOError)
+{
+    TRACE_SPAN("UserStore::put");
+    lock_guard<mutex> guard(this->lock);
+    string key = idKey(recordId), foundKey, old;
+    if (this->seek(this->idRoot, key, foundKey, old) && foundKey == key)
+    {
+        string oldContact;
+        if (this->contactOf(old, oldContact) && oldContact != contact)
+        {
+            this->erase(this->contactRoot, oldContact + '\0' + key);
+        }
+    }
+    string id;
+    putUint(id, recordId, 8);
+    this->insert(this->idRoot, key, record);
+    this->insert(this->contactRoot, contact + '\0' + key, id);
+    if (recordId > this->lastRecordId)
+    {
+        this->lastRecordId = recordId;
+    }
+    this->headerDirty = true;
+}
+
+void UserStore ::remove(long recordId) throw(IOError)
+{
+    lock_guard<mutex> guard(this->lock);
+    string key = idKey(recordId), foundKey, old;
+    if (!this->seek(this->idRoot, key, foundKey, old) || foundKey != key)
+    {
+        return;
+    }
+    string oldContact;
+    if (this->contactOf(old, oldContact))
+    {
+        this->erase(this->contactRoot, oldContact + '\0' + key);
+    }
+    this->erase(this->idRoot, key);
+}
+
+//Visits every stored record in id order by walking the leaves
+void UserStore ::forEach(function<void(const string &)> visit) throw(IOError)
+{
+    lock_guard<mutex> guard(this->lock);
+    shared_ptr<BTreeNode> node = this->fetch(this->idRoot);
+    while (!node->leaf)
+    {
+        node = this->fetch(node->children[0]);
+    }
+    while (true)
+    {
+        for (auto &record : node->values)
+        {
+            visit(record);
+        }
+        if (!node->next)
+        {
+            return;
+        }
+        node = this->fetch(node->next);
+    }
+}
+
+//Forgets the pages read so far, so a replica sees what the primary wrote
+void UserStore ::dropCache() throw(IOError)
+{
+    lock_guard<mutex> guard(this->lock);
+    char header[USERPAGESIZE];
+    this->file.clear();
+    this->file.seekg(0);
+    if (this->file.read(header, USERPAGESIZE))
+    {
+        const char *at = header + USERSTOREMAGIC.length();
+        this->pageCount = getUint(at, 4);
+        this->idRoot = getUint(at + 4, 4);
+        this->contactRoot = getUint(at + 8, 4);
+        this->lastRecordId = getUint(at + 12, 8);
+    }
+    this->pool.clear();
+    this->poolPositions.clear();
+}
+
+//Writes the changed pages and then the header that points to them
+void UserStore ::writePending() throw(IOError)
+{
+    TRACE_SPAN("UserStore::writePending");
+    lock_guard<mutex> guard(this->lock);
+    for (auto &page : this->pool)
+    {
+        if (page.second->dirty)
+        {
+            this->writeNode(page.first, *page.second);
+            page.second->dirty = false;
+        }
+    }
+    if (this->headerDirty)
+    {
+        this->writeHeader();
+        this->headerDirty = false;
+    }
+    this->file.flush();
+    if (!this->file)
+    {
+        throw IOError();
+    }
+}
+
+//    Users the self check stores, enough for the trees to be several levels deep
+const long SELFCHECKUSERS = 3000;
+
+//Runs the B+tree through the cases a split or an emptied leaf can get wrong,
+//in a scratch file that is removed again, and prints one line per case to
+//out. The pool holds only a few pages, so most seeks read from the file.
+bool UserStore ::selfCheck(string fileName, ostream &out) throw(IOError)
+{
+    ::remove(fileName.c_str());
+    unique_ptr<UserStore> store(new UserStore(fileName, 4));
+    auto contactFor = [](long recordId) { return to_string(7000000000L + recordId); };
+    auto put = [&](long recordId, const string &contact) {
+        string record;
+        RecordCodec<User>::encode(User("User " + to_string(recordId), contact, "user@example.com", recordId), record);
+        store->put(recordId, contact, record);
+    };
+    auto holds = [&](long recordId, const string &contact) {
+        string record;
+        long foundId = 0;
+        if (!store->get(recordId, record) || !store->findContact(contact, foundId) || foundId != recordId)
+        {
+            return false;
+        }
+        unique_ptr<User> user(RecordCodec<User>::decode(record, *store));
+        return user->getRecord() == recordId && user->getContact() == contact;
+    };
+    auto lacks = [&](long recordId, const string &contact) {
+        string record;
+        long foundId = 0;
+        return !store->get(recordId, record) && !store->findContact(contact, foundId);
+    };
+    auto reopen = [&]() {
+        store->writePending();
+        store.reset();
+        store.reset(new UserStore(fileName, 4));
+    };
+    auto report = [&](const string &name, bool passed) {
+        out << (passed ? "ok      " : "FAILED  ") << name << "\n";
+        return passed;
+    };
+    bool passed = true;
+
+    // the last leaf fills up and splits, then the inner nodes above it
+    for (long id = 1; id <= SELFCHECKUSERS; id++)
+    {
+        put(id, contactFor(id));
+    }
+    reopen();
+    bool ok = !store->fetch(store->idRoot)->leaf && !store->fetch(store->contactRoot)->leaf;
+    for (long id = 1; ok && id <= SELFCHECKUSERS; id++)
+    {
+        ok = holds(id, contactFor(id));
+    }
+    ok = ok && lacks(SELFCHECKUSERS + 1, contactFor(SELFCHECKUSERS + 1));
+    passed &= report("users.db split, reopen and seek", ok);
+
+    // a run of ids that spans whole leaves leaves them empty, seeks have to
+    // follow the links past them
+    long first = SELFCHECKUSERS / 4, last = SELFCHECKUSERS * 3 / 4;
+    for (long id = first; id <= last; id++)
+    {
+        store->remove(id);
+    }
+    reopen();
+    string foundKey, value;
+    ok = store->seek(store->idRoot, idKey(first), foundKey, value) && foundKey == idKey(last + 1);
+    long count = 0;
+    store->forEach([&](const string &) { count++; });
+    ok = ok && count == SELFCHECKUSERS - (last - first + 1);
+    for (long id = 1; ok && id <= SELFCHECKUSERS; id++)
+    {
+        ok = id >= first && id <= last ? lacks(id, contactFor(id)) : holds(id, contactFor(id));
+    }
+    passed &= report("users.db seek across emptied leaves", ok);
+
+    // contacts that start with another contact, the whole contact must match
+    long shortId = SELFCHECKUSERS + 1, longId = SELFCHECKUSERS + 2;
+    put(shortId, "98765");
+    put(longId, "987654321");
+    long foundId = 0;
+    ok = holds(shortId, "98765") && holds(longId, "987654321") &&
+         !store->findContact("9876", foundId) && !store->findContact("98765432", foundId);
+    store->remove(shortId);
+    ok = ok && !store->findContact("98765", foundId) && holds(longId, "987654321");
+    put(longId, "98765");
+    reopen();
+    ok = ok && holds(longId, "98765") && !store->findContact("987654321", foundId);
+    passed &= report("users.db contact that prefixes another", ok);
+
+    store.reset();
+    ::remove(fileName.c_str());
+    return passed;
+}
+
+//Splits a query into words, quoted values, operators and commas
+static vector<string> tokenizeQuery(const string &text) throw(QueryError)
+{
+    vector<string> tokens;
+    for (size_t i = 0; i < text.length();)
+    {
+        char c = text[i];
+        if (isspace((unsigned char)c))
+        {
+            i++;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            size_t end = text.find(c, i + 1);
+            if (end == string::npos)
+            {
+                throw QueryError("unterminated quote");
+            }
+            tokens.push_back(text.substr(i, end - i + 1));
+            i = end + 1;
+        }
+        else if (c == ',')
+        {
+            tokens.push_back(",");
+            i++;
+        }
+        else if ((c == '+' || c == '-' || c == '*') && i + 1 < text.length() && text[i + 1] == '=')
+        {
+            tokens.push_back(text.substr(i, 2));
+            i += 2;
+        }
+        else if (c == '=' || c == '!' || c == '<' || c == '>')
+        {
+            size_t length = i + 1 < text.length() && text[i + 1] == '=' ? 2 : 1;
+            tokens.push_back(text.substr(i, length));
+            i += length;
+        }
+        else
+        {
+            size_t end = i;
+            while (end < text.length() && !isspace((unsigned char)text[end]) &&
+                   string(",=!<>\"'").find(text[end]) == string::npos &&
+                   !(string("+-*").find(text[end]) != string::npos && end + 1 < text.length() && text[end + 1] == '='))
+            {
+                end++;
+            }
+            tokens.push_back(text.substr(i, end - i));
+            i = end;
+        }
+    }
+    return tokens;
+}
+
+static string unquote(const string &token)
+{
+    if (token.length() >= 2 && (token[0] == '"' || token[0] == '\''))
+    {
+        return token.substr(1, token.length() - 2);
+    }
+    return token;
+}
+
+//Prints a number column without a fraction when it has none
+static string formatQueryNumber(double value)
+{
+    if (value != value)
+    {
+        return "";
+    }
+    stringstream ss;
+    if (value == (long long)value)
+    {
+        ss << (long long)value;
+    }
+    else
+    {
+        ss << fixed << setprecision(2) << value;
+    }
+    return ss.str();
+}
+
+//Day number of a date column, NaN for an empty date so that it fails every
+//comparison but !=
+static double queryDay(const Date &date)
+{
+    return date.isEmpty() ? NAN : date.getDayNumber();
+}
+
+static string formatQueryDay(double day)
+{
+    return day != day ? "" : Date::fromDayNumber((long)day).toString();
+}
+
+const vector<QueryColumn<Vehicle>> &QuerySchema<Vehicle>::columns()
+{
+    static const vector<QueryColumn<Vehicle>> columns = {
+        {"id", numberColumn, [](const Vehicle &v) -> double { return v.getRecord(); },
+         [](const Vehicle &v) { return to_string(v.getRecord()); }},
+        {"registration", textColumn, nullptr, [](const Vehicle &v) { return v.getRegistrationNumber(); }},
+        {"type", numberColumn, [](const Vehicle &v) -> double { return v.getVehicleType(); },
+         [](const Vehicle &v) { return v.getVehicleTypeName(); }},
+        {"seats", numberColumn, [](const Vehicle &v) -> double { return v.getSeats(); },
+         [](const Vehicle &v) { return to_string(v.getSeats()); }},
+        {"company", textColumn, nullptr, [](const Vehicle &v) { return v.getCompanyName(); }},
+        {"price", numberColumn, [](const Vehicle &v) { return v.getPricePerKm(); },
+         [](const Vehicle &v) { return formatQueryNumber(v.getPricePerKm()); }},
+        {"puc", dateColumn, [](const Vehicle &v) { return queryDay(v.getPUCExpirationDate()); },
+         [](const Vehicle &v) { return v.getPUCExpirationDate().toString(); }},
+    };
+    return columns;
+}
+
+const vector<QueryColumn<User>> &QuerySchema<User>::columns()
+{
+    static const vector<QueryColumn<User>> columns = {
+        {"id", numberColumn, [](const User &u) -> double { return u.getRecord(); },
+         [](const User &u) { return to_string(u.getRecord()); }},
+        {"name", textColumn, nullptr, [](const User &u) { return u.getName(); }},
+        {"contact", textColumn, nullptr, [](const User &u) { return u.getContact(); }},
+        {"email", textColumn, nullptr, [](const User &u) { return u.getEmail(); }},
+    };
+    return columns;
+}
+
+const vector<QueryColumn<Trip>> &QuerySchema<Trip>::columns()
+{
+    static const vector<QueryColumn<Trip>> columns = {
+        {"id", numberColumn, [](const Trip &t) -> double { return t.getRecord(); },
+         [](const Trip &t) { return to_string(t.getRecord()); }},
+        {"vehicle", numberColumn, [](const Trip &t) -> double { return t.getVehicle().getRecord(); },
+         [](const Trip &t) { return to_string(t.getVehicle().getRecord()); }},
+        {"user", numberColumn, [](const Trip &t) -> double { return t.getUser().getRecord(); },
+         [](const Trip &t) { return to_string(t.getUser().getRecord()); }},
+        {"start", dateColumn, [](const Trip &t) { return queryDay(t.getStartDate()); },
+         [](const Trip &t) { return t.getStartDate().toString(); }},
+        {"end", dateColumn, [](const Trip &t) { return queryDay(t.getEndDate()); },
+         [](const Trip &t) { return t.getEndDate().toString(); }},
+        {"startReading", numberColumn, [](const Trip &t) -> double { return t.getStartReading(); },
+         [](const Trip &t) { return to_string(t.getStartReading()); }},
+        {"endReading", numberColumn, [](const Trip &t) -> double { return t.getEndReading(); },
+         [](const Trip &t) { return to_string(t.getEndReading()); }},
+        {"fare", numberColumn, [](const Trip &t) -> double { return t.getFare().getPaise() / 100.0; },
+         [](const Trip &t) { return t.getFare().toString(); }},
+        {"completed", numberColumn, [](const Trip &t) -> double { return t.isCompleted(); },
+         [](const Trip &t) { return string(t.isCompleted() ? "1" : "0"); }},
+    };
+    return columns;
+}
+
+vector<const Trip *> QuerySchema<Trip>::index(const Database &database, const string &column, long key)
+{
+    return column == "vehicle" ? database.getTripsForVehicle(key) : database.getTripsForUser(key);
+}
+
+vector<const Trip *> QuerySchema<Trip>::rangeIndex(const Database &database, const string &column, long first, long last)
+{
+    const TripCalendar &calendar = database.getTripCalendar();
+    return column == "start" ? calendar.startingBetween(first, last) : calendar.endingBetween(first, last);
+}
+
+const vector<UpdateColumn<Vehicle>> &QuerySchema<Vehicle>::updateColumns()
+{
+    static const vector<UpdateColumn<Vehicle>> columns = {
+        {"price", numberColumn, [](Vehicle &v, double price) {
+             if (!(price >= 0) || isinf(price))
+             {
+                 throw QueryError("invalid price " + formatQueryNumber(price));
+             }
+             v.setPricePerKm(price);
+         }, nullptr},
+    };
+    return columns;
+}
+
+const vector<UpdateColumn<User>> &QuerySchema<User>::updateColumns()
+{
+    // the contact is the key of users.db and of logins, it is not changed in bulk
+    static const vector<UpdateColumn<User>> columns = {
+        {"name", textColumn, nullptr, [](User &u, const string &name) { u.setName(name); }},
+        {"email", textColumn, nullptr, [](User &u, const string &email) { u.setEmail(email); }},
+    };
+    return columns;
+}
+
+//Trips can only be completed, at their last reading, which prices them
+const vector<UpdateColumn<Trip>> &QuerySchema<Trip>::updateColumns()
+{
+    static const vector<UpdateColumn<Trip>> columns = {
+        {"completed", numberColumn, [](Trip &t, double completed) {
+             if (completed != 1 && !(completed == 0 && !t.isCompleted()))
+             {
+                 throw QueryError("trips can only be set completed = 1");
+             }
+             if (completed == 1)
+             {
+                 t.completeTrip(max(t.getStartReading(), t.getEndReading()));
+             }
+         }, nullptr},
+    };
+    return columns;
+}
+
+//A predicate specialised for the column getter, the comparison and the value
+template <typename T, typename V, typename Compare>
+static function<bool(const T &)> comparePredicate(V (*column)(const T &), V value)
+{
+    return [column, value](const T &record) { return Compare()(column(record), value); };
+}
+
+template <typename T, typename V>
+static function<bool(const T &)> makePredicate(V (*column)(const T &), const string &op, V value) throw(QueryError)
+{
+    if (op == "=")
+    {
+        return comparePredicate<T, V, equal_to<V>>(column, value);
+    }
+    if (op == "!=")
+    {
+        return comparePredicate<T, V, not_equal_to<V>>(column, value);
+    }
+    if (op == "<")
+    {
+        return comparePredicate<T, V, less<V>>(column, value);
+    }
+    if (op == "<=")
+    {
+        return comparePredicate<T, V, less_equal<V>>(column, value);
+    }
+    if (op == ">")
+    {
+        return comparePredicate<T, V, greater<V>>(column, value);
+    }
+    if (op == ">=")
+    {
+        return comparePredicate<T, V, greater_equal<V>>(column, value);
+    }
+    throw QueryError("unknown operator " + op);
+}
+
+template <typename T>
+TableQuery<T>::TableQuery(const Database *database, const vector<string> &tokens) throw(QueryError)
+{
+    this->database = database;
+    this->firstId = 1;
+    this->lastId = LONG_MAX;
+    this->indexKey = 0;
+    this->rangeFirst = LONG_MIN;
+    this->rangeLast = LONG_MAX;
+    this->limit = 0;
+    this->numberFilters = 0;
+
+    size_t position = 1;
+    auto next = [&](const char *expected) -> string {
+        if (position >= tokens.size())
+        {
+            throw QueryError(string("expected ") + expected);
+        }
+        return tokens[position++];
+    };
+    if (position < tokens.size() && tokens[position] == "where")
+    {
+        position++;
+        do
+        {
+            string column = next("a column");
+            string op = next("an operator");
+            string value = next("a value");
+            this->addCondition(column, op, unquote(value));
+        } while (position < tokens.size() && tokens[position] == "and" && position++);
+    }
+    if (position < tokens.size() && tokens[position] == "select")
+    {
+        position++;
+        do
+        {
+            this->projection.push_back(this->findColumn(next("a column")));
+        } while (position < tokens.size() && tokens[position] == "," && position++);
+    }
+    if (position < tokens.size() && tokens[position] == "limit")
+    {
+        position++;
+        string count = next("a limit");
+        if (!isWholeNumber(count))
+        {
+            throw QueryError("invalid limit " + count);
+        }
+        this->limit = stoul(count);
+    }
+    if (position < tokens.size())
+    {
+        throw QueryError("unexpected " + tokens[position]);
+    }
+    if (this->projection.empty())
+    {
+        for (auto &column : QuerySchema<T>::columns())
+        {
+            this->projection.push_back(&column);
+        }
+    }
+}
+
+template <typename T>
+const QueryColumn<T> *TableQuery<T>::findColumn(const string &name) const throw(QueryError)
+{
+    for (auto &column : QuerySchema<T>::columns())
+    {
+        if (name == column.name)
+        {
+            return &column;
+        }
+    }
+    throw QueryError(string("no column ") + name + " in " + QuerySchema<T>::name());
+}
+
+//Turns one condition into id bounds, an index lookup or a filter. Number
+//and date filters are kept ahead of the dearer text comparisons.
+template <typename T>
+void TableQuery<T>::addCondition(const string &name, const string &op, const string &value) throw(QueryError)
+{
+    const QueryColumn<T> *column = this->findColumn(name);
+    if (column->kind == textColumn)
+    {
+        this->filters.push_back(makePredicate<T, string>(column->text, op, value));
+        this->conditions.push_back(name + " " + op + " \"" + value + "\"");
+        return;
+    }
+
+    double number;
+    if (column->kind == dateColumn)
+    {
+        if (!isValidDate(value))
+        {
+            throw QueryError("invalid date " + value);
+        }
+        number = Date(value).getDayNumber();
+    }
+    else if (name == "type" && (value == "bike" || value == "car" || value == "bus"))
+    {
+        number = value == "bike" ? VehicleType::bike : value == "car" ? VehicleType::car : VehicleType::bus;
+    }
+    else
+    {
+        char *end;
+        number = strtod(value.c_str(), &end);
+        if (value.empty() || *end)
+        {
+            throw QueryError("invalid number " + value);
+        }
+    }
+
+    if (name == "id" && op != "!=")
+    {
+        long id = (long)ceil(number);
+        bool whole = id == number;
+        if (op == "=" || op == ">=" || op == ">")
+        {
+            this->firstId = max(this->firstId, op == ">" && whole ? id + 1 : id);
+        }
+        if (op == "=" || op == "<=" || op == "<")
+        {
+            long last = (long)floor(number);
+            this->lastId = min(this->lastId, op == "<" && whole ? last - 1 : last);
+        }
+        if (op == "=" && !whole)
+        {
+            this->lastId = this->firstId - 1;
+        }
+        return;
+    }
+    if (op == "=" && this->indexColumn.empty() && QuerySchema<T>::hasIndex(name) && number == (long)number)
+    {
+        this->indexColumn = name;
+        this->indexKey = (long)number;
+        return;
+    }
+    // the filter stays as well, an equality index is read instead when there is one
+    if (column->kind == dateColumn && op != "!=" && QuerySchema<T>::hasRangeIndex(name) &&
+        (this->rangeColumn.empty() || this->rangeColumn == name))
+    {
+        long day = (long)number;
+        this->rangeColumn = name;
+        if (op == "=" || op == ">=" || op == ">")
+        {
+            this->rangeFirst = max(this->rangeFirst, op == ">" ? day + 1 : day);
+        }
+        if (op == "=" || op == "<=" || op == "<")
+        {
+            this->rangeLast = min(this->rangeLast, op == "<" ? day - 1 : day);
+        }
+    }
+    this->filters.insert(this->filters.begin() + this->numberFilters,
+                         makePredicate<T, double>(column->number, op, number));
+    this->conditions.insert(this->conditions.begin() + this->numberFilters, name + " " + op + " " + value);
+    this->numberFilters++;
+}
+
+template <typename T>
+vector<string> TableQuery<T>::getColumns() const
+{
+    vector<string> names;
+    for (auto column : this->projection)
+    {
+        names.push_back(column->name);
+    }
+    return names;
+}
+
+template <typename T>
+string TableQuery<T>::explain() const
+{
+    stringstream plan;
+    bool idBounded = this->firstId > 1 || this->lastId != LONG_MAX;
+    string idRange = to_string(this->firstId) + " to " +
+                     (this->lastId == LONG_MAX ? string("the last") : to_string(this->lastId));
+    plan << "table: " << QuerySchema<T>::name() << "\n";
+    if (!this->indexColumn.empty())
+    {
+        plan << "access: index of trips by " << this->indexColumn << " = " << this->indexKey << "\n";
+        if (idBounded)
+        {
+            plan << "filter: id from " << idRange << "\n";
+        }
+    }
+    else if (!this->rangeColumn.empty())
+    {
+        plan << "access: calendar of " << QuerySchema<T>::name() << " by " << this->rangeColumn << " from "
+             << (this->rangeFirst == LONG_MIN ? string("the first") : formatQueryDay(this->rangeFirst)) << " to "
+             << (this->rangeLast == LONG_MAX ? string("the last") : formatQueryDay(this->rangeLast)) << "\n";
+        if (idBounded)
+        {
+            plan << "filter: id from " << idRange << "\n";
+        }
+    }
+    else if (idBounded)
+    {
+        plan << "access: binary search for ids " << idRange << "\n";
+    }
+    else
+    {
+        plan << "access: scan of " << QuerySchema<T>::table(*this->database)->getRecords().size() << " records\n";
+    }
+    for (auto &condition : this->conditions)
+    {
+        plan << "filter: " << condition << "\n";
+    }
+    plan << "select:";
+    for (auto &name : this->getColumns())
+    {
+        plan << " " << name;
+    }
+    plan << "\n";
+    if (this->limit)
+    {
+        plan << "limit: " << this->limit << "\n";
+    }
+    return plan.str();
+}
+
+//Visits the matching records in the order of their ids, or of the index
+template <typename T>
+void TableQuery<T>::forEach(function<void(const T &)> visit) const
+{
+    size_t found = 0;
+    auto consider = [&](const T *record) {
+        if (!this->matches(*record))
+        {
+            return true;
+        }
+        visit(*record);
+        return !this->limit || ++found < this->limit;
+    };
+
+    if (!this->indexColumn.empty() || !this->rangeColumn.empty())
+    {
+        vector<const T *> indexed = !this->indexColumn.empty()
+            ? QuerySchema<T>::index(*this->database, this->indexColumn, this->indexKey)
+            : QuerySchema<T>::rangeIndex(*this->database, this->rangeColumn, this->rangeFirst, this->rangeLast);
+        for (auto record : indexed)
+        {
+            if (!consider(record))
+            {
+                return;
+            }
+        }
+        return;
+    }
+    const vector<T *> &records = QuerySchema<T>::table(*this->database)->getRecords();
+    auto record = lower_bound(records.begin(), records.end(), this->firstId,
+                              [](const T *record, long id) { return record->getRecord() < id; });
+    for (; record != records.end() && (*record)->getRecord() <= this->lastId; record++)
+    {
+        if (!consider(*record))
+        {
+            return;
+        }
+    }
+}
+
+//Whether the record passes the id bounds and every filter
+template <typename T>
+bool TableQuery<T>::matches(const T &record) const
+{
+    if (record.isDeleted() || record.getRecord() < this->firstId || record.getRecord() > this->lastId)
+    {
+        return false;
+    }
+    for (auto &filter : this->filters)
     {
-        tripStatus = "Completed";
-        cout << "End reading : " << this->endReading << endl;
-        cout << "Total run : " << this->endReading - this->startReading << endl;
-        cout << "Total fare : " << this->fare << endl;
+        if (!filter(record))
+        {
+            return false;
+        }
     }
+    return true;
+}
 
-    cout << "Trip status : " << tripStatus << endl;
+//True when forEach reads the whole table and stops at nothing, so the
+//records can as well be split up and matched on their own
+template <typename T>
+bool TableQuery<T>::scansTable() const
+{
+    return this->indexColumn.empty() && this->rangeColumn.empty() && !this->limit;
 }
 
-string Trip ::toString() const
+template <typename T>
+const QueryColumn<T> *TableQuery<T>::getColumn(const string &name) const throw(QueryError)
 {
-    stringstream ss;
-    ss << recordId << DELIMETER
-       << vehicle->getRecord() << DELIMETER
-       << user->getRecord() << DELIMETER
-       << startDate.toString() << DELIMETER
-       << endDate.toString() << DELIMETER
-       << startReading << DELIMETER
-       << endReading << DELIMETER
-       << fare << DELIMETER
-       << completed;
-    return ss.str();
+    return this->findColumn(name);
 }
 
-void Trip ::setDataFrom(Entity *s)
+template <typename T>
+void TableQuery<T>::run(function<void(const vector<string> &)> emit) const
 {
-    Trip *t = static_cast<Trip *>(s); // keyword
-    if (t)
+    vector<string> row(this->projection.size());
+    this->forEach([&](const T &record) {
+        for (size_t i = 0; i < this->projection.size(); i++)
+        {
+            row[i] = this->projection[i]->text(record);
+        }
+        emit(row);
+    });
+}
+
+template <typename T>
+TableUpdate<T>::TableUpdate(Database *database, const vector<string> &tokens, size_t set) throw(QueryError)
+    : selection(database, vector<string>(tokens.begin(), tokens.begin() + set))
+{
+    this->database = database;
+    size_t position = set + 1;
+    do
     {
-        this->vehicle = t->vehicle;
-        this->user = t->user;
-        this->startDate = t->startDate;
-        this->endDate = t->endDate;
-        this->startReading = t->startReading;
-        this->endReading = t->endReading;
-        this->fare = t->fare;
-        this->completed = t->completed;
+        if (position + 3 > tokens.size())
+        {
+            throw QueryError("expected a column, an operator and a value");
+        }
+        string name = tokens[position], op = tokens[position + 1], value = unquote(tokens[position + 2]);
+        position += 3;
+        Change change{nullptr, nullptr, op, 0, value};
+        for (auto &column : QuerySchema<T>::updateColumns())
+        {
+            if (name == column.name)
+            {
+                change.column = &column;
+            }
+        }
+        if (!change.column)
+        {
+            throw QueryError(string("column ") + name + " of " + QuerySchema<T>::name() + " cannot be set");
+        }
+        if (op != "=" && ((op != "+=" && op != "-=" && op != "*=") || change.column->kind != numberColumn))
+        {
+            throw QueryError("invalid operator " + op + " for " + name);
+        }
+        if (change.column->kind == numberColumn)
+        {
+            char *end;
+            change.number = strtod(value.c_str(), &end);
+            if (value.empty() || *end)
+            {
+                throw QueryError("invalid number " + value);
+            }
+            change.current = this->selection.getColumn(name);
+        }
+        this->changes.push_back(change);
+    } while (position < tokens.size() && tokens[position] == "," && position++);
+    if (position < tokens.size())
+    {
+        throw QueryError("unexpected " + tokens[position]);
     }
 }
 
-template<typename T>
-Table<T> ::Table(string filename) throw (MemoryError){
-    this->fileName = filename;
+template <typename T>
+void TableUpdate<T>::apply(T &record) const throw(QueryError)
+{
+    for (auto &change : this->changes)
+    {
+        if (change.column->kind != numberColumn)
+        {
+            change.column->setText(record, change.text);
+            continue;
+        }
+        double number = change.number;
+        if (change.op != "=")
+        {
+            double current = change.current->number(record);
+            number = change.op == "+=" ? current + number : change.op == "-=" ? current - number : current * number;
+        }
+        change.column->setNumber(record, number);
+    }
 }
 
-template<typename T>
-long Table<T>::getNextRecordId() const{
-    return this->records.size()+1;
+//Adds the changed copy of a matching record, unless the change leaves it as it was
+template <typename T>
+void TableUpdate<T>::collect(const T &record, vector<T> &updated) const throw(QueryError)
+{
+    T copy(record);
+    this->apply(copy);
+    string before, after;
+    RecordCodec<T>::format(record, before);
+    RecordCodec<T>::format(copy, after);
+    if (before != after)
+    {
+        updated.push_back(copy);
+    }
 }
 
-template<typename T>
-const T* const Table<T>::addNewRecord(T record) throw (MemoryError, IOError){
-    T *newRecord = new T(record);
-    if(!newRecord){
-        throw new MemoryError();
-    }
-    newRecord->recordId = this->getNextRecordId();
-    this->records.push_back(newRecord);
-    try{
-        this->writeToFile();
-    } catch(IOError error){
-        this->records.pop_back();
-        delete newRecord;
-        throw;
+template <typename T>
+string TableUpdate<T>::explain() const
+{
+    stringstream plan;
+    plan << this->selection.explain();
+    for (auto &change : this->changes)
+    {
+        plan << "set: " << change.column->name << " " << change.op << " " << change.text << "\n";
     }
-    return newRecord;
+    return plan.str();
 }
 
-template<typename T>
-void Table<T> :: updateRecord(T updatedRecord) throw (IOError,RecordNotFoundError){
-    for(int i=0;i<records.size();i++){
-        if(records[i]->getRecord()==updatedRecord.getRecord()){
-            T *pointerToRecord = dynamic_cast<T*>(records[i]);
-            if(pointerToRecord){
-                T oldRecord = T(*pointerToRecord);
-                records[i]->setDataFrom(&updatedRecord);
-                try{
-                    this->writeToFile();
-                    return;
+//Works out every changed record first, on several threads when the whole
+//of a large table is matched, and then has the database apply them. An
+//error in any record leaves all of them unchanged.
+template <typename T>
+size_t TableUpdate<T>::run(unsigned threads) throw(QueryError, IOError, RecordNotFoundError)
+{
+    TRACE_SPAN("TableUpdate::run");
+    // the records are read as they are after outside changes
+    this->database->applyFileChanges();
+    const vector<T *> &records = QuerySchema<T>::table(*this->database)->getRecords();
+    vector<T> updated;
+    if (threads > 1 && records.size() >= PARALLELUPDATERECORDS && this->selection.scansTable())
+    {
+        size_t chunk = (records.size() + threads - 1) / threads;
+        vector<vector<T>> parts(threads);
+        vector<exception_ptr> errors(threads);
+        vector<thread> workers;
+        for (unsigned part = 0; part < threads; part++)
+        {
+            workers.emplace_back([&, part]() {
+                try
+                {
+                    for (size_t i = part * chunk; i < min(records.size(), (part + 1) * chunk); i++)
+                    {
+                        if (this->selection.matches(*records[i]))
+                        {
+                            this->collect(*records[i], parts[part]);
+                        }
+                    }
                 }
-                catch(IOError error){
-                    records[i]->setDataFrom(&oldRecord);
+                catch (...)
+                {
+                    errors[part] = current_exception();
+                }
+            });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        for (unsigned part = 0; part < threads; part++)
+        {
+            if (errors[part])
+            {
+                try
+                {
+                    rethrow_exception(errors[part]);
+                }
+                catch (QueryError error)
+                {
                     throw;
                 }
+                catch (...)
+                {
+                    throw QueryError("the update failed");
+                }
             }
+            updated.insert(updated.end(), parts[part].begin(), parts[part].end());
         }
     }
-    throw RecordNotFoundError();
+    else
+    {
+        this->selection.forEach([&](const T &record) { this->collect(record, updated); });
+    }
+    this->database->updateRecords(updated);
+    return updated.size();
 }
 
-template<typename T>
-void Table<T>:: writeToFile() throw(IOError){
-    this->fileStream.open(fileName,ios::out|ios::trunc);
-    if(!this->fileStream){
-        throw IOError();
+//Compiles a set-based update, the caller deletes it
+Update *Database ::compileUpdate(const string &text) throw(QueryError)
+{
+    TRACE_SPAN("Database::compileUpdate");
+    vector<string> tokens = tokenizeQuery(text);
+    auto set = find(tokens.begin(), tokens.end(), "set");
+    if (tokens.empty() || set == tokens.end())
+    {
+        throw QueryError("an update needs a set clause");
     }
-    for(auto record: records){
-        fileStream<<record->toString()<<endl;
+    if (tokens[0] == QuerySchema<Vehicle>::name())
+    {
+        return new TableUpdate<Vehicle>(this, tokens, set - tokens.begin());
     }
-    this->fileStream.close();
-}
-
-template<typename T>
-const T* const Table<T>::getRecordForId(long recordID) const throw(RecordNotFoundError){
-    try{
-        return this->getReferenceOfRecordForId(recordID);
+    if (tokens[0] == QuerySchema<User>::name())
+    {
+        return new TableUpdate<User>(this, tokens, set - tokens.begin());
     }
-    catch(RecordNotFoundError err){
-        throw;
+    if (tokens[0] == QuerySchema<Trip>::name())
+    {
+        return new TableUpdate<Trip>(this, tokens, set - tokens.begin());
     }
+    throw QueryError("no table " + tokens[0]);
 }
 
-template<typename T>
-T* Table<T>::getReferenceOfRecordForId(long recordId) const throw (RecordNotFoundError){
-    for(auto record: records){
-        if(record->getRecord() == recordId){
-            return dynamic_cast<T*>(record);
-        }
-    }
-    throw RecordNotFoundError();
+//Runs a set-based update once and returns the number of records it changed
+size_t Database ::updateWhere(const string &text, unsigned threads) throw(QueryError, IOError, RecordNotFoundError)
+{
+    RecordedCall call(callUpdateWhere);
+    call.text(text);
+    call.number(threads);
+    TRACE_SPAN("Database::updateWhere");
+    unique_ptr<Update> update(this->compileUpdate(text));
+    return update->run(threads);
 }
 
-Database ::Database() throw(IOError, MemoryError)
+//Compiles a query for repeated runs, the caller deletes it
+Query *Database ::compileQuery(const string &text) const throw(QueryError)
 {
-    try
+    TRACE_SPAN("Database::compileQuery");
+    vector<string> tokens = tokenizeQuery(text);
+    if (tokens.empty())
     {
-        this->vehicleTable = new Table<Vehicle>("vehicle.txt");
-        this->userTable = new Table<User>("users.txt");
-        this->tripTable = new Table<Trip>("trips.txt");
-
-        this->fetchAllVehicles();
-        this->fetchAllUsers();
-        this->fetchAllTrips();
+        throw QueryError("empty query");
     }
-    catch (...)
+    if (tokens[0] == QuerySchema<Vehicle>::name())
     {
-        throw;
+        return new TableQuery<Vehicle>(this, tokens);
     }
-}
-
-void Database ::fetchAllVehicles() throw(IOError, MemoryError)
-{
-    this->vehicleTable->fileStream.open(this->vehicleTable->fileName);
-
-    if (!this->vehicleTable->fileStream)
+    if (tokens[0] == QuerySchema<User>::name())
     {
-        throw IOError();
+        return new TableQuery<User>(this, tokens);
     }
-    for (string line; getline(this->vehicleTable->fileStream, line);)
+    if (tokens[0] == QuerySchema<Trip>::name())
     {
-        vector<string> components = split(line, DELIMETER);
-
-        auto recordId = stol(components[0]);
-        auto registrationNumber = components[1];
-        auto type = VehicleType(stoi(components[2]));
-        auto seats = stoi(components[3]);
-        auto companyName = components[4];
-        auto pricePerKm = stod(components[5]);
-        auto PUCExpirationDate = Date(components[6]);
+        return new TableQuery<Trip>(this, tokens);
+    }
+    throw QueryError("no table " + tokens[0]);
+}
 
-        Vehicle *record = new Vehicle(registrationNumber, type, seats, companyName, pricePerKm, PUCExpirationDate, recordId);
-        if (!record)
+ShardedDatabase ::ShardedDatabase(string location) throw(IOError, MemoryError)
+{
+    this->location = location;
+    this->vehicleIds = 0;
+    this->tripIds = 0;
+    this->root = new Database(location);
+    try
+    {
+        // the shards that exist are listed in the manifest
+        ifstream manifest(location + "shards.txt");
+        if (!manifest)
+        {
+            throw IOError();
+        }
+        for (string key; getline(manifest, key);)
         {
-            throw MemoryError();
+            key = trimRecord(key);
+            if (!key.empty())
+            {
+                this->getShard(key, false);
+            }
         }
-        this->vehicleTable->records.push_back(record);
     }
-
-    this->vehicleTable->fileStream.close();
+    catch (Error error)
+    {
+        this->cleanUp();
+        throw;
+    }
 }
 
-void Database ::fetchAllUsers() throw(IOError, MemoryError)
+ShardedDatabase ::~ShardedDatabase()
 {
-    this->userTable->fileStream.open(this->userTable->fileName);
+    this->cleanUp();
+}
 
-    if (!this->userTable->fileStream)
+void ShardedDatabase ::cleanUp()
+{
+    for (auto &shard : this->shards)
     {
-        throw IOError();
+        delete shard.second->db;
+        delete shard.second;
     }
+    this->shards.clear();
+    delete this->root;
+    this->root = nullptr;
+}
 
-    for (string line; getline(this->userTable->fileStream, line);)
+//Shard of a registration number: its first characters, upper cased, with
+//anything that cannot be part of a file name replaced
+string ShardedDatabase ::shardKey(string registrationNo)
+{
+    string key = registrationNo.substr(0, SHARDKEYLENGTH);
+    for (auto &c : key)
     {
-        vector<string> components = split(line, DELIMETER);
-        auto recordId = stoi(components[0]);
-        auto name = components[1];
-        auto contact = components[2];
-        auto email = components[3];
-
-        User *record = new User(name, contact, email, recordId);
-        if (!record)
-        {
-            throw MemoryError();
-        }
-        this->userTable->records.push_back(record);
+        c = isalnum(c) ? toupper(c) : '_';
     }
+    return key.empty() ? "_" : key;
+}
 
-    this->userTable->fileStream.close();
+string ShardedDatabase ::shardLocation(string location, string key)
+{
+    return location + "shard." + key + ".";
 }
 
-void Database ::fetchAllTrips() throw(IOError, MemoryError)
+//Opens the shard, creating its files and adding it to the manifest when
+//create is set and it does not exist yet
+ShardedDatabase::Shard *ShardedDatabase ::getShard(string key, bool create) throw(IOError, MemoryError, RecordNotFoundError)
 {
-    this->tripTable->fileStream.open(this->tripTable->fileName);
-    if (!this->tripTable->fileStream)
+    lock_guard<mutex> guard(this->shardsLock);
+    auto existing = this->shards.find(key);
+    if (existing != this->shards.end())
     {
-        throw IOError();
+        return existing->second;
     }
-
-    for (string line; getline(this->tripTable->fileStream, line);)
+    string shardLocation = ShardedDatabase::shardLocation(this->location, key);
+    if (create)
     {
-        vector<string> components = split(line, DELIMETER);
-
-        try
-        {
-            auto recordID = stoi(components[0]);
-            auto vehiclePtr = this->vehicleTable->getReferenceOfRecordForId(stoi(components[1]));
-            auto userPtr = this->userTable->getReferenceOfRecordForId(stoi(components[2]));
-            auto startDate = Date(components[3]);
-            auto endDate = Date(components[4]);
-            auto startReading = stol(components[5]);
-            auto endReading = stol(components[6]);
-            auto fare = stod(components[7]);
-            auto isCompleted = components[8] == "0" ? false : true;
-
-            Trip *record = new Trip(vehiclePtr, userPtr, startDate, endDate, recordID, startReading, endReading, fare, isCompleted);
-            if (!record)
-            {
-                throw MemoryError();
-            }
-            this->tripTable->records.push_back(record);
-        }
-        catch (...)
+        ofstream vehicles(shardLocation + "vehicle.txt", ios::app);
+        ofstream trips(shardLocation + "trips.txt", ios::app);
+        ofstream manifest(this->location + "shards.txt", ios::app);
+        manifest << key << "\n";
+        if (!vehicles || !trips || !manifest)
         {
+            throw IOError();
         }
     }
-
-    this->tripTable->fileStream.close();
+    // nothing is left behind when opening the shard or adding it fails
+    unique_ptr<Database> db(new Database(shardLocation, this->root));
+    db->shareRecordIds(&this->vehicleIds, &this->tripIds);
+    unique_ptr<Shard> shard(new Shard());
+    shard->db = db.get();
+    this->shards[key] = shard.get();
+    db.release();
+    return shard.release();
 }
 
-const Vehicle *const Database ::getVehicle(string RegistrationNo)
-    const throw(RecordNotFoundError)
+//Writes the vehicles, trips and archived trips of source partitioned into
+//shards, and its users, to location
+void ShardedDatabase ::split(const Database &source, string location) throw(IOError)
 {
-    for (auto record : this->vehicleTable->records)
-    {
-        Vehicle *vehicle = dynamic_cast<Vehicle *>(record);
-        if (vehicle)
+    map<string, pair<ofstream *, ofstream *>> files;
+    ofstream users(location + "users.txt", ios::trunc);
+    ofstream vehicles(location + "vehicle.txt", ios::trunc);
+    ofstream trips(location + "trips.txt", ios::trunc);
+    ofstream manifest(location + "shards.txt", ios::trunc);
+    bool failed = !users || !vehicles || !trips || !manifest;
+
+    auto filesFor = [&](string registrationNo) {
+        string key = shardKey(registrationNo);
+        if (!files.count(key))
         {
-            if (vehicle->getRegistrationNumber() == RegistrationNo)
-            {
-                return vehicle;
-            }
+            string shardLocation = ShardedDatabase::shardLocation(location, key);
+            files[key] = make_pair(new ofstream(shardLocation + "vehicle.txt", ios::trunc),
+                                   new ofstream(shardLocation + "trips.txt", ios::trunc));
+            manifest << key << "\n";
         }
+        return files[key];
+    };
+    source.forEachUser([&](const User &user) {
+        users << user.toString() << "\n";
+    });
+    map<long, string> registrations;
+    source.vehicles().forEach([&](const Vehicle &vehicle) {
+        *filesFor(vehicle.getRegistrationNumber()).first << vehicle.toString() << "\n";
+        registrations[vehicle.getRecord()] = vehicle.getRegistrationNumber();
+    });
+    source.trips().forEach([&](const Trip &trip) {
+        *filesFor(trip.getVehicle().getRegistrationNumber()).second << trip.toString() << "\n";
+    });
+    for (auto &file : files)
+    {
+        failed = failed || !*file.second.first || !*file.second.second;
+        delete file.second.first;
+        delete file.second.second;
+    }
+    if (failed || !users || !manifest)
+    {
+        throw IOError();
     }
-    throw RecordNotFoundError();
-}
 
-const User *const Database ::getUser(string contactNo) const throw(RecordNotFoundError)
-{
-    for (auto record : this->userTable->records)
+    // archived trips go with their vehicle, those of vehicles that are gone
+    // stay in the root location
+    map<string, vector<ArchivedTrip>> archives;
+    source.forEachArchivedTrip([&](const ArchivedTrip &trip) {
+        auto registration = registrations.find(trip.vehicleId);
+        string prefix = registration == registrations.end()
+                            ? location
+                            : ShardedDatabase::shardLocation(location, shardKey(registration->second));
+        archives[prefix + TRIPARCHIVEPREFIX].push_back(trip);
+    });
+    for (auto &archive : archives)
     {
-        User *user = dynamic_cast<User *>(record);
-        if (user)
-        {
-            if (user->getContact() == contactNo)
-            {
-                return user;
-            }
-        }
+        sort(archive.second.begin(), archive.second.end(),
+             [](const ArchivedTrip &a, const ArchivedTrip &b) { return a.recordId < b.recordId; });
+        TripArchive(archive.first).addSegment(archive.second);
     }
-    throw RecordNotFoundError();
 }
 
-const vector<const Vehicle *> Database ::getVehicle(Date startDate, Date endDate, VehicleType type) const
+const User *ShardedDatabase ::getUser(string contactNo) throw(RecordNotFoundError)
 {
-    vector<const Vehicle *> vehicles = vector<const Vehicle *>();
+    lock_guard<shared_timed_mutex> guard(this->usersLock);
+    return this->root->getUser(contactNo);
+}
 
-    for (auto vrecord : this->vehicleTable->records)
+void ShardedDatabase ::addUser(User *user) throw(IOError, MemoryError)
+{
+    lock_guard<shared_timed_mutex> guard(this->usersLock);
+    this->root->addNewRecord(user);
+}
+
+//Runs the operation while the shared users cannot change. Shards only share
+//the lock when their reads leave the user table as it is.
+void ShardedDatabase ::withUsers(function<void()> operation)
+{
+    if (PAGEDUSERS)
     {
-        Vehicle *vehicle = dynamic_cast<Vehicle *>(vrecord);
-        if (vehicle && vehicle->getVehicleType() == type)
-        {
-            bool tripFound = false;
-            for (auto trecord : (this->tripTable->records))
-            {
-                Trip *trip = dynamic_cast<Trip *>(trecord);
-                if (trip &&
-                    !trip->isCompleted() &&
-                    trip->getVehicle().getRecord() == vehicle->getRecord() &&
-                    !(trip->getStartDate() >= endDate &&
-                    trip->getEndDate() >= endDate) &&
-                    !(trip->getStartDate() <= startDate && 
-                    trip->getEndDate() <= startDate)
-                    )
-                {
-                    tripFound = true;
-                    break;
-                }
-            }
-            if (!tripFound)
-            {
-                vehicles.push_back(vehicle);
-            }
-        }
+        lock_guard<shared_timed_mutex> guard(this->usersLock);
+        operation();
+    }
+    else
+    {
+        shared_lock<shared_timed_mutex> guard(this->usersLock);
+        operation();
     }
-    return vehicles;
 }
 
-void Database ::cleanUp()
+void ShardedDatabase ::addVehicle(Vehicle *vehicle) throw(IOError, MemoryError)
 {
-    delete this->vehicleTable;
-    delete this->userTable;
-    delete this->tripTable;
+    Shard *shard = this->getShard(shardKey(vehicle->getRegistrationNumber()), true);
+    this->withUsers([&]() {
+        lock_guard<mutex> guard(shard->lock);
+        shard->db->addNewRecord(vehicle);
+    });
 }
 
-Database ::~Database()
+//Runs the operation on the shard of the registration number while holding
+//only that shard's lock and a shared hold on the users
+void ShardedDatabase ::withShard(string registrationNo, function<void(Database &)> operation) throw(IOError, MemoryError, RecordNotFoundError)
 {
-    this->cleanUp();
+    Shard *shard = this->getShard(shardKey(registrationNo), false);
+    this->withUsers([&]() {
+        lock_guard<mutex> guard(shard->lock);
+        operation(*shard->db);
+    });
 }
 
-const Table<Vehicle> *const Database ::getVehicleRef() const
+//Searches every shard in parallel and merges the results in shard order
+const vector<const Vehicle *> ShardedDatabase ::getVehicle(Date startDate, Date endDate, VehicleType type)
 {
-    return this->vehicleTable;
+    vector<Shard *> shards;
+    {
+        lock_guard<mutex> guard(this->shardsLock);
+        for (auto &shard : this->shards)
+        {
+            shards.push_back(shard.second);
+        }
+    }
+    vector<future<vector<const Vehicle *>>> searches;
+    for (auto shard : shards)
+    {
+        searches.push_back(async(launch::async, [=]() {
+            vector<const Vehicle *> found;
+            this->withUsers([&]() {
+                lock_guard<mutex> guard(shard->lock);
+                found = shard->db->getVehicle(startDate, endDate, type);
+            });
+            return found;
+        }));
+    }
+    vector<const Vehicle *> vehicles;
+    for (auto &search : searches)
+    {
+        auto found = search.get();
+        vehicles.insert(vehicles.end(), found.begin(), found.end());
+    }
+    return vehicles;
 }
 
-const Table<User> *const Database ::getUserRef() const
+LogFollower ::LogFollower(string location) throw(IOError, MemoryError)
 {
-    return this->userTable;
+    this->location = location;
+    this->epoch = 0;
+    this->offset = 0;
+    // the header is read before the files, a primary restarting in between
+    // then shows up as a new epoch and the replica is loaded again
+    ifstream log(location + "mutations.log", ios::binary);
+    if (log)
+    {
+        this->readHeader(log, this->epoch, this->offset);
+    }
+    this->replica = new Database(location, nullptr, true);
+    this->sequence = 0;
+    this->stopping = false;
+    this->poll();
+    this->worker = thread(&LogFollower::run, this);
 }
 
-const Table<Trip> *const Database ::getTripRef() const
+LogFollower ::~LogFollower()
 {
-    return this->tripTable;
+    this->stopping = true;
+    this->worker.join();
+    delete this->replica;
 }
 
-template <class T>
-void Database ::addNewRecord(T *record) throw(IOError, MemoryError)
+void LogFollower ::run()
 {
-    try
+    while (!this->stopping)
     {
-        Vehicle *v = dynamic_cast<Vehicle *>(record);
-        if (v)
-        {
-            auto savedRecord = this->vehicleTable->addNewRecord(*v);
-            record->recordId = savedRecord->recordId;
-            return;
-        }
-
-        User *u = dynamic_cast<User *>(record);
-        if (u)
+        this_thread::sleep_for(chrono::milliseconds(FOLLOWERPOLLMILLISECONDS));
+        try
         {
-            auto savedRecord = this->userTable->addNewRecord(*u);
-            record->recordId = savedRecord->recordId;
-            return;
+            this->poll();
         }
-        Trip *t = dynamic_cast<Trip *>(record);
-        if (t)
+        catch (Error error)
         {
-            auto savedRecord = this->tripTable->addNewRecord(*t);
-            record->recordId = savedRecord->recordId;
-            return;
+            // the primary may be rewriting its files, try again next time
         }
     }
-    catch (...)
-    {
-        throw;
-    }
 }
 
-template <class T>
-void Database ::updateRecord(T *record) throw(IOError, RecordNotFoundError)
+//Reads the epoch of a log and where its entries start, false while the
+//header is missing or still being written
+bool LogFollower ::readHeader(ifstream &log, long long &epoch, streamoff &start)
 {
-    try
+    string header;
+    if (!getline(log, header) || log.eof() || header.compare(0, 6, "epoch;") != 0)
     {
-        Vehicle *v = dynamic_cast<Vehicle *>(record);
-        if (v)
-        {
-            this->vehicleTable->updateRecord(*v);
-            return;
-        }
+        return false;
+    }
+    epoch = atoll(header.c_str() + 6);
+    start = header.length() + 1;
+    return true;
+}
 
-        User *u = dynamic_cast<User *>(record);
-        if (u)
-        {
-            this->userTable->updateRecord(*u);
-            return;
-        }
+//Loads the replica again from the data files and follows the log from its
+//first entry
+void LogFollower ::reload(long long epoch, streamoff start) throw(IOError, MemoryError)
+{
+    Database *fresh = new Database(this->location, nullptr, true);
+    lock_guard<mutex> guard(this->lock);
+    delete this->replica;
+    this->replica = fresh;
+    this->epoch = epoch;
+    this->offset = start;
+    this->sequence = 0;
+}
 
-        Trip *t = dynamic_cast<Trip *>(record);
-        if (t)
+//Applies the complete lines that were appended to the log since the last
+//poll. A new epoch means the primary restarted and began a new log, an
+//entry that does not follow the last one means the log was not the one
+//applied so far, and an entry that cannot be applied would leave the replica
+//behind the primary. Each time the replica is loaded again from the data files.
+void LogFollower ::poll()
+{
+    ifstream log(this->location + "mutations.log", ios::binary);
+    long long epoch;
+    streamoff start;
+    if (!log || !this->readHeader(log, epoch, start))
+    {
+        return;
+    }
+    log.seekg(0, ios::end);
+    streamoff size = log.tellg();
+    if (epoch != this->epoch || size < this->offset)
+    {
+        this->reload(epoch, start);
+    }
+    if (size == this->offset)
+    {
+        return;
+    }
+    log.seekg(this->offset);
+    string pending(size - this->offset, '\0');
+    log.read(&pending[0], pending.length());
+    // a line that is still being written is left for the next poll
+    size_t complete = pending.rfind('\n');
+    if (complete == string::npos)
+    {
+        return;
+    }
+    bool broken = false;
+    {
+        lock_guard<mutex> guard(this->lock);
+        size_t begin = 0;
+        while (begin <= complete)
         {
-            this->tripTable->updateRecord(*t);
-            return;
+            size_t end = pending.find('\n', begin);
+            string entry = pending.substr(begin, end - begin);
+            if (atol(entry.c_str()) != this->sequence + 1 || this->replica->applyLogEntry(entry) == 0)
+            {
+                broken = true;
+                break;
+            }
+            this->sequence++;
+            begin = end + 1;
         }
+        this->offset += begin;
     }
-    catch (...)
+    if (broken)
     {
-        throw;
+        this->reload(epoch, start);
     }
 }
 
+long LogFollower ::getSequence()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->sequence;
+}
+
+void LogFollower ::query(function<void(const Database &)> read)
+{
+    lock_guard<mutex> guard(this->lock);
+    read(*this->replica);
+}
+
 Application::Application(){
-    try{
-        this->db = new Database();
-    }
-    catch(Error e){
-        cout<<e.getMessage();
-        exit(EXIT_FAILURE);
+    this->db = nullptr;
+}
+
+//Read-only databases never archive, convert or write their files, so they
+//can be opened next to a running menu
+void Application::openDatabase(bool readOnly) throw(IOError, MemoryError){
+    if(!this->db){
+        this->db = new Database("", nullptr, readOnly);
     }
 }
 
@@ -1015,6 +10186,13 @@ void Application::gotoXY(int x, int y) const{
 void Application::renderMenu(){
     char choice = 1;
     while(true){
+        // what other programs changed in the files since the last choice
+        try{
+            this->db->applyFileChanges();
+        }
+        catch(Error e){
+            // written again with the next change
+        }
         system("cls");
         gotoXY(25,4);
         cout<<"Select Any option from below";
@@ -1035,7 +10213,13 @@ void Application::renderMenu(){
         gotoXY(25,12);
         cout<<"8. Complete Trip";
         gotoXY(25,13);
-        cout<<"9. Exit";
+        cout<<"9. Back Up Data";
+        gotoXY(25,14);
+        cout<<"0. Exit";
+        if(this->backup.valid()){
+            gotoXY(25,17);
+            cout<<"Backup to "<<this->backupLocation<<": "<<this->getBackupStatus();
+        }
 
         gotoXY(30,15);
         cout<<"Enter your Choice: ";
@@ -1068,6 +10252,9 @@ void Application::renderMenu(){
                 this->renderCompleteTripMenu();
                 break;
             case '9':
+                this->renderBackupMenu();
+                break;
+            case '0':
                 this->cleanMemory();
                 system("cls");
                 exit(EXIT_SUCCESS);
@@ -1250,7 +10437,7 @@ void Application::renderAddNewTripMenu() const{
         try{
             trip = 
             new Trip(this->db->getVehicleRef()->getRecordForId(vehicleID)
-                    ,this->db->getUserRef()->getRecordForId(userId)
+                    ,this->db->getUserForId(userId)
                     ,Date(startDate),Date(endDate));
             this->db->addNewRecord(trip);
             stringstream ss;    
@@ -1276,6 +10463,17 @@ void Application::renderViewTripMenu() const{
         cout<<endl;
         system("pause");
     }
+    catch(RecordNotFoundError e){
+        // old completed trips are no longer in the table but in the archive
+        try{
+            this->db->getArchivedTrip(tripId).display();
+            cout<<endl;
+            system("pause");
+        }
+        catch(Error e){
+            this->showDialog(e.getMessage());
+        }
+    }
     catch(Error e){
         this->showDialog(e.getMessage());
     }
@@ -1287,12 +10485,18 @@ void Application::renderStartTripMenu() const{
     system("cls");
     cout<<"Enter Trip id: ";
     cin>>tripId;
-    cout<<"Enter Odometer(distance) reading: ";
-    cin>>initialReading;
 
     Trip *newTrip;
     try{
         auto trip = this->db->getTripRef()->getRecordForId(tripId);
+        // the vehicle's telemetry knows the reading, otherwise ask for it
+        if(this->db->getTelemetry().getOdometer(trip->getVehicle().getRecord(), initialReading)){
+            cout<<"Odometer(distance) reading from telemetry: "<<initialReading<<"\n";
+        }
+        else{
+            cout<<"Enter Odometer(distance) reading: ";
+            cin>>initialReading;
+        }
         newTrip = new Trip(*trip);
         newTrip->startTrip(initialReading);
         this->db->updateRecord(newTrip);
@@ -1327,6 +10531,37 @@ void Application::renderCompleteTripMenu() const{
     }
 }
 
+//Starts a backup and goes back to the menu while it is written, the menu
+//shows how it went
+void Application::renderBackupMenu(){
+    string location;
+    system("cls");
+    gotoXY(0,1);
+    cout<<"Enter the location to back up to, for example backup/: ";
+    getline(cin,location);
+    try{
+        this->backup = this->db->startBackup(location);
+        this->backupLocation = location;
+        showDialog("Backup started, the menu shows when it is done: ",location);
+    }
+    catch(Error e){
+        showDialog(e.getMessage());
+    }
+}
+
+string Application::getBackupStatus() const{
+    if(this->backup.wait_for(chrono::seconds(0)) != future_status::ready){
+        return "running";
+    }
+    try{
+        this->backup.get();
+        return "done";
+    }
+    catch(Error e){
+        return "failed, " + e.getMessage();
+    }
+}
+
 void Application::showDialog(string message, string id) const {
     cout<<"\n\n";
     cout<<message<<"\n";
@@ -1345,9 +10580,584 @@ void Application::welcome(){
 }
 
 void Application::start(){
+    try{
+        this->openDatabase(false);
+        if(SHIPMUTATIONLOG){
+            this->db->shipMutations();
+        }
+    }
+    catch(Error e){
+        cout<<e.getMessage();
+        exit(EXIT_FAILURE);
+    }
+    if(HOTRELOAD){
+        this->db->watchFiles();
+    }
+    this->db->watchTelemetry();
     welcome();
 }
 
+int Application::printUsage() const{
+    cerr<<"Usage:\n"
+        <<"  OOPsFinal                                 start the menu\n"
+        <<"  OOPsFinal export-trips <csv|json> [file]  export trips with their vehicle and user\n"
+        <<"  OOPsFinal import <vehicles|users> <file> [rejects] [threads]\n"
+        <<"                                            import a partner CSV feed\n"
+        <<"  OOPsFinal shard-split <location>          partition the data into shards\n"
+        <<"  OOPsFinal shard-available <location> <start> <end> <type>\n"
+        <<"                                            search all shards for free vehicles\n"
+        <<"  OOPsFinal book-batch <file>               book a CSV batch of \"contact,start,end,type\"\n"
+        <<"  OOPsFinal delete <vehicle|user|trip> <registration|contact|id>\n"
+        <<"                                            delete a record without trips\n"
+        <<"  OOPsFinal search <users|vehicles> <text> [limit]\n"
+        <<"                                            find users by part of the name or email and\n"
+        <<"                                            vehicles by part of the registration number\n"
+        <<"  OOPsFinal list <vehicles|users|trips> [size] [after]\n"
+        <<"                                            print a page of records, size 20 by default,\n"
+        <<"                                            starting after the record id a page ended on\n"
+        <<"  OOPsFinal day [date]                      trips starting, ending and on the road on a day,\n"
+        <<"                                            today when no date is given\n"
+        <<"  OOPsFinal query <query>                   print the rows a query selects, for example\n"
+        <<"                                            vehicles where seats > 30 select registration\n"
+        <<"  OOPsFinal explain <query|update>          show how a query or an update would be run\n"
+        <<"  OOPsFinal update <table> [where ...] set <column> <op> <value>[, ...]\n"
+        <<"                                            change every record a query selects at once,\n"
+        <<"                                            op one of = += -= *=, for example\n"
+        <<"                                            vehicles where type = car set price *= 1.05\n"
+        <<"  OOPsFinal replay-telemetry <file> [rate] [producers]\n"
+        <<"                                            feed \"registration;odometer;timestamp\" readings\n"
+        <<"                                            at rate per second, 0 for as fast as possible\n"
+        <<"  OOPsFinal replay-workload <trace> [speed] [threads]\n"
+        <<"                                            run the calls recorded with "<<WORKLOADENVIRONMENT<<"=<trace> again\n"
+        <<"                                            on a copy of the files, speed 0 for as fast as\n"
+        <<"                                            possible, 1 for the recorded timing\n"
+        <<"  OOPsFinal backup <location>               copy the data as it is now to location, for\n"
+        <<"                                            example backup/, without writing to it. The\n"
+        <<"                                            menu's Back Up Data keeps serving meanwhile\n"
+        <<"  OOPsFinal bench-async [requests] [clients]\n"
+        <<"                                            compare serving lookups and bookings from one\n"
+        <<"                                            event loop with a thread per request, on a copy\n"
+        <<"                                            of the files\n"
+        <<"  OOPsFinal follow <location>               serve read-only queries from stdin on a\n"
+        <<"                                            replica of the database at location\n"
+        <<"  OOPsFinal self-check <location>           run the storage checks on scratch files at\n"
+        <<"                                            location, the data files are not touched\n";
+    return EXIT_FAILURE;
+}
+
+//Runs one command given on the command line without the menu and returns
+//the exit status of the program
+int Application::runCommand(vector<string> arguments){
+    int status = EXIT_SUCCESS;
+    try{
+        string command = arguments[0];
+        // only the commands that change the data open it for writing, the
+        // others can run next to the menu without touching its files.
+        // follow, shard-available and self-check use other locations.
+        static const set<string> writers = {"import", "book-batch", "delete", "update",
+                                            "replay-telemetry", "replay-workload", "bench-async"};
+        static const set<string> readers = {"export-trips", "shard-split", "search", "list",
+                                            "day", "query", "explain", "backup"};
+        if(writers.count(command) || readers.count(command)){
+            this->openDatabase(readers.count(command) > 0);
+        }
+        if(command == "export-trips" && arguments.size() >= 2){
+            ExportFormat format;
+            if(arguments[1] == "csv"){
+                format = csvFormat;
+            }
+            else if(arguments[1] == "json"){
+                format = jsonLinesFormat;
+            }
+            else{
+                return this->printUsage();
+            }
+            // without a file (or with "-") the trips go to stdout
+            FILE *out = stdout;
+            if(arguments.size() >= 3 && arguments[2] != "-"){
+                out = fopen(arguments[2].c_str(), "wb");
+                if(!out){
+                    throw IOError();
+                }
+            }
+            TripExporter exporter(out, format);
+            try{
+                this->db->exportTrips(exporter);
+            }
+            catch(IOError e){
+                if(out != stdout){
+                    fclose(out);
+                }
+                throw;
+            }
+            if(out != stdout && fclose(out) != 0){
+                throw IOError();
+            }
+        }
+        else if(command == "import" && arguments.size() >= 3 &&
+                (arguments[1] == "vehicles" || arguments[1] == "users")){
+            ifstream in(arguments[2]);
+            ofstream rejects(arguments.size() >= 4 ? arguments[3] : arguments[2] + ".rejects");
+            if(!in || !rejects){
+                throw IOError();
+            }
+            unsigned threads = arguments.size() >= 5 ? max(1, atoi(arguments[4].c_str())) : thread::hardware_concurrency();
+            ImportReport report = arguments[1] == "vehicles"
+                ? this->db->importVehicles(in, rejects, threads)
+                : this->db->importUsers(in, rejects, threads);
+            cout<<"Imported: "<<report.imported<<"\n"
+                <<"Rejected: "<<report.rejected<<"\n";
+            if(report.imported){
+                cout<<"Record ids: "<<report.firstRecordId<<" - "<<report.lastRecordId<<"\n";
+            }
+        }
+        else if(command == "shard-split" && arguments.size() >= 2){
+            ShardedDatabase::split(*this->db, arguments[1]);
+        }
+        else if(command == "shard-available" && arguments.size() >= 5){
+            int type = atoi(arguments[4].c_str());
+            if(!isValidDate(arguments[2]) || !isValidDate(arguments[3]) || type < bike || type > bus){
+                return this->printUsage();
+            }
+            ShardedDatabase sharded(arguments[1]);
+            auto vehicles = sharded.getVehicle(Date(arguments[2]), Date(arguments[3]), VehicleType(type));
+            for(auto vehicle: vehicles){
+                cout<<vehicle->getRegistrationNumber()<<"\t"
+                    <<vehicle->getSeats()<<"\t"
+                    <<vehicle->getPricePerKm()<<"\t"
+                    <<vehicle->getCompanyName()<<"\n";
+            }
+        }
+        else if(command == "book-batch" && arguments.size() >= 2){
+            ifstream in(arguments[1]);
+            if(!in){
+                throw IOError();
+            }
+            vector<BookingRequest> requests;
+            for(string line; getline(in,line);){
+                vector<string> fields = splitCsvLine(line);
+                if(trimRecord(line).empty() || fields.size() != 4){
+                    continue;
+                }
+                long userId = 0;
+                try{
+                    userId = this->db->getUser(fields[0])->getRecord();
+                }
+                catch(RecordNotFoundError e){
+                }
+                requests.push_back(BookingRequest{userId, Date(fields[1]), Date(fields[2]),
+                                                  VehicleType(atoi(fields[3].c_str()))});
+            }
+            auto results = this->db->bookBatch(requests);
+            long satisfied = 0;
+            for(size_t i = 0; i < results.size(); i++){
+                if(results[i].vehicle){
+                    satisfied++;
+                    cout<<i+1<<DELIMETER<<results[i].vehicle->getRegistrationNumber()
+                        <<DELIMETER<<results[i].tripId<<"\n";
+                }
+                else{
+                    cout<<i+1<<DELIMETER<<"REJECTED\n";
+                }
+            }
+            cerr<<"Booked "<<satisfied<<" of "<<results.size()<<" requests\n";
+        }
+        else if(command == "delete" && arguments.size() >= 3){
+            if(arguments[1] == "vehicle"){
+                Vehicle vehicle = *this->db->getVehicle(arguments[2]);
+                this->db->deleteRecord(&vehicle);
+            }
+            else if(arguments[1] == "user"){
+                User user = *this->db->getUser(arguments[2]);
+                this->db->deleteRecord(&user);
+            }
+            else if(arguments[1] == "trip"){
+                Trip trip = *this->db->getTripRef()->getRecordForId(atol(arguments[2].c_str()));
+                this->db->deleteRecord(&trip);
+            }
+            else{
+                return this->printUsage();
+            }
+            cerr<<"Deleted "<<arguments[1]<<" "<<arguments[2]<<"\n";
+        }
+        else if(command == "search" && arguments.size() >= 3){
+            size_t limit = arguments.size() >= 4 ? atol(arguments[3].c_str()) : 20;
+            if(arguments[1] == "vehicles"){
+                for(auto vehicle: this->db->searchVehicles(arguments[2], limit)){
+                    cout<<vehicle->toString()<<"\n";
+                }
+            }
+            else if(arguments[1] == "users"){
+                for(auto user: this->db->searchUsers(arguments[2], limit)){
+                    cout<<user->toString()<<"\n";
+                }
+            }
+            else{
+                return this->printUsage();
+            }
+        }
+        else if(command == "list" && arguments.size() >= 2){
+            size_t pageSize = arguments.size() >= 3 ? max(1, atoi(arguments[2].c_str())) : 20;
+            long after = arguments.size() >= 4 ? atol(arguments[3].c_str()) : 0;
+            //Prints one page and how to ask for the next one
+            auto print = [&](const auto &cursor, auto page){
+                long next = cursor.nextPage(pageSize, page);
+                for(auto record: page){
+                    cout<<record->toString()<<"\n";
+                }
+                if(next != 0){
+                    cout<<"Next page: OOPsFinal list "<<arguments[1]<<" "<<pageSize<<" "<<next<<"\n";
+                }
+            };
+            if(arguments[1] == "vehicles"){
+                print(this->db->vehicles().after(after), vector<const Vehicle *>());
+            }
+            else if(arguments[1] == "users"){
+                print(this->db->users().after(after), vector<const User *>());
+            }
+            else if(arguments[1] == "trips"){
+                print(this->db->trips().after(after), vector<const Trip *>());
+            }
+            else{
+                return this->printUsage();
+            }
+        }
+        else if(command == "day"){
+            if(arguments.size() >= 2 && !isValidDate(arguments[1])){
+                return this->printUsage();
+            }
+            Date day = arguments.size() >= 2 ? Date(arguments[1]) : Date();
+            auto print = [](const string &title, const vector<const Trip *> &trips){
+                cout<<title<<" ("<<trips.size()<<")\n";
+                for(auto trip: trips){
+                    cout<<"  "<<trip->getRecord()<<DELIMETER<<trip->getVehicle().getRegistrationNumber()
+                        <<DELIMETER<<trip->getUser().getName()<<DELIMETER<<trip->getUser().getContact()
+                        <<DELIMETER<<trip->getStartDate().toString()<<DELIMETER<<trip->getEndDate().toString()<<"\n";
+                }
+            };
+            cout<<"Trips on "<<day.toString()<<"\n";
+            print("Pickups", this->db->getTripsStarting(day, day));
+            print("Returns", this->db->getTripsEnding(day, day));
+            print("On the road", this->db->getTripsActiveOn(day));
+        }
+        else if(command == "update" && arguments.size() >= 2){
+            string text;
+            for(size_t i = 1; i < arguments.size(); i++){
+                text += arguments[i] + " ";
+            }
+            size_t changed = this->db->updateWhere(text, max(1u, thread::hardware_concurrency()));
+            this->db->flush().get();
+            cout<<"Updated "<<changed<<" records\n";
+        }
+        else if((command == "query" || command == "explain") && arguments.size() >= 2){
+            string text;
+            for(size_t i = 1; i < arguments.size(); i++){
+                text += arguments[i] + " ";
+            }
+            vector<string> tokens = tokenizeQuery(text);
+            if(command == "explain" && find(tokens.begin(), tokens.end(), "set") != tokens.end()){
+                unique_ptr<Update> update(this->db->compileUpdate(text));
+                cout<<update->explain();
+            }
+            else{
+                Query *query = this->db->compileQuery(text);
+                if(command == "explain"){
+                    cout<<query->explain();
+                }
+                else{
+                    vector<string> columns = query->getColumns();
+                    auto print = [](const vector<string> &row){
+                        for(size_t i = 0; i < row.size(); i++){
+                            cout<<(i ? string(1,DELIMETER) : "")<<row[i];
+                        }
+                        cout<<"\n";
+                    };
+                    print(columns);
+                    query->run(print);
+                }
+                delete query;
+            }
+        }
+        else if(command == "replay-telemetry" && arguments.size() >= 2){
+            this->replayTelemetry(arguments[1],
+                                  arguments.size() >= 3 ? atol(arguments[2].c_str()) : 0,
+                                  arguments.size() >= 4 ? max(1, atoi(arguments[3].c_str())) : 1);
+        }
+        else if(command == "backup" && arguments.size() >= 2){
+            this->db->startBackup(arguments[1]).get();
+            cout<<"Backed up to "<<arguments[1]<<"\n";
+        }
+        else if(command == "bench-async"){
+            long requests = arguments.size() >= 2 ? max(1L, atol(arguments[1].c_str())) : 10000;
+            long clients = arguments.size() >= 3 ? max(1L, atol(arguments[2].c_str())) : 100;
+            this->benchmarkAsync(requests, clients);
+        }
+        else if(command == "replay-workload" && arguments.size() >= 2){
+            vector<WorkloadCall> calls;
+            WorkloadRecorder::read(arguments[1], calls);
+            double speed = arguments.size() >= 3 ? atof(arguments[2].c_str()) : 0;
+            unsigned threads = arguments.size() >= 4 ? max(1, atoi(arguments[3].c_str())) : 1;
+            ReplayReport report = this->db->replayWorkload(calls, speed, threads);
+            this->db->flush().get();
+            cout<<"Calls: "<<report.calls<<" ("<<report.failures<<" failed) in "<<report.seconds<<"s, "
+                <<(long long)(report.calls / max(report.seconds, 1e-9))<<" calls/s\n"
+                <<"Recorded latency:\n";
+            report.recorded.print(cout);
+            cout<<"Replayed latency:\n";
+            report.replayed.print(cout);
+        }
+        else if(command == "follow" && arguments.size() >= 2){
+            this->followerLoop(arguments[1]);
+        }
+        else if(command == "self-check" && arguments.size() >= 2){
+            bool passed = UserStore::selfCheck(arguments[1] + "selfcheck.users.db", cout);
+            if(!Database::selfCheck(arguments[1], cout) || !passed){
+                status = EXIT_FAILURE;
+            }
+        }
+        else{
+            status = this->printUsage();
+        }
+    }
+    catch(Error e){
+        cerr<<e.getMessage()<<"\n";
+        status = EXIT_FAILURE;
+    }
+    this->cleanMemory();
+    return status;
+}
+
+//Answers queries from stdin, one per line, on a replica of the database:
+//  vehicle <registration no>, user <contact no>,
+//  available <start date> <end date> <vehicle type>, sequence and stats
+//  (the availability cache counters)
+void Application::followerLoop(string location) const{
+    LogFollower follower(location);
+    for(string line; getline(cin,line);){
+        stringstream query(line);
+        string kind, first, second, third;
+        query>>kind>>first>>second>>third;
+        follower.query([&](const Database &replica){
+            try{
+                if(kind == "vehicle"){
+                    cout<<replica.getVehicle(first)->toString()<<"\n";
+                }
+                else if(kind == "user"){
+                    cout<<replica.getUser(first)->toString()<<"\n";
+                }
+                else if(kind == "stats"){
+                    CacheStats stats = replica.getAvailabilityCacheStats();
+                    cout<<"hits "<<stats.hits<<" misses "<<stats.misses
+                        <<" invalidations "<<stats.invalidations<<" entries "<<stats.entries<<"\n";
+                }
+                else if(kind == "available"){
+                    for(auto vehicle: replica.getVehicle(Date(first), Date(second), VehicleType(atoi(third.c_str())))){
+                        cout<<vehicle->toString()<<"\n";
+                    }
+                }
+                else if(kind == "sequence"){
+                }
+                else if(kind == "trace"){
+                    Tracer::dumpToFile(first);
+                }
+                else{
+                    cout<<"unknown query\n";
+                }
+            }
+            catch(Error e){
+                cout<<e.getMessage()<<"\n";
+            }
+        });
+        if(kind == "sequence"){
+            cout<<follower.getSequence()<<"\n";
+        }
+        cout<<"."<<endl;
+    }
+}
+
+//Replays recorded telemetry into the database's ingest. The readings are read
+//up front so only the ingest is measured, then split between the producer
+//threads, each keeping its share of the rate.
+void Application::replayTelemetry(string fileName, long rate, int producers) const{
+    ifstream in(fileName);
+    if(!in){
+        throw IOError();
+    }
+    vector<TelemetryReading> readings;
+    for(string line; getline(in,line);){
+        vector<string> fields = split(trimRecord(line),DELIMETER);
+        if(fields.size() != 3){
+            continue;
+        }
+        try{
+            readings.push_back(TelemetryReading{this->db->getVehicle(fields[0])->getRecord(),
+                                                atol(fields[1].c_str()), atoll(fields[2].c_str())});
+        }
+        catch(RecordNotFoundError e){
+            cerr<<"Unknown vehicle "<<fields[0]<<"\n";
+        }
+    }
+
+    TelemetryIngest &telemetry = this->db->getTelemetry();
+    long long before = telemetry.getStats().received;
+    auto started = chrono::steady_clock::now();
+    vector<thread> threads;
+    for(int producer = 0; producer < producers; producer++){
+        threads.push_back(thread([&, producer]{
+            long sent = 0;
+            for(size_t i = producer; i < readings.size(); i += producers, sent++){
+                if(rate > 0){
+                    this_thread::sleep_until(started + chrono::nanoseconds(sent * 1000000000LL * producers / rate));
+                }
+                telemetry.submit(readings[i]);
+            }
+        }));
+    }
+    for(auto &producer: threads){
+        producer.join();
+    }
+    while(telemetry.getStats().received - before < (long long)readings.size()){
+        this_thread::sleep_for(chrono::milliseconds(TELEMETRYBATCHMILLISECONDS));
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    TelemetryStats stats = telemetry.getStats();
+    cout<<"Replayed "<<readings.size()<<" readings in "<<seconds<<"s ("
+        <<(long long)(readings.size() / max(seconds, 1e-9))<<"/s), "
+        <<stats.batches<<" batches, "<<stats.vehicles<<" vehicles\n";
+    this->db->vehicles().forEach([&](const Vehicle &vehicle){
+        long odometer;
+        if(telemetry.getOdometer(vehicle.getRecord(), odometer)){
+            cout<<vehicle.getRegistrationNumber()<<DELIMETER<<odometer<<"\n";
+        }
+    });
+}
+
+//Serves the same mix of vehicle lookups and one-day bookings from one
+//event loop and then with a thread per request, keeping clients requests
+//in flight. Each run books days of its own. It changes the files, so it is
+//meant for a copy of them.
+void Application::benchmarkAsync(long requests, long clients){
+    vector<string> registrations;
+    vector<long> users;
+    this->db->vehicles().forEach([&](const Vehicle &vehicle){
+        registrations.push_back(vehicle.getRegistrationNumber());
+    });
+    this->db->users().forEach([&](const User &user){
+        users.push_back(user.getRecord());
+    });
+    if(registrations.empty() || users.empty()){
+        cout<<"The benchmark needs at least one vehicle and one user\n";
+        return;
+    }
+    long today = Date().getDayNumber();
+    auto bookingFor = [&](long i, long run){
+        Date day = Date::fromDayNumber(today + BENCHMARKFIRSTDAY + run * BENCHMARKDAYS + (i / 2) % BENCHMARKDAYS);
+        return BookingRequest{users[i / 2 % users.size()], day, day, VehicleType(i / 2 % 3 + 1)};
+    };
+    auto report = [&](string name, long long failures, long long booked, double seconds, const LatencyHistogram &latency){
+        cout<<name<<": "<<requests<<" requests ("<<failures<<" failed, "<<booked<<" booked) in "<<seconds<<"s, "
+            <<(long long)(requests / max(seconds, 1e-9))<<" requests/s\n";
+        latency.print(cout);
+    };
+
+    // the answers all run on the loop thread, so its counters need no lock
+    {
+        LatencyHistogram latency;
+        long long failures = 0, booked = 0;
+        atomic<long> next(0);
+        auto started = chrono::steady_clock::now();
+        {
+            // declared first, the answers call it until the loop is done
+            function<void()> issue;
+            AsyncDatabase async(this->db);
+            issue = [&]{
+                long i = next++;
+                if(i >= requests){
+                    return;
+                }
+                auto sent = chrono::steady_clock::now();
+                auto answer = [&, sent](exception_ptr error){
+                    latency.add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sent).count());
+                    failures += error != nullptr;
+                    issue();
+                };
+                if(i % 2 == 0){
+                    async.getVehicleAsync(registrations[i / 2 % registrations.size()], [answer](const Vehicle *, exception_ptr error){
+                        answer(error);
+                    });
+                }
+                else{
+                    async.bookAsync(bookingFor(i, 0), [&, answer](const BookingResult &result, exception_ptr error){
+                        booked += result.vehicle != nullptr;
+                        answer(error);
+                    });
+                }
+            };
+            for(long client = 0; client < clients; client++){
+                issue();
+            }
+        }
+        report("Event loop", failures, booked, chrono::duration<double>(chrono::steady_clock::now() - started).count(), latency);
+    }
+
+    // every request gets a new thread, which waits for the disk itself
+    {
+        LatencyHistogram latency;
+        long long failures = 0, booked = 0;
+        mutex databaseLock, countersLock;
+        vector<thread> slots(clients);
+        auto started = chrono::steady_clock::now();
+        for(long i = 0; i < requests; i++){
+            thread &slot = slots[i % clients];
+            if(slot.joinable()){
+                slot.join();
+            }
+            auto sent = chrono::steady_clock::now();
+            slot = thread([&, i, sent]{
+                bool failed = false, vehicleBooked = false;
+                try{
+                    if(i % 2 == 0){
+                        lock_guard<mutex> guard(databaseLock);
+                        this->db->getVehicle(registrations[i / 2 % registrations.size()]);
+                    }
+                    else{
+                        {
+                            lock_guard<mutex> guard(databaseLock);
+                            vehicleBooked = this->db->bookBatch({bookingFor(i, 1)})[0].vehicle != nullptr;
+                        }
+                        this->db->flush().get();
+                    }
+                }
+                catch(...){
+                    failed = true;
+                }
+                lock_guard<mutex> guard(countersLock);
+                latency.add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sent).count());
+                failures += failed;
+                booked += vehicleBooked;
+            });
+        }
+        for(auto &slot: slots){
+            if(slot.joinable()){
+                slot.join();
+            }
+        }
+        report("Thread per request", failures, booked, chrono::duration<double>(chrono::steady_clock::now() - started).count(), latency);
+    }
+}
+
 void Application::cleanMemory(){
+    if(!this->db){
+        return;
+    }
+    // wait for the background writes so a failure is not lost on exit
+    try{
+        this->db->flush().get();
+    }
+    catch(IOError e){
+        cout<<e.getMessage()<<"\n";
+    }
     delete db;
+    this->db = nullptr;
 }
\ No newline at end of file